@@ -0,0 +1,151 @@
+/*
+    Multithreaded stress benchmark for the file system.
+    Runs each workload with 1, 2, 4, ... threads and reports throughput and speedup over one thread.
+
+    Build: cc -O2 -pthread fs.c bench_fs.c -o bench_fs
+    Usage: ./bench_fs [max_threads] [seconds_per_run]
+*/
+
+#include "fs.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHARED_FILES 1024 // Files in /shared, read by every thread.
+#define FILE_BYTES 4096   // Size of each shared file.
+
+typedef enum { W_LOOKUP, W_WALK, W_READ, W_MIXED } workload_t;
+
+static const char *workload_names[] = { "lookup", "lookup (uncached walk)", "read", "mixed (10% create/write/rm)" };
+
+// Prefix that makes a path too long for the lookup cache, so every lookup walks the tree.
+#define UNCACHED_PREFIX "/shared/./././././././././././././././././././././././././././././././././././././././././."
+
+typedef struct worker {
+    pthread_t thread;
+    int id;
+    workload_t workload;
+    unsigned long ops;
+    int errors;
+} worker_t;
+
+static volatile int stop;
+
+// Small per-thread PRNG (xorshift32).
+static unsigned rnd(unsigned *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    unsigned seed = 2463534242u + (unsigned)w->id * 7919u;
+    char path[128], buf[FILE_BYTES];
+    file_info_t info;
+    unsigned long n = 0, created = 0;
+
+    while (!stop) {
+        unsigned r = rnd(&seed);
+        unsigned k = (r >> 8) % SHARED_FILES;
+        snprintf(path, sizeof(path), "/shared/d%u/f%u", k % 16, k);
+
+        if (w->workload == W_WALK) {
+            snprintf(path, sizeof(path), UNCACHED_PREFIX "/d%u/f%u", k % 16, k);
+            if (get_file_info(path, &info) != 0) w->errors++;
+        } else if (w->workload == W_LOOKUP || (w->workload == W_MIXED && r % 10 < 6)) {
+            if (get_file_info(path, &info) != 0) w->errors++;
+        } else if (w->workload == W_READ || r % 10 < 9) {
+            if (read_file(path, 0, buf, sizeof(buf)) != FILE_BYTES) w->errors++;
+        } else {
+            // Create, write and remove a file in this thread's own directory.
+            snprintf(path, sizeof(path), "/work/t%d/f%lu", w->id, created++);
+            if (create_file(path) != 0) w->errors++;
+            if (write_file(path, 0, buf, 512) != 512) w->errors++;
+            if (rm_file(path) != 0) w->errors++;
+        }
+        n++;
+    }
+    w->ops = n;
+    return NULL;
+}
+
+// Run one workload with nthreads threads for secs seconds; returns operations per second.
+static double run(workload_t wl, int nthreads, double secs, int *errors) {
+    worker_t *ws = calloc((size_t)nthreads, sizeof(*ws));
+    stop = 0;
+    double t0 = now_sec();
+    for (int i = 0; i < nthreads; i++) {
+        ws[i].id = i;
+        ws[i].workload = wl;
+        pthread_create(&ws[i].thread, NULL, worker_main, &ws[i]);
+    }
+    usleep((useconds_t)(secs * 1e6));
+    stop = 1;
+
+    unsigned long total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(ws[i].thread, NULL);
+        total += ws[i].ops;
+        *errors += ws[i].errors;
+    }
+    double elapsed = now_sec() - t0;
+    free(ws);
+    return total / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double secs = argc > 2 ? atof(argv[2]) : 1.0;
+    if (max_threads < 1) max_threads = 1;
+
+    fs_init();
+
+    // Shared tree: /shared/d0..d15, files spread over them by index.
+    char path[64], buf[FILE_BYTES];
+    memset(buf, 'x', sizeof(buf));
+    for (int i = 0; i < SHARED_FILES; i++) {
+        snprintf(path, sizeof(path), "/shared/d%d", i % 16);
+        mkdir_p(path);
+        snprintf(path, sizeof(path), "/shared/d%d/f%d", i % 16, i);
+        create_file(path);
+        write_file(path, 0, buf, sizeof(buf));
+    }
+    for (int i = 0; i < max_threads; i++) {
+        snprintf(path, sizeof(path), "/work/t%d", i);
+        mkdir_p(path);
+    }
+
+    printf("%-30s %8s %14s %8s\n", "workload", "threads", "ops/sec", "speedup");
+    int errors = 0;
+    for (workload_t wl = W_LOOKUP; wl <= W_MIXED; wl++) {
+        double base = 0;
+        for (int t = 1; t <= max_threads; t = t < max_threads && t * 2 > max_threads ? max_threads : t * 2) {
+            double ops = run(wl, t, secs, &errors);
+            if (t == 1) base = ops;
+            printf("%-30s %8d %14.0f %7.2fx\n", workload_names[wl], t, ops, ops / base);
+            if (t == max_threads) break;
+        }
+    }
+
+    // Every worker directory must be empty again, and no operation may have failed.
+    for (int i = 0; i < max_threads; i++) {
+        file_info_t info;
+        snprintf(path, sizeof(path), "/work/t%d", i);
+        if (get_file_info(path, &info) != 0 || info.child_count != 0) errors++;
+    }
+    printf("%s (%d errors)\n", errors ? "FAILED" : "OK", errors);
+
+    fs_destroy();
+    return errors != 0;
+}
@@ -0,0 +1,94 @@
+/*
+    Image benchmark: builds trees of growing size, saves each with fsi_save() and times
+    fsi_load() against rebuilding the same tree through the API, checking the loaded tree.
+    Also times fsi_map() and the first read through the mapped tree, which materializes only
+    the directories on the way.
+
+    Build: cc -O2 -pthread fs.c bench_image.c -o bench_image
+    Usage: ./bench_image [max_nodes] [image_path]
+*/
+
+#include "fs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FANOUT 32 // Subdirectories per directory and files per leaf directory.
+#define FILE_BYTES 100 // Contents of every file (small files stay inline).
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Build a tree of nodes files spread over three levels of directories; returns seconds taken.
+static double build(fs_t *fs, long nodes) {
+    char path[128], buf[FILE_BYTES];
+    memset(buf, 'x', sizeof(buf));
+    double t0 = now_sec();
+    for (long i = 0; i < nodes; i++) {
+        long a = i % FANOUT, b = i / FANOUT % FANOUT, c = i / (FANOUT * FANOUT) % FANOUT;
+        snprintf(path, sizeof(path), "/a%ld/b%ld/c%ld", a, b, c);
+        if (i < FANOUT * FANOUT * FANOUT) fsi_mkdir_p(fs, path);
+        snprintf(path, sizeof(path), "/a%ld/b%ld/c%ld/file%ld", a, b, c, i);
+        fsi_create_file(fs, path);
+        fsi_write_file(fs, path, 0, buf, sizeof(buf));
+    }
+    return now_sec() - t0;
+}
+
+int main(int argc, char **argv) {
+    long max_nodes = argc > 1 ? atol(argv[1]) : 1000000;
+    const char *image = argc > 2 ? argv[2] : "bench_image.img";
+
+    printf("%-10s %9s %9s %9s %9s %12s %9s %12s\n", "files", "image MB", "build s", "save s", "load s", "nodes/s",
+           "map s", "1st read s");
+    int errors = 0;
+    for (long nodes = 1000; nodes <= max_nodes; nodes *= 10) {
+        fs_t *fs = fs_new(), *loaded = fs_new(), *mapped = fs_new();
+        if (!fs || !loaded || !mapped) return 1;
+        double build_s = build(fs, nodes);
+
+        double t0 = now_sec();
+        if (fsi_save(fs, image) != 0) errors++;
+        double save_s = now_sec() - t0;
+        FILE *f = fopen(image, "rb");
+        double mb = 0;
+        if (f) {
+            fseek(f, 0, SEEK_END);
+            mb = ftell(f) / 1e6;
+            fclose(f);
+        }
+
+        t0 = now_sec();
+        if (fsi_load(loaded, image) != 0) errors++;
+        double load_s = now_sec() - t0;
+
+        // Spot-check the loaded tree: the last file exists with its contents.
+        char path[128], buf[FILE_BYTES];
+        long i = nodes - 1;
+        snprintf(path, sizeof(path), "/a%ld/b%ld/c%ld/file%ld", i % FANOUT, i / FANOUT % FANOUT,
+                 i / (FANOUT * FANOUT) % FANOUT, i);
+        if (fsi_read_file(loaded, path, 0, buf, sizeof(buf)) != FILE_BYTES || buf[0] != 'x') errors++;
+
+        // The same file through a mapped image: mapping is constant time, the first read pays for
+        // the directories on its path.
+        t0 = now_sec();
+        if (fsi_map(mapped, image) != 0) errors++;
+        double map_s = now_sec() - t0;
+        t0 = now_sec();
+        if (fsi_read_file(mapped, path, 0, buf, sizeof(buf)) != FILE_BYTES || buf[0] != 'x') errors++;
+        double first_s = now_sec() - t0;
+
+        printf("%-10ld %9.1f %9.3f %9.3f %9.3f %12.0f %9.6f %12.6f\n", nodes, mb, build_s, save_s, load_s,
+               nodes / load_s, map_s, first_s);
+        fs_free(fs);
+        fs_free(loaded);
+        fs_free(mapped);
+    }
+    remove(image);
+    printf("%s (%d errors)\n", errors ? "FAILED" : "OK", errors);
+    return errors != 0;
+}
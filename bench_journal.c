@@ -0,0 +1,108 @@
+/*
+    Journal benchmark: times small writes with the journal off and under each sync policy, with
+    1, 2, 4, ... threads, so the effect of group commit (several changes per fsync) shows up as
+    FS_SYNC_ALWAYS throughput that grows with the number of threads.
+
+    Build: cc -O2 -pthread fs.c bench_journal.c -o bench_journal
+    Usage: ./bench_journal [max_threads] [seconds_per_run] [journal_path]
+*/
+
+#include "fs.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WRITE_BYTES 128 // Size of each logged write.
+
+typedef struct worker {
+    pthread_t thread;
+    int id;
+    unsigned long ops;
+    int errors;
+} worker_t;
+
+static volatile int stop;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    char path[64], buf[WRITE_BYTES] = {0};
+    snprintf(path, sizeof(path), "/work/t%d", w->id);
+    unsigned long n = 0;
+    while (!stop) {
+        if (write_file(path, (n % 64) * WRITE_BYTES, buf, sizeof(buf)) != WRITE_BYTES) w->errors++;
+        n++;
+    }
+    w->ops = n;
+    return NULL;
+}
+
+// Run writers on nthreads threads for secs seconds; returns writes per second.
+static double run(int nthreads, double secs, int *errors) {
+    worker_t *ws = calloc((size_t)nthreads, sizeof(*ws));
+    stop = 0;
+    double t0 = now_sec();
+    for (int i = 0; i < nthreads; i++) {
+        ws[i].id = i;
+        pthread_create(&ws[i].thread, NULL, worker_main, &ws[i]);
+    }
+    usleep((useconds_t)(secs * 1e6));
+    stop = 1;
+
+    unsigned long total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(ws[i].thread, NULL);
+        total += ws[i].ops;
+        *errors += ws[i].errors;
+    }
+    double elapsed = now_sec() - t0;
+    free(ws);
+    return total / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double secs = argc > 2 ? atof(argv[2]) : 1.0;
+    const char *journal = argc > 3 ? argv[3] : "bench_journal.jnl";
+    if (max_threads < 1) max_threads = 1;
+
+    fs_init();
+    char path[64];
+    mkdir_p("/work");
+    for (int i = 0; i < max_threads; i++) {
+        snprintf(path, sizeof(path), "/work/t%d", i);
+        create_file(path);
+    }
+
+    // -1 runs without a journal.
+    const int policies[] = { -1, FS_SYNC_NEVER, FS_SYNC_INTERVAL, FS_SYNC_ALWAYS };
+    const char *names[] = { "no journal", "never", "interval (10 ms)", "always" };
+    printf("%-18s %8s %14s %8s\n", "policy", "threads", "writes/sec", "speedup");
+    int errors = 0;
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        double base = 0;
+        for (int t = 1; t <= max_threads; t = t < max_threads && t * 2 > max_threads ? max_threads : t * 2) {
+            remove(journal);
+            if (policies[p] >= 0 && fs_journal_open(journal, policies[p], 10) != 0) {
+                printf("cannot open journal %s\n", journal);
+                return 1;
+            }
+            double ops = run(t, secs, &errors);
+            if (policies[p] >= 0 && fs_journal_close() != 0) errors++;
+            if (t == 1) base = ops;
+            printf("%-18s %8d %14.0f %7.2fx\n", names[p], t, ops, ops / base);
+            if (t == max_threads) break;
+        }
+    }
+    remove(journal);
+    printf("%s (%d errors)\n", errors ? "FAILED" : "OK", errors);
+    fs_destroy();
+    return errors != 0;
+}
@@ -0,0 +1,93 @@
+/*
+    Search benchmark: times fs_search() over a large tree, walking it serially and with 2, 4, ... worker
+    threads (with the name index turned off), then once more through the name index, and checks that
+    every run reports the same number of matches.
+
+    Build: cc -O2 -pthread fs.c bench_search.c -o bench_search
+    Usage: ./bench_search [max_threads] [nodes]
+*/
+
+#include "fs.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FANOUT 32 // Subdirectories per directory and files per leaf directory.
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run one search with stdout discarded (printing would dominate the time); returns seconds taken.
+static double timed_search(const char *term, int *matches) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    double t0 = now_sec();
+    *matches = fs_search(term);
+    fflush(stdout);
+    double t = now_sec() - t0;
+
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return t;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long nodes = argc > 2 ? atol(argv[2]) : 1000000;
+    if (max_threads < 1) max_threads = 1;
+
+    fs_init();
+
+    // Three levels of FANOUT directories, with the files spread over the leaf directories.
+    char path[128];
+    for (long i = 0; i < nodes; i++) {
+        long a = i % FANOUT, b = i / FANOUT % FANOUT, c = i / (FANOUT * FANOUT) % FANOUT;
+        snprintf(path, sizeof(path), "/a%ld/b%ld/c%ld", a, b, c);
+        if (i < FANOUT * FANOUT * FANOUT) mkdir_p(path);
+        snprintf(path, sizeof(path), "/a%ld/b%ld/c%ld/file%ld", a, b, c, i);
+        create_file(path);
+    }
+    printf("tree: %ld files\n", nodes);
+
+    // A term that matches a small fraction of names, so the run is dominated by the traversal.
+    const char *term = "777";
+    printf("%-8s %10s %10s %8s\n", "threads", "seconds", "matches", "speedup");
+    int errors = 0, expected = -1;
+    double base = 0;
+    fs_set_search_index(0);
+    for (int t = 1; t <= max_threads; t = t < max_threads && t * 2 > max_threads ? max_threads : t * 2) {
+        fs_set_search_threads(t);
+        int matches;
+        timed_search(term, &matches); // Warm up.
+        double secs = timed_search(term, &matches);
+        if (t == 1) {
+            base = secs;
+            expected = matches;
+        }
+        if (matches != expected) errors++;
+        printf("%-8d %10.3f %10d %7.2fx\n", t, secs, matches, base / secs);
+        if (t == max_threads) break;
+    }
+
+    // The same term through the name index, which visits only the candidates.
+    fs_set_search_threads(1);
+    fs_set_search_index(1);
+    int matches;
+    timed_search(term, &matches); // Warm up.
+    double secs = timed_search(term, &matches);
+    if (matches != expected) errors++;
+    printf("%-8s %10.6f %10d %7.2fx\n", "index", secs, matches, base / secs);
+    printf("%s (%d errors)\n", errors ? "FAILED" : "OK", errors);
+
+    fs_destroy();
+    return errors != 0;
+}
@@ -3,656 +3,5171 @@
 */
 #include "fs.h"
 #include <stdio.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// Global root pointer that points to the root directory of the file system tree.
-static node_t *root;
-static node_t *cwd;
+// Concurrency:
+// Every node carries a reader/writer lock. A directory's lock serializes changes to its children;
+// a file's lock guards its contents and size. Operations that only read take the lock shared, so
+// reads never block each other. Path walks take no locks at all: they run inside an epoch read
+// section (see below), probe each directory's hash table while writers may be changing it, and
+// lock only the node they end on. That node may have been removed meanwhile, so once it is locked
+// the walk checks that it is still in the tree (removal clears its parent) and starts over if not.
+// The one exception is a directory still lazily mapped from an image: the first walk to reach it
+// write-locks it while its children are materialized (see dir_ready()).
+// Locks are always taken parent before child:
+//   - Removal write-locks the parent and then the child, so it waits for everyone using the child.
+//   - Working directories and open handles pin their node (refcount). A pinned directory cannot
+//     be removed; a pinned file is not freed until its last handle is closed.
+// Timestamps are also written under shared locks, so they are always stored and loaded atomically.
+#define LK_READ 0  // Shared lock.
+#define LK_WRITE 1 // Exclusive lock.
 
-// Node creation:
-static node_t *node_new(node_type t, const char *name, node_t *parent) {
+// Epoch-based reclamation:
+// A removed node (or a directory's replaced hash table) may still be in use by lock-free walks, so
+// it is retired to the limbo list of the current epoch instead of being freed. Readers count
+// themselves in one of EBR_SLOTS per-thread slots, under the parity of the epoch they entered in;
+// entering and leaving a read section only touches the thread's own cache line. The epoch moves
+// from e to e+1 once no reader of epoch e-1 is left, and whatever was retired in epoch e-1 is
+// freed then: anyone who entered later started after it was unlinked and cannot reach it.
+#define EBR_SLOTS 64 // Reader slots (threads share a slot once there are more threads).
 
-    // Set up basic properties of a node (type, name, and parent).
-    node_t *n = calloc(1, sizeof(*n)); // Allocate memory and set to zero.
-    n->type = t; 
-    n->parent = parent;
-    strncpy(n->name, name, NAME_MAX);
-    
-    // Initialize metadata timestamps.
-    time_t now = time(NULL);
-    n->created = now;
-    n->modified = now;
-    n->accessed = now;
-    n->attributes = ATTR_NONE; // Start with no special attributes.
-    
-    return n;
-}
+// Path lookup (dentry) cache:
+// A direct-mapped cache from (start directory, path) to the node walk_from() resolved it to,
+// including negative entries for paths that did not exist. Rather than tracking which entries
+// a change affects, entries are stamped with a generation number:
+//   - Removing a node can only break positive entries, so it bumps dcache_pos_gen.
+//   - Adding a node can only break negative entries, so it bumps dcache_neg_gen.
+// An entry is valid only while the generation it was filled in is still current.
+// Entries are seqlocks, read without locking: a lookup discards an entry that was rewritten while
+// it was reading it. Like any lock-free lookup, a hit may hand out a node that is being removed;
+// the walk notices once it has the node locked.
+#define DCACHE_SIZE 4096    // Number of cache entries (must be a power of two).
+#define DCACHE_PATH_MAX 96  // Longest path (including terminator) that is cached.
 
-// Initialize the file system by creating the root directory.
-// Also set current working directory to root.
-void fs_init(void) {
-    root = node_new(N_DIR, "", NULL); // Root has empty name and no parent.
-    cwd = root;
-}
+typedef struct dcache_entry {
+    uint32_t seq;                          // Even while stable, odd while being rewritten.
+    uint64_t gen;                          // Generation the entry was filled in (0 = empty).
+    node_t *start;                         // Directory a relative path was resolved from (NULL if absolute).
+    node_t *node;                          // Resolved node, or NULL for a cached miss.
+    uint64_t path[DCACHE_PATH_MAX / 8];    // Path as passed by the caller, zero-padded.
+} dcache_entry_t;
 
-// Node deletion/clean-up:
-// Recursively frees entire tree starting from any given node.
-static void node_free(node_t *n) {
-    
-    // Validate input.
-    if (!n) return;
+// A reader slot: epoch-parity counts of threads inside a read section, and those threads' share
+// of the lookup cache counters. Each slot has its own cache line.
+typedef struct reader_slot {
+    size_t active[2];
+    size_t hits, negative_hits, misses, bypassed;
+} __attribute__((aligned(64))) reader_slot_t;
 
-    // If directory node, recursively free all children first.
-    if (n->type == N_DIR)
-        for (size_t i=0;i<n->child_count;i++) node_free(n->children[i]);
+// A directory's hash table over its children, keyed on name_hash. Tables are replaced (never
+// resized in place) when they fill up, so a lock-free walk always sees a consistent capacity.
+typedef struct dir_table {
+    size_t cap;                      // Number of slots (power of two).
+    struct dir_table *next_retired;  // Next replaced table waiting to be freed.
+    node_t *slots[];                 // Children (NULL = empty, DIR_TOMBSTONE = removed).
+} dir_table_t;
 
-    // For files, free the data buffer.
-    free(n->data);
-    free(n);
-}
+// Open file table:
+// Handles index into a growable array. Free handles are chained through next_free,
+// so opening and closing are O(1) and handle numbers are reused.
+typedef struct open_file {
+    node_t *node;   // Open file node, or NULL if the handle is free.
+    int flags;      // FS_O_* flags the handle was opened with.
+    int next_free;  // Next free handle (only meaningful while node is NULL).
+} open_file_t;
 
-// Clean up the entire file system.
-void fs_destroy(void) { 
+// Node slab allocator:
+// Nodes are carved out of large slabs instead of being malloc'd one at a time. Each node type has
+// its own pool (directory and file nodes differ in size). Freed nodes go onto the pool's free list,
+// chained through their parent pointer, and are handed out again before the slab grows.
+// Tearing down a file system releases whole slabs at once rather than walking the tree.
+#define SLAB_BYTES (256 * 1024) // Size of each slab, including its header.
 
-    // Free nodes starting from root.
-    node_free(root); 
-    root = NULL; 
+typedef struct slab {
+    struct slab *next; // Next (older) slab in the pool.
+    size_t used;       // Nodes handed out from this slab so far (nodes follow the header).
+} slab_t;
 
-    // Make sure to reassign CWD to NULL!
-    cwd = NULL;
-}
+typedef struct node_pool {
+    size_t node_size;    // Bytes per node in this pool.
+    slab_t *slabs;       // All slabs, newest first.
+    node_t *free_list;   // Freed nodes waiting for reuse.
+    pthread_mutex_t lock; // Guards slabs and free_list.
+} node_pool_t;
 
-// Directory management helper functions:
-// Add a child to a directory.
-static node_t *dir_add(node_t *dir, node_t *child) {
+// Name index types (see "Name index" below).
+#define NIDX_STRIPES 64 // Lock stripes; a trigram's stripe comes from the top bits of its hash.
 
-    // Validate that passed in directory is not null, that the node is a directory, and the directory is not full.
-    if (!dir || dir->type!=N_DIR || dir->child_count>=MAX_CHILDREN) return NULL;
+typedef struct posting_entry {
+    uint64_t ino; // Node number (lists are sorted by it).
+    node_t *node; // NULL once the node was removed (a tombstone).
+} posting_entry_t;
 
-    // Validate the child pointer is not null.
-    if (!child) return NULL;
+typedef struct posting {
+    uint32_t tri; // Trigram, packed as three bytes (0 marks an unused slot).
+    size_t n, cap, dead; // Entries, allocated length, and tombstones among the entries.
+    posting_entry_t *entries;
+} posting_t;
 
-    // Prevent attaching a node that already belongs to another directory.
-    if (child->parent && child->parent != dir) return NULL;
+typedef struct nidx_stripe {
+    pthread_rwlock_t lock;
+    posting_t *lists; // Open-addressing table of posting lists, keyed by trigram.
+    size_t cap, used;
+} __attribute__((aligned(64))) nidx_stripe_t;
 
-    // Prevent adding the same child twice.
-    for (size_t i = 0; i < dir->child_count; i++) {
-        if (dir->children[i] == child) {
-            return dir->children[i];
-        }
-    }
-    // Put the child into the children array of the directory and increment the counter.
-    dir->children[dir->child_count++] = child;
+// Image format:
+// fs_save() writes the whole tree to a file that fs_load() reads back in one sequential read:
+//   header | names | file data | node table
+// The node table has one fixed-size record per node, in breadth-first order with root first, so
+// the children of a directory are one contiguous run of records (first .. first+count). Loading
+// therefore needs no name lookups to rebuild the tree, and every node can be allocated up front.
+// A file's data is an extent table (chunk index, length, offset in the image) followed by the
+// bytes; holes are not stored, and storage reserved past end-of-file (fs_fallocate()) is not kept.
+// Integers are stored in the byte order of the host that wrote the image; tables start 8-byte
+// aligned. The format is versioned, and an image of another version or byte order is rejected.
+// fs_map() uses the same format in place: see "Lazily mapped directories" below. Delta images
+// (fs_export_delta()) use it too, under their own magic so they are never loaded as a whole tree.
+#define FS_IMAGE_MAGIC "CS149FS" // Eight bytes, including the terminator.
+#define FS_DELTA_MAGIC "CS149FD"
+#define FS_IMAGE_VERSION 1
+#define FS_IMAGE_ORDER 0x01020304u // Reads back differently on a host of the other byte order.
 
-    // Set the child's parent pointer to point back to dir (tree is bidirectional).
-    child->parent = dir;
+typedef struct image_header {
+    char magic[8];        // FS_IMAGE_MAGIC.
+    uint32_t version;     // FS_IMAGE_VERSION.
+    uint32_t order;       // FS_IMAGE_ORDER.
+    uint64_t size;        // Total bytes in the image (catches truncated files).
+    uint64_t node_count;  // Records in the node table (at least one: root).
+    uint64_t nodes_off;   // Offset of the node table.
+    uint64_t next_ino;    // Last node number handed out.
+} image_header_t;
 
-    // Update directory metadata.
-    dir->modified = dir->accessed = time(NULL);
+typedef struct image_node {
+    uint64_t ino;
+    uint64_t first;     // Directories: record of the first child. Files: offset of the extent table.
+    uint64_t count;     // Directories: number of children. Files: number of extents.
+    uint64_t size;      // Files: size in bytes.
+    uint64_t name_off;  // Offset of the name (name_len bytes, not terminated).
+    int64_t created, modified, accessed;
+    uint32_t type;      // N_DIR or N_FILE.
+    uint8_t attributes;
+    uint8_t name_len;
+    uint16_t flags;     // IMAGE_* flags.
+} image_node_t;
 
-    return child;
-}
+#define IMAGE_DIRTY 0x1 // Directories: a descendant may have the archive bit set (see node_archive()).
+#define IMAGE_KEEP 0x2  // Delta images only: the node itself is unchanged (see fsi_export_delta()).
+#define IMAGE_GONE 0x4  // Delta images only: the name was removed from the directory (just name and type).
 
-// Find a child by name in directory.
-static node_t *dir_find(node_t *dir, const char *name) {
+// A node removed since the last backup, for the next delta to remove it too (see node_gone()).
+typedef struct delta_gone {
+    uint64_t dir; // Node number of the directory it was removed from.
+    node_type type;
+    char name[NAME_MAX + 1];
+} delta_gone_t;
 
-    // Validate that passed in node is a directory.
-    if (!dir || dir->type!=N_DIR) return NULL;
+typedef struct image_extent {
+    uint64_t index;  // Chunk number.
+    uint64_t len;    // Bytes stored (up to the chunk's end or end-of-file, whichever is first).
+    uint64_t off;    // Offset of the bytes in the image.
+} image_extent_t;
 
-    // Use linear search through children array.
-    for (size_t i=0;i<dir->child_count;i++) {
-        if (strncmp(dir->children[i]->name, name, NAME_MAX)==0) {
-            return dir->children[i];
-        } 
-    }
+// Journal (see fs.h):
+// A change is logged while the node it changed is still locked, so changes that depend on each other
+// are logged in the order they were made. Logging only appends to a buffer in memory; once the node
+// is unlocked, journal_commit() gets the record to the file. Whoever finds no write in progress takes
+// the whole buffer (every record appended so far, by any thread) and writes it with one write(2) and,
+// under FS_SYNC_ALWAYS, one fdatasync(); everyone else waits for that write if it covers their
+// record, or takes the next one. Under load one fsync so covers many changes (group commit).
+// The file is a journal_header_t followed by records: a journal_record_t, the path it applies to
+// (terminated), then the data written, if any. Records are checksummed, so one torn by a crash is
+// recognized and ends the log.
+#define FS_JOURNAL_MAGIC "CS149JL" // Eight bytes, including the terminator.
+#define FS_JOURNAL_VERSION 1
 
-    return NULL;
-}
+typedef struct journal_header {
+    char magic[8];     // FS_JOURNAL_MAGIC.
+    uint32_t version;  // FS_JOURNAL_VERSION.
+    uint32_t order;    // FS_IMAGE_ORDER.
+} journal_header_t;
 
-// Build full path for a node into buffer (including leading '/').
-static void node_get_path(node_t *n, char *buf, size_t bufsize) {
-    if (!n || !buf || bufsize == 0) {
-        return;
-    }
+// Logged operations.
+enum { JOP_MKDIR = 1, JOP_CREATE, JOP_WRITE, JOP_RM, JOP_RMDIR, JOP_ATTR, JOP_TOUCH, JOP_TRUNCATE, JOP_FALLOCATE };
 
-    // case when just "/"
-    if (n == root) {
-        if (bufsize > 1) {
-            buf[0] = '/';
-            buf[1] = '\0';
-        } else {
-            buf[0] = '\0';
-        }
-        return;
-    }
+typedef struct journal_record {
+    uint64_t len;       // Bytes in the record, this header included.
+    uint32_t sum;       // FNV-1a over the whole record, computed with this field zero.
+    uint32_t path_len;  // Bytes of path following the header, terminator included.
+    int64_t time;       // When the change was made.
+    uint64_t a, b;      // WRITE and FALLOCATE: offset and length. TRUNCATE: new size.
+    uint8_t op;         // JOP_*.
+    uint8_t attributes; // ATTR: the new attributes.
+    uint8_t pad[6];
+} journal_record_t;
 
-    // Collect segments by walking up to root
-    const char *segments[64];
-    size_t count = 0;
+typedef struct journal {
+    int fd;                   // Log file, positioned at its end.
+    char *path;               // Its name (checkpoints replace the file).
+    int policy;               // FS_SYNC_*.
+    int interval_ms;          // FS_SYNC_INTERVAL: time between fsyncs.
+    pthread_t flusher;        // FS_SYNC_INTERVAL: thread doing the fsyncs.
+    pthread_mutex_t lock;     // Guards everything below.
+    pthread_cond_t cond;      // Broadcast when a write finishes or the flusher should stop.
+    uint8_t *buf;             // Records appended but not written yet.
+    size_t len, cap;
+    uint8_t *wbuf;            // Buffer being written (owned by the writer while busy).
+    size_t wcap;
+    uint64_t appended;        // Records appended (the last one's sequence number).
+    uint64_t written;         // Records written to the file.
+    uint64_t synced;          // Records known to be on disk.
+    uint64_t size;            // Bytes in the file.
+    int busy;                 // A write is in progress (with the lock dropped).
+    int failed;               // Logging failed: later changes are not logged.
+    int stop;                 // Tells the flusher to exit.
+} journal_t;
 
-    node_t *cur = n;
-    while (cur && cur != root && count < 64) {
-        segments[count++] = cur->name;
-        cur = cur->parent;
-    }
+// Snapshots:
+// A snapshot is a generation number. fs_snapshot() bumps fs->snap_gen, and snapshot k sees, of every
+// node, the newest state made in a generation before k; each state records the generation it was
+// made in. That lives in a node_snap_t the node points to, allocated the first time the node needs a
+// generation other than 0, so nodes no snapshot ever saw change carry no more than a null pointer.
+// Before a writer first changes a node whose state an open snapshot can see,
+// node_cow() pushes a frozen copy of that state onto the node's versions list: directories copy
+// their children array and table, files their extent array, taking a reference on each chunk
+// instead of copying data. Frozen copies never change, so snapshot reads use them without locks; a
+// live node is read under its lock, once it is known not to have changed since the snapshot. A
+// removed node that a snapshot may still reach waits as a zombie instead of being retired.
+// Releasing a snapshot prunes the versions and zombies no open snapshot can see any more, retiring
+// them through EBR like anything else lock-free readers may be inside.
+struct fs_snapshot {
+    fs_t *fs;    // Instance the snapshot is of.
+    uint64_t id; // Its generation: it sees states made before it.
+};
 
-    size_t pos = 0;
+// The snapshot state of a node (node->snap).
+typedef struct node_snap {
+    uint64_t gen; // Generation the node's current state was made in.
+    uint64_t born; // Generation the node was created in.
+    node_t *versions; // Earlier states still visible to a snapshot, newest first. Each has its own node_snap_t.
+} node_snap_t;
 
-    // Leading slash
-    if (pos < bufsize - 1) {
-        buf[pos++] = '/';
-    }
+typedef struct snap_zombie {
+    node_t *node; // Removed node.
+    uint64_t died; // Generation it was removed in (snapshots after it cannot see it).
+} snap_zombie_t;
 
-    // Append segments in reverse (from closest to root)
-    for (size_t i = 0; i < count && pos < bufsize - 1; i++) {
-        const char *name = segments[count - 1 - i];
-        size_t len = strlen(name);
+// Session:
+// A client's view of an instance: its working directory, which relative paths resolve against.
+struct fs_session {
+    fs_t *fs; // Instance the session belongs to.
+    node_t *cwd; // Current working directory. It is pinned, and swapped atomically by fss_cd().
+};
 
+// File system instance:
+// Everything a file system owns lives here, so separate instances share no state and no locks.
+// The original API (mkdir_p(), read_file(), ...) operates on default_fs.
+struct fs {
+    node_t *root; // Root directory of the tree.
+    fs_session_t session; // Built-in session used by the fsi_* functions.
 
-        // Truncate if necessary
-        if (pos + len >= bufsize - 1) {
-            len = (bufsize - 1) - pos;
-        }
+    // Path lookup cache (see above).
+    dcache_entry_t *dcache;
+    uint64_t dcache_pos_gen;
+    uint64_t dcache_neg_gen;
+    size_t dcache_invalidations;
 
-        memcpy(buf + pos, name, len);
-        pos += len;
+    // Open file table (see above).
+    open_file_t *open_files;
+    int open_cap;
+    int open_free;
+    pthread_mutex_t open_lock; // Guards the table (not the files).
 
-        if (i + 1 < count && pos < bufsize - 1) {
-            buf[pos++] = '/';
-        }
-    }
-    buf[pos] = '\0';
-}
+    int search_threads; // Workers fss_search() uses (1 = serial search).
+    int search_index; // Whether searches may use the name index (0 = always walk the tree).
+    uint64_t next_ino; // Last node number handed out.
+    int nidx_broken; // Set if the name index missed an update (searches then walk the tree).
 
+    // Mapped image (see fs_map()), NULL if none.
+    const uint8_t *map;
+    size_t map_size;
+    size_t lazy_dirs; // Directories not materialized yet (searches walk the tree until it is 0).
 
-// Recursive helper: search subtree rooted at `n` for names containing `term`.
-// Prints full paths of matches. Returns number of matches.
-static int search_subtree(node_t *n, const char *term) {
-    if (!n || !term || term[0] == '\0') return 0;
+    journal_t *journal; // Open journal (see fs_journal_open()), NULL if none.
 
-    int matches = 0;
+    // Removals the next delta must hold (see node_gone()).
+    pthread_mutex_t gone_lock; // Guards the log.
+    delta_gone_t *gone;
+    size_t ngone, gone_cap;
+    uint64_t backup_ino; // Nodes numbered up to this may be in a saved image or delta.
+    int backups; // Saves and exports running.
 
-    // Visiting this node counts as an access.
-    n->accessed = time(NULL);
+    // Snapshots (see above).
+    uint64_t snap_gen; // Snapshots taken so far: the generation changes are made in.
+    uint64_t snap_newest; // Newest open snapshot's id, 0 if none.
+    pthread_mutex_t snap_lock; // Guards the lists below and taking snapshots.
+    pthread_mutex_t snap_gc_lock; // Serializes pruning after releases.
+    uint64_t *snaps; // Ids of the open snapshots, ascending.
+    size_t nsnaps, snaps_cap;
+    node_t **versioned; // Nodes with frozen versions.
+    size_t nversioned, versioned_cap;
+    snap_zombie_t *zombies; // Removed nodes a snapshot may still see.
+    size_t nzombies, zombies_cap;
 
-    // Skip root's empty name when matching.
-    if (n != root && strstr(n->name, term) != NULL) {
-        char path[1024];
-        node_get_path(n, path, sizeof(path));
-        printf("%s%s\n", path, n->type == N_DIR ? "/" : "");
-        matches++;
-    }
+    // Node pools, one per node type.
+    node_pool_t dir_pool;
+    node_pool_t file_pool;
 
-    // Recurse into children if this is a directory.
-    if (n->type == N_DIR) {
-        for (size_t i = 0; i < n->child_count; i++) {
-            matches += search_subtree(n->children[i], term);
-        }
-    }
+    // Epoch-based reclamation (see above).
+    uint64_t epoch;
+    pthread_mutex_t retire_lock; // Guards the limbo lists and advancing the epoch.
+    node_t *limbo_nodes[3]; // Removed nodes, by the epoch (mod 3) they were retired in.
+    dir_table_t *limbo_tables[3]; // Replaced directory tables, likewise.
+    reader_slot_t readers[EBR_SLOTS]; // Reader slots (cache-line aligned).
+    nidx_stripe_t nidx[NIDX_STRIPES]; // Name index (cache-line aligned).
+};
 
-    return matches;
-}
+static fs_t default_fs;
 
-static node_t *walk_from(node_t *start,
-                         const char *path,
-                         int want_parent,
-                         char out_leaf[NAME_MAX+1]) {
-    if (!path) return NULL;
+// Marks a slot in a directory's hash table whose child was removed.
+// Lookups probe past it; inserts may reuse it.
+#define DIR_TOMBSTONE ((node_t *)(uintptr_t)1)
 
-    int absolute = (path[0] == '/');
-    node_t *cur = absolute ? root : (start ? start : root);
+// Initial number of slots in a directory's hash table (must be a power of two).
+#define DIR_MIN_SLOTS 8
 
-    char tmp[1024];
-    strncpy(tmp, path, sizeof(tmp));
-    tmp[sizeof(tmp)-1] = 0;
+// FNV-1a hash over the first len bytes of a node name, cached in node->name_hash.
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
 
-    char *save = NULL;
-    char *tok  = strtok_r(tmp, "/", &save);
-    char *next = strtok_r(NULL, "/", &save);
+// Nodes are allocated by the million, so their sizes are pinned down here: a field added to the
+// header or a payload has to fit or move out (as snapshot state did, see node_snap_t). The lock's
+// size is the platform's; the rest is counted in bytes (sizes for x86-64 Linux).
+_Static_assert(sizeof(node_t) <= 104 + sizeof(pthread_rwlock_t), "node_t header grew");
+_Static_assert(sizeof(dir_node_t) <= 160 + sizeof(pthread_rwlock_t), "dir_node_t grew");
+_Static_assert(sizeof(file_node_t) <= 200 + sizeof(pthread_rwlock_t), "file_node_t grew");
 
-    // Case: path is just "/" or ""
-    if (!tok) {
-        return want_parent ? cur : cur;
-    }
+// Typed views of a node's payload (callers check n->type first).
+static dir_node_t *as_dir(node_t *n) { return (dir_node_t *)n; }
+static file_node_t *as_file(node_t *n) { return (file_node_t *)n; }
 
-    while (tok) {
-        if (strlen(tok) == 0 || strlen(tok) > NAME_MAX) return NULL;
+// A node's snapshot state (see "Snapshots" below), read without its lock: node->snap, once set,
+// stays until the node is freed. A node without one is of generation 0 and has no versions.
+static uint64_t node_gen(const node_t *n) {
+    node_snap_t *s = __atomic_load_n(&n->snap, __ATOMIC_ACQUIRE);
+    return s ? __atomic_load_n(&s->gen, __ATOMIC_SEQ_CST) : 0;
+}
 
-        if (strcmp(tok, ".") == 0) {
-            // stay in cur
-        } else if (strcmp(tok, "..") == 0) {
-            if (cur->parent) cur = cur->parent; // root stays at root
-        } else if (!next) {
-            // last component
-            if (want_parent) {
-                if (out_leaf) {
-                    strncpy(out_leaf, tok, NAME_MAX);
-                    out_leaf[NAME_MAX] = '\0';
-                }
-                return cur;
-            }
-            return dir_find(cur, tok);
-        } else {
-            // middle component: must be a directory we can descend into
-            cur = dir_find(cur, tok);
-            if (!cur || cur->type != N_DIR) return NULL;
-        }
+static uint64_t node_born(const node_t *n) {
+    node_snap_t *s = __atomic_load_n(&n->snap, __ATOMIC_ACQUIRE);
+    return s ? s->born : 0;
+}
 
-        tok  = next;
-        next = strtok_r(NULL, "/", &save);
-    }
+static node_t *node_versions(const node_t *n) {
+    node_snap_t *s = __atomic_load_n(&n->snap, __ATOMIC_ACQUIRE);
+    return s ? __atomic_load_n(&s->versions, __ATOMIC_ACQUIRE) : NULL;
+}
 
-    // if we consumed everything cleanly and there was no special last component
-    return want_parent ? cur : cur;
+// Node locking (see "Concurrency" above).
+static void node_lock(node_t *n, int mode) {
+    if (mode == LK_WRITE) pthread_rwlock_wrlock(&n->lock);
+    else pthread_rwlock_rdlock(&n->lock);
 }
 
-int fs_cd(const char *path) {
-    node_t *d = walk_from(cwd, path, 0, NULL);
-    if (!d || d->type != N_DIR) return -1;
-    cwd = d;
-    
-    // Update access time since we accessed the directory.
-    d->accessed = time(NULL);
-    
-    return 0;
+static void node_unlock(node_t *n) {
+    pthread_rwlock_unlock(&n->lock);
 }
 
-static node_t *walk(const char *path, int want_parent, char out_leaf[NAME_MAX+1]) {
-    return walk_from(cwd, path, want_parent, out_leaf);
+// Pins keep a node from being freed (files) or removed (directories) while it is not locked.
+static void node_pin(node_t *n) {
+    __atomic_add_fetch(&n->refcount, 1, __ATOMIC_ACQ_REL);
 }
 
-int mkdir_p(const char *path) {
-    if (!path) return -1;
-    if (strcmp(path, "/") == 0 || strcmp(path, "") == 0) return 0;
+static void node_unpin(node_t *n) {
+    __atomic_sub_fetch(&n->refcount, 1, __ATOMIC_ACQ_REL);
+}
 
-    int absolute = (path[0] == '/');
-    node_t *cur  = absolute ? root : cwd;
+// A node's parent, as seen by a lock-free walk (NULL for root and for removed nodes).
+static node_t *node_parent(node_t *n) {
+    return __atomic_load_n(&n->parent, __ATOMIC_ACQUIRE);
+}
 
-    char tmp[1024];
-    strncpy(tmp, path, sizeof(tmp));
-    tmp[sizeof(tmp)-1] = 0;
+// Whether a node is still in the tree. Callers hold its lock, so the answer cannot change.
+static int node_linked(fs_t *fs, node_t *n) {
+    return n == fs->root || node_parent(n) != NULL;
+}
 
-    char *save = NULL;
-    char *tok  = strtok_r(tmp, "/", &save);
+// Incremental backup:
+// A change to a node sets its archive bit, and flags every directory above it as having a changed
+// descendant, so fs_export_delta() only has to descend into flagged directories. The flags are
+// set bottom-up and stop at the first directory already flagged; the export clears a flag before
+// it looks below it. Both sides use sequentially consistent atomics, so a change racing with an
+// export is either seen by it or leaves its flags set for the next one. The archive bit is only
+// ever changed atomically, since touch_file() sets it under a shared lock.
 
-    // Case: just "/" or "//"
-    if (!tok) return 0;
+// Record that n changed since the last backup. Called with n (or, for a node being added or
+// removed, its parent) locked, which keeps every directory above it in the tree.
+static void node_archive(node_t *n) {
+    __atomic_or_fetch(&n->attributes, ATTR_ARCHIVE, __ATOMIC_SEQ_CST);
+    for (node_t *p = node_parent(n); p && !__atomic_load_n(&as_dir(p)->dirty, __ATOMIC_SEQ_CST); p = node_parent(p)) {
+        __atomic_store_n(&as_dir(p)->dirty, 1, __ATOMIC_SEQ_CST);
+    }
+}
 
-    while (tok) {
-        if (strlen(tok) == 0 || strlen(tok) > NAME_MAX) return -1;
+// Enter a read section (see "Epoch-based reclamation" above). Nothing retired after this may be
+// freed until the matching ebr_exit(). Returns the thread's slot; *parity is needed to leave.
+static reader_slot_t *ebr_enter(fs_t *fs, unsigned *parity) {
+    static unsigned next_id;
+    static __thread unsigned id; // 0 until the thread first reads.
+    if (!id) id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    reader_slot_t *r = &fs->readers[id % EBR_SLOTS];
 
-        if (strcmp(tok, ".") == 0) {
-            // stay
-        } else if (strcmp(tok, "..") == 0) {
-            if (cur->parent) cur = cur->parent;
-        } else {
-            // normal directory name
-            node_t *n = dir_find(cur, tok);
-            if (!n) {
-                n = node_new(N_DIR, tok, cur);
-                if (!dir_add(cur, n)) return -1;
-            } else if (n->type != N_DIR) {
-                // trying to mkdir where a file already exists
-                return -1;
-            } else {
-                // Update accessed time when traversing through existing directory.
-                n->accessed = time(NULL);
-            }
-            cur = n;
+    // Count ourselves under the epoch we saw; if it moved on meanwhile, the advance may have
+    // missed us, so count again under the new one.
+    for (;;) {
+        uint64_t e = __atomic_load_n(&fs->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&r->active[e & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&fs->epoch, __ATOMIC_SEQ_CST) == e) {
+            *parity = e & 1;
+            return r;
         }
-
-        tok = strtok_r(NULL, "/", &save);
+        __atomic_sub_fetch(&r->active[e & 1], 1, __ATOMIC_SEQ_CST);
     }
+}
 
-    return 0;
+static void ebr_exit(reader_slot_t *r, unsigned parity) {
+    __atomic_sub_fetch(&r->active[parity], 1, __ATOMIC_RELEASE);
 }
 
-// Implements empty file creation in file system.
-int create_file(const char *path) {
+// Timestamps are written under shared locks too, so they are stored and loaded atomically.
+static void stamp(time_t *t, time_t now) {
+    __atomic_store_n(t, now, __ATOMIC_RELAXED);
+}
 
-    // Parse path for file creation using leaf buffer (stores the filename, which is the last component of the path).
-    char leaf[NAME_MAX + 1] = {0};
+static time_t stamp_get(const time_t *t) {
+    return __atomic_load_n(t, __ATOMIC_RELAXED);
+}
 
-    // Use want_parent = 1 to get the parent directory. 
-    // For example, for "/documents/myfile.txt", returns "documents/" and puts "myfile.txt" in leaf.
-    node_t *parent = walk(path, 1, leaf);
+// Take a node from a pool (the caller holds its lock and zeroes the node), reusing a freed node
+// if there is one.
+static node_t *pool_take(node_pool_t *p) {
+    node_t *n = p->free_list;
+    if (n) {
+        p->free_list = n->parent;
+        return n;
+    }
 
-    // Validate that the parent exists and it is a directory node.
-    if (!parent || parent->type!=N_DIR) return -1;
+    // Carve the next node from the newest slab, starting a new slab when it is full.
+    size_t per_slab = (SLAB_BYTES - sizeof(slab_t)) / p->node_size;
+    slab_t *s = p->slabs;
+    if (!s || s->used == per_slab) {
+        s = malloc(SLAB_BYTES);
+        if (!s) return NULL;
+        s->next = p->slabs;
+        s->used = 0;
+        p->slabs = s;
+    }
+    return (node_t *)((uint8_t *)(s + 1) + s->used++ * p->node_size);
+}
 
-    // Validate leaf before creation (some of these are already checked by shell.c and other fs.c functions, but we want to make our program more robust).
-    if (leaf[0] == '\0') return -1; // Don't want to create files with empty names.
-    if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) return -1; // Prevent "." and ".." as file names.
-    if (strlen(leaf) > NAME_MAX) return -1; // Prevent names that are too long.
+// Take a zeroed node from a pool.
+static node_t *pool_alloc(node_pool_t *p) {
+    pthread_mutex_lock(&p->lock);
+    node_t *n = pool_take(p);
+    pthread_mutex_unlock(&p->lock);
+    if (n) memset(n, 0, p->node_size);
+    return n;
+}
 
-    // Prevent duplicate file creation so that we don't overwrite.
-    if (dir_find(parent, leaf)) return -1;
+// Take count zeroed nodes from a pool into out[] under one lock round trip (used by fs_load()).
+// On failure the nodes already taken go back on the free list, so nothing is taken.
+static int pool_alloc_many(node_pool_t *p, size_t count, node_t **out) {
+    pthread_mutex_lock(&p->lock);
+    for (size_t i = 0; i < count; i++) {
+        out[i] = pool_take(p);
+        if (!out[i]) {
+            while (i--) {
+                out[i]->type = 0;
+                out[i]->parent = p->free_list;
+                p->free_list = out[i];
+            }
+            pthread_mutex_unlock(&p->lock);
+            return -1;
+        }
+        memset(out[i], 0, p->node_size);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
 
-    // Prevent file creation if parent directory is READ_ONLY.
-    if (parent->attributes & ATTR_READONLY) return -1;
+// Return a node to its pool. A zero type marks the slot as free for pool_destroy().
+static void pool_free(node_pool_t *p, node_t *n) {
+    n->type = 0;
+    pthread_mutex_lock(&p->lock);
+    n->parent = p->free_list;
+    p->free_list = n;
+    pthread_mutex_unlock(&p->lock);
+}
 
-    // Create file node.
-    node_t *f = node_new(N_FILE, leaf, parent);
-    if (!dir_add(parent, f)) {
-        node_free(f);
-        return -1;
+// Release a pool in bulk: release() frees the payload of every node still in use, then each
+// slab is freed whole.
+static void pool_destroy(node_pool_t *p, void (*release)(node_t *)) {
+    slab_t *s = p->slabs;
+    while (s) {
+        slab_t *next = s->next;
+        for (size_t i = 0; i < s->used; i++) {
+            node_t *n = (node_t *)((uint8_t *)(s + 1) + i * p->node_size);
+            if (n->type) release(n);
+        }
+        free(s);
+        s = next;
     }
+    p->slabs = NULL;
+    p->free_list = NULL;
+}
 
-    // Though file metadata is handled by node_new(), we need to update the parent directory metadata.
+// Node creation:
+// name does not need to be null-terminated; len (at most NAME_MAX) gives its length.
+static node_t *node_new(fs_t *fs, node_type t, const char *name, size_t len, node_t *parent) {
+
+    // Set up basic properties of a node (type, name, and parent).
+    // Allocate (and zero) only as much as this node type needs, from that type's pool.
+    node_t *n = pool_alloc(t == N_DIR ? &fs->dir_pool : &fs->file_pool);
+    if (!n) return NULL;
+    n->type = t; 
+    n->parent = parent;
+    memcpy(n->name, name, len); // pool_alloc() already null-terminated the name.
+    n->name_hash = name_hash(n->name, len);
+    n->ino = __atomic_add_fetch(&fs->next_ino, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_init(&n->lock, NULL);
+    
+    // Initialize metadata timestamps.
     time_t now = time(NULL);
-    parent->modified = parent->accessed = now;
+    n->created = now;
+    n->modified = now;
+    n->accessed = now;
+    n->attributes = ATTR_ARCHIVE; // No special attributes, but new since the last backup.
 
-    // Return result.
-    return 0;
+    // A new node belongs to the state of its parent it is added to (see node_cow()). Without an
+    // open snapshot, generation 0 compares the same to every later one.
+    uint64_t gen = parent && __atomic_load_n(&fs->snap_newest, __ATOMIC_SEQ_CST) ? node_gen(parent) : 0;
+    if (gen) {
+        n->snap = malloc(sizeof(*n->snap));
+        if (!n->snap) {
+            pthread_rwlock_destroy(&n->lock);
+            pool_free(t == N_DIR ? &fs->dir_pool : &fs->file_pool, n);
+            return NULL;
+        }
+        *n->snap = (node_snap_t){ .gen = gen, .born = gen };
+    }
+    
+    return n;
 }
 
-// Implements dynamic memory management to handle growing file storage as per needs.
-static int ensure_cap(node_t *f, size_t want) {
-
-    // Check if we need to grow file size (early exits if we already have enough capacity).
-    if (f->cap >= want) return 0;
-
-    // Calculate new capacity otherwise:
-    size_t newcap = f->cap ? f->cap : 64; // Start with initial capacity of 64 bytes if file has no capacity yet.
-    while (newcap < want) newcap *= 2; // Double space until we have sufficient storage capacity.
-    uint8_t *p = realloc(f->data, newcap); // Reallocate memory using realloc() while preserving existing data by copying old content to new location if necessary. This also frees old memory.
-    if (!p) return -1; // Error handling if allocation fails (out of memory).
-
-    // Zero new memory region:
-    // Initialize new bytes to zero.
-    // p + f->cap: points to the start of the new memory region.
-    // newcap - f->cap: the size of the new region to zero.
-    if (newcap > f->cap) memset(p + f->cap, 0, newcap - f->cap);
-
-    // Update file structure:
-    f->data = p; // Update data pointer to new memory location.
-    f->cap = newcap; // Update capacity to reflect new size.
-    return 0; 
+// Start a session in the root directory of fs.
+static void session_setup(fs_session_t *ss, fs_t *fs) {
+    ss->fs = fs;
+    ss->cwd = fs->root;
+    node_pin(ss->cwd);
 }
 
-// Implementats file write operation at a specific offset.
-// path: file path.
-// off: byte offset indicating where to start writing.
-// buf: pointer to data to write.
-// len: number of bytes to write.
-ssize_t write_file(const char *path, size_t off, const void *buf, size_t len) {
+// Initialize a file system instance by creating the root directory.
+// Also set current working directory to root.
+static int fs_setup(fs_t *fs) {
+    memset(fs, 0, sizeof(*fs));
+    pthread_mutex_init(&fs->open_lock, NULL);
+    fs->open_free = -1;
+    fs->dir_pool.node_size = sizeof(dir_node_t);
+    fs->file_pool.node_size = sizeof(file_node_t);
+    pthread_mutex_init(&fs->dir_pool.lock, NULL);
+    pthread_mutex_init(&fs->file_pool.lock, NULL);
+    pthread_mutex_init(&fs->retire_lock, NULL);
+    pthread_mutex_init(&fs->snap_lock, NULL);
+    pthread_mutex_init(&fs->snap_gc_lock, NULL);
+    pthread_mutex_init(&fs->gone_lock, NULL);
+    for (size_t i = 0; i < NIDX_STRIPES; i++) pthread_rwlock_init(&fs->nidx[i].lock, NULL);
+    fs->search_threads = 1;
+    fs->search_index = 1;
 
-    // Find the file to write to using walk() & want_parent = 0, which will return actual file node.
-    node_t *f = walk(path, 0, NULL);
+    fs->root = node_new(fs, N_DIR, "", 0, NULL); // Root has empty name and no parent.
+    if (!fs->root) return -1;
+    session_setup(&fs->session, fs);
 
-    // Validate that the file exists and is not a directory.
-    if (!f || f->type!=N_FILE) return -1;
+    // Start with an empty lookup cache (lookups still work uncached if this fails).
+    fs->dcache = calloc(DCACHE_SIZE, sizeof(*fs->dcache));
+    fs->dcache_pos_gen = 1;
+    fs->dcache_neg_gen = 1;
+    return 0;
+}
 
-    // Calculate the total space needed for write operation.
-    size_t need = off + len; // Need is the total file size required AFTER the write.
+// Chunk reference counting:
+// Allocate a zeroed chunk with cap bytes of data, owned by the caller.
+static fs_chunk_t *chunk_new(size_t cap) {
+    fs_chunk_t *c = calloc(1, sizeof(*c) + cap);
+    if (!c) return NULL;
+    c->refs = 1;
+    c->cap = cap;
+    return c;
+}
 
-    // Ensure there's sufficient capacity for this operation by calling ensure_cap().
-    if (ensure_cap(f, need) < 0) return -1;
+// Take another reference to a chunk (views pin chunks under a shared file lock, so this is atomic).
+static void chunk_get(fs_chunk_t *c) {
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
 
-    // f->data + off: points to the write location in the file's buffer.
-    // Copy len bytes from buf to file write location.
-    memcpy(f->data + off, buf, len);
+// Drop a reference to a chunk, freeing it with the last one.
+static void chunk_put(fs_chunk_t *c) {
+    if (c && __atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) free(c);
+}
 
-    // Update the file size if write extended file.
-    if (need > f->size) f->size = need;
+// Whether a read view still pins the chunk (only its owner may then modify it in place).
+static int chunk_shared(fs_chunk_t *c) {
+    return __atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) > 1;
+}
 
-    // Update metadata: file was modified and accessed.
-    time_t now = time(NULL);
-    f->modified = now;
-    f->accessed = now;
+// Node deletion/clean-up:
+// Free the buffers a node owns (but not the node itself).
+static void node_release(node_t *n) {
+    pthread_rwlock_destroy(&n->lock);
+    free(n->snap);
 
-    // Return success.
-    return (ssize_t)len;
+    // For directories, free the children array and hash table; for files, free the data chunks.
+    if (n->type == N_DIR) {
+        free(as_dir(n)->children);
+        free(as_dir(n)->table);
+    } else {
+        file_node_t *f = as_file(n);
+        if (f->nextents) { // Inline files have nothing to free.
+            for (size_t i = 0; i < f->nextents; i++) chunk_put(f->extents[i].chunk);
+            free(f->extents);
+        }
+    }
 }
 
-// Implements file read operation starting from a specific offset.
-// Same parameters as write_file().
-ssize_t read_file(const char *path, size_t off, void *buf, size_t len) {
-
-    // Find the file to read from using walk() and want_parent = 0 to find the file node.
-    node_t *f = walk(path, 0, NULL);
+// Free a single node. Only files and empty directories are ever freed this way;
+// whole trees are released in bulk by fs_teardown().
+static void node_free(fs_t *fs, node_t *n) {
+    
+    // Validate input.
+    if (!n) return;
 
-    // Validate that the file exists and is not a directory.
-    if (!f || f->type!=N_FILE) return -1;
+    node_release(n);
+    pool_free(n->type == N_DIR ? &fs->dir_pool : &fs->file_pool, n);
+}
 
-    // Check for end-of-file (offset is at or beyond file size).
-    if (off >= f->size) return 0; // If EOF detected, return 0 to indicate no bytes were read.
+// Try to move the epoch on (the caller holds retire_lock). On success, what was retired two
+// epochs ago is detached onto *nodes / *tables for the caller to free.
+static int ebr_advance(fs_t *fs, node_t **nodes, dir_table_t **tables) {
+    uint64_t e = fs->epoch;
+    for (size_t i = 0; i < EBR_SLOTS; i++) {
+        if (__atomic_load_n(&fs->readers[i].active[(e + 1) & 1], __ATOMIC_SEQ_CST)) return 0;
+    }
 
-    // Calculate actual read size in bytes.
-    size_t n = f->size - off; // n = f->size - off: bytes available from offset to EOF.
-    if (n > len) n = len; // Don't read more than requested.
+    // Nobody from epoch e-1 is left (it shares a parity with e+1).
+    size_t old = (e + 2) % 3;
+    node_t **np = nodes;
+    while (*np) np = &(*np)->next_retired;
+    *np = fs->limbo_nodes[old];
+    dir_table_t **tp = tables;
+    while (*tp) tp = &(*tp)->next_retired;
+    *tp = fs->limbo_tables[old];
+    fs->limbo_nodes[old] = NULL;
+    fs->limbo_tables[old] = NULL;
+    __atomic_store_n(&fs->epoch, e + 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
 
-    // Copy data to buffer.
-    // f->data + off points to the read location in the file.
-    // Copy n bytes from file to the provided buffer (handles any data type).
-    memcpy(buf, f->data + off, n);
+// Free a removed node (n) and/or a replaced hash table (t) once no lock-free walk can still be
+// using it. Two advances suffice when no reader is active, so a quiet instance frees right away.
+static void ebr_retire(fs_t *fs, node_t *n, dir_table_t *t) {
+    node_t *nodes = NULL;
+    dir_table_t *tables = NULL;
 
-    // Update metadata: file was accessed.
-    f->accessed = time(NULL);
+    pthread_mutex_lock(&fs->retire_lock);
+    size_t cur = fs->epoch % 3;
+    if (n) {
+        __atomic_store_n(&n->next_retired, fs->limbo_nodes[cur], __ATOMIC_RELAXED); // Indexed searches may still read dir_index.
+        fs->limbo_nodes[cur] = n;
+    }
+    if (t) {
+        t->next_retired = fs->limbo_tables[cur];
+        fs->limbo_tables[cur] = t;
+    }
+    if (ebr_advance(fs, &nodes, &tables)) ebr_advance(fs, &nodes, &tables);
+    pthread_mutex_unlock(&fs->retire_lock);
 
-    // Return bytes read, similar to UNIX read().
-    return (ssize_t)n;
+    while (nodes) {
+        node_t *next = nodes->next_retired;
+        node_free(fs, nodes);
+        nodes = next;
+    }
+    while (tables) {
+        dir_table_t *next = tables->next_retired;
+        free(tables);
+        tables = next;
+    }
 }
 
-// Implements file deletion/removal from file system.
-int rm_file(const char *path) {
+// Name index:
+// A trigram index over node names, so substring searches need not visit every node. Each trigram
+// (three consecutive name bytes) maps to a posting list of the nodes whose names contain it,
+// sorted by node number; dir_add() and dir_remove() keep it current. A search for a term of at
+// least three bytes starts from the shortest posting list among the term's trigrams, intersects it
+// with the others, and verifies the few candidates left with strstr() (a name can contain every
+// trigram of a term without containing the term). Removal leaves a tombstone, and a list is
+// compacted once half of it is tombstones. If an update ever fails for lack of memory the index
+// is incomplete, so it is marked broken and searches go back to walking the tree.
 
-    // Parse path to get parent directory.
-    char leaf[NAME_MAX+1]={0}; // Stores filename to be deleted.
-    node_t *parent = walk(path, 1, leaf); // Use walk() & want_parent = 1 to get the containing directory.
-    if (!parent) return -1; 
+// Mix a trigram's bits: the top bits pick the lock stripe, the low bits the slot within it.
+static uint32_t tri_hash(uint32_t tri) {
+    return tri * 2654435761u;
+}
 
-    // Prevent removal of a file in a READ_ONLY directory.
-    if (parent->attributes & ATTR_READONLY) return -1;
+static nidx_stripe_t *nidx_stripe(fs_t *fs, uint32_t tri) {
+    return &fs->nidx[tri_hash(tri) >> 26];
+}
 
-    // Search for the file in the parent directory using linear search on the parent directory's children array.
-    for (size_t i = 0; i < parent->child_count; i++) {
-        node_t *c = parent->children[i];
+// Collect up to max distinct trigrams of s[0..len) into out; returns how many.
+static size_t name_trigrams(const char *s, size_t len, uint32_t *out, size_t max) {
+    size_t n = 0;
+    for (size_t i = 0; i + 3 <= len && n < max; i++) {
+        uint32_t t = (uint8_t)s[i] | (uint32_t)(uint8_t)s[i + 1] << 8 | (uint32_t)(uint8_t)s[i + 2] << 16;
+        size_t j = 0;
+        while (j < n && out[j] != t) j++;
+        if (j == n) out[n++] = t;
+    }
+    return n;
+}
 
-        // Name must match filename (leaf) and the node type must be a file, not a directory.
-        if (strncmp(c->name, leaf, NAME_MAX) == 0 && c->type == N_FILE) {
+// Find the posting list for tri in a stripe (locked by the caller). With create, a missing list
+// is added (empty); returns NULL if it is missing or cannot be added.
+static posting_t *nidx_list(nidx_stripe_t *s, uint32_t tri, int create) {
+    if (create && (s->used + 1) * 2 > s->cap) {
+        // Keep the table at most half full, moving the lists over to a table twice the size.
+        size_t cap = s->cap ? s->cap * 2 : 64;
+        posting_t *lists = calloc(cap, sizeof(*lists));
+        if (!lists) return NULL;
+        for (size_t i = 0; i < s->cap; i++) {
+            if (!s->lists[i].tri) continue;
+            size_t j = tri_hash(s->lists[i].tri) & (cap - 1);
+            while (lists[j].tri) j = (j + 1) & (cap - 1);
+            lists[j] = s->lists[i];
+        }
+        free(s->lists);
+        s->lists = lists;
+        s->cap = cap;
+    }
+    if (!s->cap) return NULL;
 
-            // Prevent removal of a READ_ONLY file.
-            if (c->attributes & ATTR_READONLY) return -1;
-            
-            // Perform removal using swap-with-last algorithm.
-            // This removes in O(1), doesn't shift other files, and only requires a copy operation.
-            // However, it does not preserve file position/order in the directory listing.
-            
-            // IMPORTANT: Swap first, then free to avoid use-after-free bug.
-            parent->children[i] = parent->children[parent->child_count-1];
-            parent->child_count--;
-            node_free(c);  // Now safe to free.
+    size_t mask = s->cap - 1;
+    for (size_t i = tri_hash(tri) & mask; ; i = (i + 1) & mask) {
+        posting_t *p = &s->lists[i];
+        if (p->tri == tri) return p;
+        if (!p->tri) {
+            if (!create) return NULL;
+            p->tri = tri;
+            s->used++;
+            return p;
+        }
+    }
+}
 
-            // Update parent metadata for modification time and also accessed time.
-            parent->modified = parent->accessed = time(NULL);
+// Index of the entry for ino in a posting list, or p->n if it has none.
+static size_t posting_find(const posting_t *p, uint64_t ino) {
+    size_t lo = 0, hi = p->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (p->entries[mid].ino < ino) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < p->n && p->entries[lo].ino == ino) ? lo : p->n;
+}
 
-            return 0;
+// Add a node to the posting lists of its name's trigrams (called by dir_add()).
+static void nidx_insert(fs_t *fs, node_t *n) {
+    uint32_t tris[NAME_MAX];
+    size_t k = name_trigrams(n->name, strlen(n->name), tris, NAME_MAX);
+    for (size_t i = 0; i < k; i++) {
+        nidx_stripe_t *s = nidx_stripe(fs, tris[i]);
+        pthread_rwlock_wrlock(&s->lock);
+        posting_t *p = nidx_list(s, tris[i], 1);
+        if (p && p->n == p->cap) {
+            size_t cap = p->cap ? p->cap * 2 : 4;
+            posting_entry_t *e = realloc(p->entries, cap * sizeof(*e));
+            if (e) {
+                p->entries = e;
+                p->cap = cap;
+            }
         }
+        if (!p || p->n == p->cap) {
+            __atomic_store_n(&fs->nidx_broken, 1, __ATOMIC_RELAXED);
+        } else {
+            // Node numbers grow with creation, so this almost always appends.
+            size_t pos = p->n;
+            while (pos > 0 && p->entries[pos - 1].ino > n->ino) pos--;
+            memmove(&p->entries[pos + 1], &p->entries[pos], (p->n - pos) * sizeof(*p->entries));
+            p->entries[pos] = (posting_entry_t){ n->ino, n };
+            p->n++;
+        }
+        pthread_rwlock_unlock(&s->lock);
     }
-    return -1;
 }
 
-// Implements empty directory removal for file system.
-int rmdir_empty(const char *path) {
-
-    // Find the directory to remove using walk() & want_parent = 0, which returns the actual directory node.
-    node_t *d = walk(path, 0, NULL);
+// Drop a node from the posting lists of its name's trigrams (called by dir_remove()).
+static void nidx_remove(fs_t *fs, node_t *n) {
+    uint32_t tris[NAME_MAX];
+    size_t k = name_trigrams(n->name, strlen(n->name), tris, NAME_MAX);
+    for (size_t i = 0; i < k; i++) {
+        nidx_stripe_t *s = nidx_stripe(fs, tris[i]);
+        pthread_rwlock_wrlock(&s->lock);
+        posting_t *p = nidx_list(s, tris[i], 0);
+        size_t pos = p ? posting_find(p, n->ino) : 0;
+        while (p && pos < p->n && p->entries[pos].ino == n->ino && p->entries[pos].node != n) pos++; // A damaged image may repeat numbers.
+        if (p && pos < p->n && p->entries[pos].node == n) {
+            p->entries[pos].node = NULL;
+            if (++p->dead * 2 > p->n) {
+                size_t live = 0;
+                for (size_t j = 0; j < p->n; j++) {
+                    if (p->entries[j].node) p->entries[live++] = p->entries[j];
+                }
+                p->n = live;
+                p->dead = 0;
+            }
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
 
-    // Safety validation: directory must exist, must be directory type, and cannot be root directory.
-    if (!d || d->type!=N_DIR || d==root) return -1;
+// Find the nodes whose names contain every trigram of term (at most 32 are used), sorted by node
+// number, into *out (caller frees). Returns how many, or -1 if term is too short or on error.
+static ssize_t nidx_candidates(fs_t *fs, const char *term, posting_entry_t **out) {
+    uint32_t tris[32];
+    size_t k = name_trigrams(term, strlen(term), tris, 32);
+    if (k == 0) return -1;
 
-    // Check if the directory is empty (only empty directories can be removed, similar to UNIX rmdir).
-    if (d->child_count) return -1;
+    // Start from the shortest list (counting tombstones is close enough).
+    size_t best = 0, best_n = SIZE_MAX;
+    for (size_t i = 0; i < k; i++) {
+        nidx_stripe_t *s = nidx_stripe(fs, tris[i]);
+        pthread_rwlock_rdlock(&s->lock);
+        posting_t *p = nidx_list(s, tris[i], 0);
+        size_t n = p ? p->n - p->dead : 0;
+        pthread_rwlock_unlock(&s->lock);
+        if (n < best_n) {
+            best = i;
+            best_n = n;
+        }
+    }
+    *out = NULL;
+    if (best_n == 0) return 0;
 
-    // Get parent directory of directory to be removed.
-    node_t *p = d->parent;
-    
-    // Prevent removal of a directory in a READ_ONLY parent directory.
-    if (p->attributes & ATTR_READONLY) return -1;
-    
-    // Prevent removal of a READ_ONLY directory.
-    if (d->attributes & ATTR_READONLY) return -1;
+    nidx_stripe_t *s = nidx_stripe(fs, tris[best]);
+    pthread_rwlock_rdlock(&s->lock);
+    posting_t *p = nidx_list(s, tris[best], 0);
+    posting_entry_t *cand = p ? malloc(p->n * sizeof(*cand)) : NULL;
+    size_t nc = 0;
+    for (size_t j = 0; cand && j < p->n; j++) {
+        if (p->entries[j].node) cand[nc++] = p->entries[j];
+    }
+    pthread_rwlock_unlock(&s->lock);
+    if (!cand) return p ? -1 : 0;
 
-    // Find and remove directory using swap-with-last algorithm (linear search over children).
-    for (size_t i = 0; i < p->child_count; i++) {
-        
-        // Use pointer comparison instead of name comparison.
-        if (p->children[i] == d) { 
+    // Keep only candidates that every other trigram's list also has.
+    for (size_t i = 0; i < k && nc > 0; i++) {
+        if (i == best) continue;
+        s = nidx_stripe(fs, tris[i]);
+        pthread_rwlock_rdlock(&s->lock);
+        p = nidx_list(s, tris[i], 0);
+        size_t keep = 0;
+        for (size_t j = 0; p && j < nc; j++) {
+            size_t pos = posting_find(p, cand[j].ino);
+            if (pos < p->n && p->entries[pos].node) cand[keep++] = cand[j];
+        }
+        pthread_rwlock_unlock(&s->lock);
+        nc = keep;
+    }
+    *out = cand;
+    return (ssize_t)nc;
+}
 
-            // Swap first, then free node!
-            p->children[i] = p->children[p->child_count-1];
-            p->child_count--;
-            node_free(d);
+// Free a name index (no other thread may still be using the instance).
+static void nidx_destroy(fs_t *fs) {
+    for (size_t i = 0; i < NIDX_STRIPES; i++) {
+        nidx_stripe_t *s = &fs->nidx[i];
+        for (size_t j = 0; j < s->cap; j++) free(s->lists[j].entries);
+        free(s->lists);
+        s->lists = NULL;
+        s->cap = s->used = 0;
+        pthread_rwlock_destroy(&s->lock);
+    }
+}
 
-            // Update parent metadata.
-            p->modified = p->accessed = time(NULL);
+// Journal writing (see "Journal" above):
 
-            return 0;
-        }
+// FNV-1a over n bytes at p, continuing from h (start from 2166136261).
+static uint32_t journal_sum(uint32_t h, const void *p, size_t n) {
+    const uint8_t *b = p;
+    for (size_t i = 0; i < n; i++) {
+        h ^= b[i];
+        h *= 16777619u;
     }
+    return h;
+}
 
-    return -1;
+// Write all n bytes at p to fd. Returns 0, or -1 on error.
+static int journal_write_all(int fd, const void *p, size_t n) {
+    const uint8_t *b = p;
+    while (n) {
+        ssize_t k = write(fd, b, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return -1;
+        b += k;
+        n -= (size_t)k;
+    }
+    return 0;
 }
 
-// Implements directory content listing, similar to UNIX ls.
-int ls_dir(const char *path) {
-    node_t *d = NULL;
+// Write out every record appended so far, then fdatasync() if sync is set. Called with j->lock held
+// and no write in progress; the lock is dropped during the I/O, while appends go to the other buffer.
+static void journal_flush(journal_t *j, int sync) {
+    uint8_t *buf = j->buf;
+    size_t len = j->len, cap = j->cap;
+    uint64_t upto = j->appended;
+    j->buf = j->wbuf;
+    j->cap = j->wcap;
+    j->len = 0;
+    j->wbuf = buf;
+    j->wcap = cap;
+    j->busy = 1;
+    pthread_mutex_unlock(&j->lock);
+
+    int rc = journal_write_all(j->fd, buf, len);
+    if (rc == 0 && sync) rc = fdatasync(j->fd);
 
-    if (path == NULL || path[0] == '\0' || strcmp(path, ".") == 0) {
-        d = cwd;
-    } else if (strcmp(path, "/") == 0) {
-        d = root;
+    pthread_mutex_lock(&j->lock);
+    j->busy = 0;
+    if (rc == 0) {
+        j->written = upto;
+        j->size += len;
+        if (sync) j->synced = upto;
     } else {
-        d = walk(path, 0, NULL);  // uses cwd inside if you've wrapped it
+        j->failed = 1;
     }
+    pthread_cond_broadcast(&j->cond);
+}
 
-    if (!d || d->type != N_DIR) return -1;
+// Wait until record seq is written (and on disk, if sync is set), writing it ourselves if nobody
+// else is writing. Called with j->lock held. Returns 0, or -1 if the journal failed.
+static int journal_wait(journal_t *j, uint64_t seq, int sync) {
+    while (!j->failed && (sync ? j->synced : j->written) < seq) {
+        if (j->busy) pthread_cond_wait(&j->cond, &j->lock);
+        else journal_flush(j, sync);
+    }
+    return j->failed ? -1 : 0;
+}
 
-    // Update metadata: directory was accessed.
-    d->accessed = time(NULL);
+// Get record seq (from journal_log()) to the file as the sync policy asks. Called after the changed
+// node is unlocked, so the write does not hold up other users of the node.
+static void journal_commit(fs_t *fs, uint64_t seq) {
+    if (!seq) return;
+    journal_t *j = __atomic_load_n(&fs->journal, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&j->lock);
+    journal_wait(j, seq, j->policy == FS_SYNC_ALWAYS);
+    pthread_mutex_unlock(&j->lock);
+}
 
-    for (size_t i = 0; i < d->child_count; i++) {
-        node_t *c = d->children[i];
-        printf("%s%s\n", c->name, c->type == N_DIR ? "/" : "");
+// FS_SYNC_INTERVAL: fsync whatever was written every interval_ms, until told to stop.
+static void *journal_flusher(void *arg) {
+    journal_t *j = arg;
+    struct timespec next;
+    clock_gettime(CLOCK_REALTIME, &next);
+    pthread_mutex_lock(&j->lock);
+    while (!j->stop) {
+        next.tv_sec += j->interval_ms / 1000;
+        next.tv_nsec += (long)(j->interval_ms % 1000) * 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        while (!j->stop && pthread_cond_timedwait(&j->cond, &j->lock, &next) != ETIMEDOUT) {}
+        if (!j->stop) journal_wait(j, j->appended, 1);
     }
-    return 0;
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
 }
 
-// Metadata operations implementation:
+// Close fs's journal (if any) after writing out what is left, and fsyncing it unless the policy is
+// FS_SYNC_NEVER. No other thread may be changing the tree. Returns 0, or -1 if logging ever failed.
+static int journal_stop(fs_t *fs) {
+    journal_t *j = fs->journal;
+    if (!j) return 0;
+    __atomic_store_n(&fs->journal, NULL, __ATOMIC_RELEASE);
 
-// Get comprehensive file/directory information.
-int get_file_info(const char *path, file_info_t *info) {
-    if (!info) return -1;
+    pthread_mutex_lock(&j->lock);
+    int rc = journal_wait(j, j->appended, j->policy != FS_SYNC_NEVER);
+    j->stop = 1;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    if (j->policy == FS_SYNC_INTERVAL) pthread_join(j->flusher, NULL);
+
+    if (close(j->fd) < 0) rc = -1;
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->cond);
+    free(j->buf);
+    free(j->wbuf);
+    free(j->path);
+    free(j);
+    return rc;
+}
+
+// Clean up an entire file system instance.
+static void fs_teardown(fs_t *fs) {
+
+    // The old tree's changes end here: close its journal.
+    journal_stop(fs);
+
+    // Forget open handles. Their nodes (including files removed while open) live in the
+    // node pools and are released together with everything else below.
+    free(fs->open_files);
+    fs->open_files = NULL;
+    fs->open_cap = 0;
+    fs->open_free = -1;
+
+    // Release every node in bulk, slab by slab, instead of walking the tree from root.
+    pool_destroy(&fs->dir_pool, node_release);
+    pool_destroy(&fs->file_pool, node_release);
+    fs->root = NULL; 
+
+    // Make sure to reassign CWD to NULL!
+    fs->session.cwd = NULL;
+
+    // Drop the lookup cache along with the tree it pointed into.
+    free(fs->dcache);
+    fs->dcache = NULL;
+
+    // Retired nodes were released with their pools; replaced tables still need freeing.
+    for (size_t i = 0; i < 3; i++) {
+        while (fs->limbo_tables[i]) {
+            dir_table_t *next = fs->limbo_tables[i]->next_retired;
+            free(fs->limbo_tables[i]);
+            fs->limbo_tables[i] = next;
+        }
+        fs->limbo_nodes[i] = NULL;
+    }
+    pthread_mutex_destroy(&fs->dir_pool.lock);
+    pthread_mutex_destroy(&fs->file_pool.lock);
+    pthread_mutex_destroy(&fs->open_lock);
+    pthread_mutex_destroy(&fs->retire_lock);
+    nidx_destroy(fs);
+
+    // Frozen versions and zombies were released with the pools; only the lists are left.
+    free(fs->snaps);
+    free(fs->versioned);
+    free(fs->zombies);
+    fs->snaps = NULL;
+    fs->versioned = NULL;
+    fs->zombies = NULL;
+    fs->nsnaps = fs->nversioned = fs->nzombies = 0;
+    pthread_mutex_destroy(&fs->snap_lock);
+    pthread_mutex_destroy(&fs->snap_gc_lock);
+    free(fs->gone);
+    fs->gone = NULL;
+    fs->ngone = fs->gone_cap = 0;
+    pthread_mutex_destroy(&fs->gone_lock);
+
+    // Nothing points into a mapped image any more.
+    if (fs->map) munmap((void *)fs->map, fs->map_size);
+    fs->map = NULL;
+}
+
+// Create an independent file system instance with an empty root directory.
+fs_t *fs_new(void) {
+    fs_t *fs = aligned_alloc(_Alignof(fs_t), sizeof(fs_t));
+    if (!fs) return NULL;
+    if (fs_setup(fs) < 0) {
+        fs_teardown(fs);
+        free(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+// Free an instance and everything in it (no other thread may still be using it).
+void fs_free(fs_t *fs) {
+    if (!fs) return;
+    fs_teardown(fs);
+    free(fs);
+}
+
+// Open a session on fs, starting in the root directory.
+fs_session_t *fs_session_new(fs_t *fs) {
+    if (!fs) return NULL;
+    fs_session_t *ss = malloc(sizeof(*ss));
+    if (!ss) return NULL;
+    session_setup(ss, fs);
+    return ss;
+}
+
+// End a session, releasing its working directory.
+void fs_session_free(fs_session_t *ss) {
+    if (!ss) return;
+    node_unpin(ss->cwd);
+    free(ss);
+}
+
+// Invalidate cached lookups after the namespace changed.
+// removed: a node was detached (breaks positive entries); otherwise a node was added (breaks negative entries).
+static void dcache_invalidate(fs_t *fs, int removed) {
+    __atomic_add_fetch(removed ? &fs->dcache_pos_gen : &fs->dcache_neg_gen, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&fs->dcache_invalidations, 1, __ATOMIC_RELAXED);
+}
+
+// Directory management helper functions:
+// Each directory keeps its children twice: a dense array in listing order (used by ls_dir and
+// search) and an open-addressing hash table with linear probing (used for lookups by name).
+// Removals leave a tombstone in the table so that probe chains stay intact.
+// Writers hold the directory's write lock. Lock-free walks may probe the table at the same time,
+// so slots and the table pointer are stored atomically, and a child is fully set up before it is
+// published in a slot.
+
+// Place a child into the first free or tombstoned slot of its probe chain.
+// Caller guarantees there is room in the table.
+static void dir_slot_insert(dir_node_t *dir, dir_table_t *t, node_t *child) {
+    size_t mask = t->cap - 1;
+    size_t i = child->name_hash & mask;
+    while (t->slots[i] && t->slots[i] != DIR_TOMBSTONE) i = (i + 1) & mask;
+    if (!t->slots[i]) dir->slot_used++; // Reusing a tombstone does not add an occupied slot.
+    __atomic_store_n(&t->slots[i], child, __ATOMIC_RELEASE);
+}
+
+// Replace the hash table with a new one of newcap slots, dropping all tombstones.
+// Walks may still be probing the old table, so it is retired rather than freed.
+static int dir_slot_rehash(fs_t *fs, dir_node_t *dir, size_t newcap) {
+    dir_table_t *t = calloc(1, sizeof(*t) + newcap * sizeof(t->slots[0]));
+    if (!t) return -1;
+
+    t->cap = newcap;
+    dir->slot_used = 0;
+    for (size_t i = 0; i < dir->child_count; i++) dir_slot_insert(dir, t, dir->children[i]);
+    dir_table_t *old = dir->table;
+    __atomic_store_n(&dir->table, t, __ATOMIC_RELEASE);
+    if (old) ebr_retire(fs, NULL, old);
+    return 0;
+}
+
+// Make room for one more child in both the children array and the hash table.
+static int dir_reserve(fs_t *fs, dir_node_t *dir) {
+
+    // Grow the children array by doubling.
+    if (dir->child_count == dir->child_cap) {
+        size_t newcap = dir->child_cap ? dir->child_cap * 2 : DIR_MIN_SLOTS;
+        node_t **p = realloc(dir->children, newcap * sizeof(*p));
+        if (!p) return -1;
+        dir->children = p;
+        dir->child_cap = newcap;
+    }
+
+    // Keep the table at most 3/4 full (counting tombstones) so probe chains stay short.
+    // If most occupied slots are tombstones, rehashing at the same size is enough.
+    size_t cap = dir->table ? dir->table->cap : 0;
+    if ((dir->slot_used + 1) * 4 > cap * 3) {
+        size_t newcap = cap ? cap : DIR_MIN_SLOTS;
+        while ((dir->child_count + 1) * 2 > newcap) newcap *= 2;
+        if (dir_slot_rehash(fs, dir, newcap) < 0) return -1;
+    }
+    return 0;
+}
+
+// Add a child to a directory (the caller holds dir's write lock).
+static node_t *dir_add(fs_t *fs, node_t *dir, node_t *child) {
+
+    // Validate that passed in directory is not null and that the node is a directory.
+    if (!dir || dir->type!=N_DIR) return NULL;
+
+    // Validate the child pointer is not null.
+    if (!child) return NULL;
+
+    // Prevent attaching a node that already belongs to another directory.
+    if (child->parent && child->parent != dir) return NULL;
+
+    // Prevent adding the same child twice.
+    dir_node_t *d = as_dir(dir);
+    if (child->dir_index < d->child_count && d->children[child->dir_index] == child) {
+        return child;
+    }
+
+    // Grow the directory if needed (directories have no fixed child limit).
+    if (dir_reserve(fs, d) < 0) return NULL;
+
+    // Set the child's parent pointer to point back to dir (tree is bidirectional).
+    // This happens before the child is published, since walks may find it right away.
+    child->parent = dir;
+
+    // Append the child to the children array and index it by name.
+    __atomic_store_n(&child->dir_index, d->child_count, __ATOMIC_RELAXED); // Read by indexed searches.
+    d->children[d->child_count++] = child;
+    dir_slot_insert(d, d->table, child);
+    nidx_insert(fs, child);
+
+    // A path that used to be missing may now resolve (covers mkdir_p and create_file).
+    dcache_invalidate(fs, 0);
+
+    // Update directory metadata.
+    time_t now = time(NULL);
+    stamp(&dir->modified, now);
+    stamp(&dir->accessed, now);
+
+    return child;
+}
+
+// Find a child by name in directory. Needs no lock: callers either hold dir's lock or are
+// inside a read section, in which case the child may be removed at any moment (see walk()).
+// name is a (pointer, length) slice and does not need to be null-terminated.
+static node_t *dir_find(node_t *dir, const char *name, size_t len) {
+
+    // Validate that passed in node is a directory.
+    if (!dir || dir->type!=N_DIR || len > NAME_MAX) return NULL;
+    dir_table_t *t = __atomic_load_n(&as_dir(dir)->table, __ATOMIC_ACQUIRE);
+    if (!t) return NULL;
+
+    // Probe from the name's home slot until an empty slot ends the chain.
+    // Comparing cached hashes first avoids most string comparisons.
+    uint32_t h = name_hash(name, len);
+    size_t mask = t->cap - 1;
+    node_t *c;
+    for (size_t i = h & mask; (c = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE)); i = (i + 1) & mask) {
+        if (c != DIR_TOMBSTONE && c->name_hash == h &&
+            memcmp(c->name, name, len) == 0 && c->name[len] == '\0') {
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+// Detach a child from its directory (does not free it).
+// The caller write-locks dir and then child, so no locked user is left; lock-free walks may
+// still reach the child, so the caller retires it rather than freeing it.
+static void dir_remove(fs_t *fs, node_t *dir, node_t *child) {
+    dir_node_t *d = as_dir(dir);
+
+    // Replace the child's hash slot with a tombstone.
+    dir_table_t *t = d->table;
+    size_t mask = t->cap - 1;
+    for (size_t i = child->name_hash & mask; t->slots[i]; i = (i + 1) & mask) {
+        if (t->slots[i] == child) {
+            __atomic_store_n(&t->slots[i], DIR_TOMBSTONE, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+
+    // Mark the child unlinked, for walks that find it anyway.
+    __atomic_store_n(&child->parent, NULL, __ATOMIC_RELEASE);
+
+    // Remove from the children array using swap-with-last.
+    // This removes in O(1), but does not preserve file position/order in the directory listing.
+    node_t *last = d->children[--d->child_count];
+    d->children[child->dir_index] = last;
+    __atomic_store_n(&last->dir_index, child->dir_index, __ATOMIC_RELAXED);
+    nidx_remove(fs, child);
+
+    // Cached paths may resolve to (or through) the removed node (covers rm_file and rmdir_empty).
+    dcache_invalidate(fs, 1);
+}
+
+// Lazily mapped directories:
+// After fs_map() the tree starts out as just the root, whose `lazy` points at its record in the
+// mapped image. A lazy directory's children are materialized all at once, under its write lock, the
+// first time anything needs them: walks (and everything else that lists or changes a directory)
+// call dir_ready() first. Its subdirectories start out lazy in turn, and its files keep reading
+// their data from the image. Records are checked as they are materialized, so a damaged image makes
+// the operation that reaches the damage fail instead of costing a full check up front.
+
+// Check an image's header (with the given magic) and that its node table lies within it.
+// Returns 0, or -1 if not.
+static int image_check_header(const uint8_t *img, size_t size, const char *magic) {
+    const image_header_t *h = (const image_header_t *)img;
+    if (size < sizeof(*h) || memcmp(h->magic, magic, sizeof(h->magic)) != 0) return -1;
+    if (h->version != FS_IMAGE_VERSION || h->order != FS_IMAGE_ORDER || h->size != size) return -1;
+    if (h->node_count == 0 || h->nodes_off % 8 || h->nodes_off > size ||
+        h->node_count > (size - h->nodes_off) / sizeof(image_node_t)) return -1;
+    return 0;
+}
+
+// Check record i of an image: its name, its type and (for files) its extents. Where a directory's
+// children are is checked by the caller. Returns 0, or -1 if the record is damaged.
+static int image_check_node(const uint8_t *img, size_t size, const image_node_t *rec, uint64_t i) {
+    if (rec->name_len > NAME_MAX || rec->name_off > size || rec->name_len > size - rec->name_off) return -1;
+    const char *name = (const char *)img + rec->name_off;
+    if (i == 0 ? (rec->type != N_DIR || rec->name_len != 0) : rec->name_len == 0) return -1;
+    if (memchr(name, '/', rec->name_len) || memchr(name, '\0', rec->name_len)) return -1;
+    if ((rec->name_len == 1 && name[0] == '.') || (rec->name_len == 2 && memcmp(name, "..", 2) == 0)) return -1;
+    if (rec->type == N_DIR) return 0;
+    if (rec->type != N_FILE) return -1;
+
+    if (rec->size > SIZE_MAX || rec->first % 8 || rec->first > size ||
+        rec->count > (size - rec->first) / sizeof(image_extent_t)) return -1;
+    const image_extent_t *ext = (const image_extent_t *)(img + rec->first);
+    for (uint64_t j = 0; j < rec->count; j++) {
+        if (j > 0 && ext[j].index <= ext[j - 1].index) return -1;
+        if (ext[j].len == 0 || ext[j].len > FS_CHUNK_SIZE || ext[j].off > size ||
+            ext[j].len > size - ext[j].off) return -1;
+        if (ext[j].index > rec->size / FS_CHUNK_SIZE ||
+            ext[j].index * FS_CHUNK_SIZE + ext[j].len > rec->size) return -1;
+    }
+    return 0;
+}
+
+// The records of the children of rec, a directory in the mapped image, once checked: children
+// follow their parent in the table (so there are no cycles), and node numbers handed out later
+// must be new. Sets *ndirs to how many are directories. Returns NULL if a record is bad.
+static const image_node_t *map_children(fs_t *fs, const image_node_t *rec, size_t *ndirs) {
+    const image_header_t *h = (const image_header_t *)fs->map;
+    const image_node_t *recs = (const image_node_t *)(fs->map + h->nodes_off);
+    uint64_t first = rec->first, count = rec->count;
+    if (first <= (uint64_t)(rec - recs) || first > h->node_count || count > h->node_count - first) return NULL;
+    const image_node_t *kids = recs + first;
+    *ndirs = 0;
+    for (size_t j = 0; j < count; j++) {
+        if (image_check_node(fs->map, fs->map_size, &kids[j], first + j) < 0) return NULL;
+        if (kids[j].ino > h->next_ino) return NULL;
+        *ndirs += kids[j].type == N_DIR;
+    }
+    return kids;
+}
+
+// Materialize the children of lazy directory d (the caller holds its write lock).
+static int dir_materialize(fs_t *fs, dir_node_t *d) {
+    const image_node_t *rec = d->lazy;
+    size_t count = rec->count, ndirs, nlazy = 0;
+
+    // Check them all first.
+    const image_node_t *kids = map_children(fs, rec, &ndirs);
+    if (!kids) return -1;
+
+    // Exact-size children array and table, and the nodes from the pools in bulk.
+    size_t ccap = count > DIR_MIN_SLOTS ? count : DIR_MIN_SLOTS, tcap = DIR_MIN_SLOTS;
+    while ((count + 1) * 2 > tcap) tcap *= 2;
+    node_t **children = malloc(ccap * sizeof(*children));
+    node_t **spare = malloc(count * sizeof(*spare));
+    dir_table_t *t = calloc(1, sizeof(*t) + tcap * sizeof(t->slots[0]));
+    size_t made = 0, di = 0, fi = ndirs;
+    int have_dirs = 0, have_files = 0; // Which pools the spare nodes were taken from.
+    if (!children || !spare || !t) goto fail;
+    if (pool_alloc_many(&fs->dir_pool, ndirs, spare) < 0) goto fail;
+    have_dirs = 1;
+    if (pool_alloc_many(&fs->file_pool, count - ndirs, spare + ndirs) < 0) goto fail;
+    have_files = 1;
+
+    t->cap = tcap;
+    for (size_t j = 0; j < count; j++) {
+        const image_node_t *k = &kids[j];
+        node_t *x = children[j] = spare[k->type == N_DIR ? di++ : fi++];
+        x->type = k->type;
+        memcpy(x->name, fs->map + k->name_off, k->name_len);
+        x->name_hash = name_hash(x->name, k->name_len);
+        x->ino = k->ino;
+        x->attributes = k->attributes;
+        x->created = k->created;
+        x->modified = k->modified;
+        x->accessed = k->accessed;
+        x->parent = &d->base;
+        x->dir_index = j;
+        pthread_rwlock_init(&x->lock, NULL);
+        made++;
+        if (x->type == N_DIR) as_dir(x)->dirty = k->flags & IMAGE_DIRTY;
+        if (x->type == N_DIR && k->count) {
+            as_dir(x)->lazy = k;
+            nlazy++;
+        } else if (x->type == N_FILE) {
+            file_node_t *f = as_file(x);
+            f->size = k->size;
+            if (k->count) {
+                f->image = fs->map;
+                f->image_ext = (const image_extent_t *)(fs->map + k->first);
+                f->image_count = k->count;
+            }
+        }
+
+        // Insert into the table, refusing a name that is already there.
+        size_t mask = tcap - 1, i = x->name_hash & mask;
+        for (; t->slots[i]; i = (i + 1) & mask) {
+            if (t->slots[i]->name_hash == x->name_hash && strcmp(t->slots[i]->name, x->name) == 0) goto fail;
+        }
+        t->slots[i] = x;
+    }
+    free(spare);
+
+    // Publish: walks find the children through the table once it is stored, and stop waiting
+    // for the directory once `lazy` is cleared.
+    d->children = children;
+    d->child_cap = ccap;
+    d->child_count = count;
+    d->slot_used = count;
+    __atomic_store_n(&d->table, t, __ATOMIC_RELEASE);
+    for (size_t j = 0; j < count; j++) nidx_insert(fs, children[j]);
+    __atomic_add_fetch(&fs->lazy_dirs, nlazy, __ATOMIC_RELEASE);
+    __atomic_store_n(&d->lazy, NULL, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&fs->lazy_dirs, 1, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    // The directory stays lazy, so return every node taken, used or not. A walk that failed here
+    // found nothing only for now: its miss must not be cached.
+    dcache_invalidate(fs, 0);
+    for (size_t j = 0; j < made; j++) node_free(fs, children[j]);
+    for (; have_dirs && di < ndirs; di++) pool_free(&fs->dir_pool, spare[di]);
+    for (; have_files && fi < count; fi++) pool_free(&fs->file_pool, spare[fi]);
+    free(children);
+    free(spare);
+    free(t);
+    return -1;
+}
+
+// Make sure a directory's children are materialized before they are looked at. Must not be
+// called with n locked. Returns 0 (also for files), or -1 if materializing failed.
+static int dir_ready(fs_t *fs, node_t *n) {
+    if (n->type != N_DIR || !__atomic_load_n(&as_dir(n)->lazy, __ATOMIC_ACQUIRE)) return 0;
+    node_lock(n, LK_WRITE);
+    int rc = as_dir(n)->lazy ? dir_materialize(fs, as_dir(n)) : 0;
+    node_unlock(n);
+    return rc;
+}
+
+// Build the full path of a linked node (including leading '/') into a malloc'd string.
+// The caller holds the node's lock; paths have no depth or length limit.
+static char *node_path_dup(node_t *n, size_t *out_len) {
+    size_t len = 0;
+    for (node_t *cur = n; cur->parent; cur = cur->parent) len += 1 + strlen(cur->name);
+    if (len == 0) len = 1; // Root is just "/".
+
+    char *path = malloc(len + 1);
+    if (!path) return NULL;
+    path[0] = '/';
+    path[len] = '\0';
+
+    // Fill in the segments from the end, walking up to root.
+    size_t pos = len;
+    for (node_t *cur = n; cur->parent; cur = cur->parent) {
+        size_t k = strlen(cur->name);
+        pos -= k;
+        memcpy(path + pos, cur->name, k);
+        path[--pos] = '/';
+    }
+    if (out_len) *out_len = len;
+    return path;
+}
+
+// Log a change to node n (or, given a leaf, to the entry leaf in directory n), with the data in iov
+// appended to the record. Called with n locked, so the path is stable. Returns the record's sequence
+// number for journal_commit(), or 0 if nothing was logged: there is no journal, or n was removed
+// (changes to files open after removal cannot matter to a replay).
+static uint64_t journal_log(fs_t *fs, journal_record_t rec, node_t *n, const char *leaf,
+                            const struct iovec *iov, int iovcnt) {
+    journal_t *j = __atomic_load_n(&fs->journal, __ATOMIC_ACQUIRE);
+    if (!j || !node_linked(fs, n)) return 0;
+
+    size_t len = 0, leaf_len = leaf ? strlen(leaf) : 0;
+    char *path = node_path_dup(n, &len);
+    char *full = path ? realloc(path, len + leaf_len + 2) : NULL;
+    if (!full) {
+        free(path);
+        pthread_mutex_lock(&j->lock);
+        j->failed = 1;
+        pthread_mutex_unlock(&j->lock);
+        return 0;
+    }
+    if (leaf) {
+        if (len > 1) full[len++] = '/'; // Root's path is already "/".
+        memcpy(full + len, leaf, leaf_len + 1);
+        len += leaf_len;
+    }
+
+    // Checksum outside the lock; only the copy into the buffer is serialized.
+    size_t data = 0;
+    for (int i = 0; i < iovcnt; i++) data += iov[i].iov_len;
+    rec.len = sizeof(rec) + len + 1 + data;
+    rec.path_len = (uint32_t)(len + 1);
+    rec.time = time(NULL);
+    rec.sum = 0;
+    uint32_t h = journal_sum(2166136261u, &rec, sizeof(rec));
+    h = journal_sum(h, full, len + 1);
+    for (int i = 0; i < iovcnt; i++) h = journal_sum(h, iov[i].iov_base, iov[i].iov_len);
+    rec.sum = h;
+
+    uint64_t seq = 0;
+    pthread_mutex_lock(&j->lock);
+    if (!j->failed && j->len + rec.len > j->cap) {
+        size_t cap = j->cap ? j->cap : 4096;
+        while (cap < j->len + rec.len) cap *= 2;
+        uint8_t *p = realloc(j->buf, cap);
+        if (p) {
+            j->buf = p;
+            j->cap = cap;
+        } else {
+            j->failed = 1;
+        }
+    }
+    if (!j->failed) {
+        uint8_t *dst = j->buf + j->len;
+        memcpy(dst, &rec, sizeof(rec));
+        memcpy(dst + sizeof(rec), full, len + 1);
+        dst += sizeof(rec) + len + 1;
+        for (int i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len) memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+        j->len += rec.len;
+        seq = ++j->appended;
+    }
+    pthread_mutex_unlock(&j->lock);
+    free(full);
+    return seq;
+}
+
+// Copy-on-write (see "Snapshots" above):
+
+// Make room for n entries of size bytes in a growable array (*p, *cap). Returns 0, or -1 if out of memory.
+static int snap_reserve(void *p, size_t *cap, size_t n, size_t size) {
+    if (n <= *cap) return 0;
+    size_t c = *cap ? *cap * 2 : 16;
+    while (c < n) c *= 2;
+    void *q = realloc(*(void **)p, c * size);
+    if (!q) return -1;
+    *(void **)p = q;
+    *cap = c;
+    return 0;
+}
+
+// Whether one of the open snapshots in ids[0..n) (ascending) has an id in (lo, hi].
+static int snap_open_in(const uint64_t *ids, size_t n, uint64_t lo, uint64_t hi) {
+    size_t a = 0, b = n;
+    while (a < b) {
+        size_t mid = a + (b - a) / 2;
+        if (ids[mid] <= lo) a = mid + 1;
+        else b = mid;
+    }
+    return a < n && ids[a] <= hi;
+}
+
+// Make a frozen copy of n's current state (the caller locks n; a directory must be materialized).
+// The copy owns its children array and table, or its extent array and a reference on each chunk;
+// a mapped file's copy reads from the image like the file does.
+static node_t *node_freeze(fs_t *fs, node_t *n) {
+    node_t *v = pool_alloc(n->type == N_DIR ? &fs->dir_pool : &fs->file_pool);
+    if (!v) return NULL;
+    v->type = n->type;
+    v->name_hash = n->name_hash;
+    v->ino = n->ino;
+    memcpy(v->name, n->name, sizeof(v->name));
+    v->attributes = __atomic_load_n(&n->attributes, __ATOMIC_RELAXED);
+    pthread_rwlock_init(&v->lock, NULL);
+    v->created = n->created;
+    v->modified = stamp_get(&n->modified);
+    v->accessed = stamp_get(&n->accessed);
+    v->snap = malloc(sizeof(*v->snap));
+    if (!v->snap) {
+        node_free(fs, v);
+        return NULL;
+    }
+    *v->snap = (node_snap_t){ .gen = node_gen(n), .born = node_born(n) };
+
+    if (n->type == N_DIR) {
+        dir_node_t *d = as_dir(n), *c = as_dir(v);
+        size_t count = d->child_count;
+        c->children = count ? malloc(count * sizeof(*c->children)) : NULL;
+        c->table = d->table ? malloc(sizeof(*d->table) + d->table->cap * sizeof(d->table->slots[0])) : NULL;
+        if ((count && !c->children) || (d->table && !c->table)) {
+            node_free(fs, v);
+            return NULL;
+        }
+        if (count) memcpy(c->children, d->children, count * sizeof(*c->children));
+        if (d->table) memcpy(c->table, d->table, sizeof(*d->table) + d->table->cap * sizeof(d->table->slots[0]));
+        c->child_count = c->child_cap = count;
+        c->slot_used = d->slot_used;
+        c->dirty = __atomic_load_n(&d->dirty, __ATOMIC_RELAXED);
+    } else {
+        file_node_t *f = as_file(n), *c = as_file(v);
+        c->size = f->size;
+        c->allocated = f->allocated;
+        if (f->image) {
+            c->image = f->image;
+            c->image_ext = f->image_ext;
+            c->image_count = f->image_count;
+        } else if (f->nextents) {
+            c->extents = malloc(f->nextents * sizeof(*c->extents));
+            if (!c->extents) {
+                node_free(fs, v);
+                return NULL;
+            }
+            memcpy(c->extents, f->extents, f->nextents * sizeof(*c->extents));
+            for (size_t i = 0; i < f->nextents; i++) chunk_get(f->extents[i].chunk);
+            c->nextents = c->extent_cap = f->nextents;
+        } else {
+            memcpy(c->inline_data, f->inline_data, FS_INLINE_MAX);
+        }
+    }
+    return v;
+}
+
+// Called with n write-locked before it is changed. If an open snapshot can see n's current state,
+// a frozen copy of it is kept first and n's state then belongs to the current generation, so later
+// changes in it need no copy. A state no open snapshot can see keeps its generation: every later
+// snapshot sees it the same way, and n needs no node_snap_t for it. Returns 0, or -1 if out of
+// memory (n is left as it was). snap_newest is read after snap_gen and fs_snapshot() stores them in
+// the other order, so a snapshot whose generation we see is never missed.
+static int node_cow(fs_t *fs, node_t *n) {
+    uint64_t cur = __atomic_load_n(&fs->snap_gen, __ATOMIC_SEQ_CST);
+    uint64_t gen = node_gen(n);
+    if (gen >= cur || __atomic_load_n(&fs->snap_newest, __ATOMIC_SEQ_CST) <= gen) return 0;
+    if (n->type == N_DIR && as_dir(n)->lazy && dir_materialize(fs, as_dir(n)) < 0) return -1;
+    node_snap_t *s = n->snap;
+    if (!s) {
+        s = calloc(1, sizeof(*s)); // Generation 0, as without one.
+        if (!s) return -1;
+        __atomic_store_n(&n->snap, s, __ATOMIC_RELEASE);
+    }
+    node_t *v = node_freeze(fs, n);
+    if (!v) return -1;
+
+    // The first version puts n on the list that releasing snapshots prunes.
+    if (!s->versions) {
+        pthread_mutex_lock(&fs->snap_lock);
+        int rc = snap_reserve(&fs->versioned, &fs->versioned_cap, fs->nversioned + 1, sizeof(node_t *));
+        if (rc == 0) fs->versioned[fs->nversioned++] = n;
+        pthread_mutex_unlock(&fs->snap_lock);
+        if (rc < 0) {
+            node_free(fs, v);
+            return -1;
+        }
+    }
+    v->snap->versions = s->versions;
+    __atomic_store_n(&s->versions, v, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->gen, cur, __ATOMIC_SEQ_CST); // After the version: readers check gen first.
+    return 0;
+}
+
+// Retire a node removed from the tree (see ebr_retire()), unless an open snapshot may still see it:
+// then it is kept as a zombie until the snapshots are released. The caller no longer holds its lock.
+static void node_retire(fs_t *fs, node_t *n) {
+    if (__atomic_load_n(&fs->snap_newest, __ATOMIC_SEQ_CST) > node_born(n) || node_versions(n)) {
+        pthread_mutex_lock(&fs->snap_lock);
+        int rc = snap_reserve(&fs->zombies, &fs->zombies_cap, fs->nzombies + 1, sizeof(snap_zombie_t));
+        if (rc == 0) fs->zombies[fs->nzombies++] = (snap_zombie_t){ n, __atomic_load_n(&fs->snap_gen, __ATOMIC_SEQ_CST) };
+        pthread_mutex_unlock(&fs->snap_lock);
+        return; // If out of memory, it stays until the pools are released.
+    }
+    ebr_retire(fs, n, NULL);
+}
+
+// The state of n that snapshot k sees: n itself, read-locked (*locked is set), if it has not
+// changed since k was taken; otherwise its frozen version from before k, which needs no lock; or
+// NULL if n is newer than k. Called inside a read section.
+static node_t *snap_state(node_t *n, uint64_t k, int *locked) {
+    *locked = 0;
+    while (node_gen(n) < k) {
+        node_lock(n, LK_READ);
+        if (node_gen(n) < k) {
+            *locked = 1;
+            return n;
+        }
+        node_unlock(n); // Changed meanwhile: its state for k is a version now.
+    }
+    node_t *v = node_versions(n);
+    while (v && v->snap->gen >= k) v = node_versions(v);
+    return v;
+}
+
+// Removal log (see "Incremental backup" in fs.h):
+// A delta records a removal as an IMAGE_GONE record in the directory it was removed from, so a
+// directory that changed needs no listing of what it still holds. Removals are logged here until an
+// export takes them: only those of nodes a backup may hold, that is nodes numbered up to backup_ino
+// (the last node number when the last save or export finished), and every removal while a save or
+// export runs or a snapshot (which can be saved later) is open. Logging happens under the parent's
+// write lock, and fsi_export_delta() takes a directory's entries under its read lock, after clearing
+// its flags: a removal is either taken by an export or flags the directory for the next one.
+
+// Log the removal of n from dir. Called with dir write-locked, before n is detached. Returns 0, or
+// -1 if out of memory (nothing is removed then).
+static int node_gone(fs_t *fs, node_t *dir, node_t *n) {
+    if (!__atomic_load_n(&fs->backups, __ATOMIC_SEQ_CST) && !__atomic_load_n(&fs->snap_newest, __ATOMIC_SEQ_CST) &&
+        n->ino > __atomic_load_n(&fs->backup_ino, __ATOMIC_SEQ_CST)) return 0;
+    pthread_mutex_lock(&fs->gone_lock);
+    int rc = snap_reserve(&fs->gone, &fs->gone_cap, fs->ngone + 1, sizeof(*fs->gone));
+    if (rc == 0) {
+        delta_gone_t *g = &fs->gone[fs->ngone++];
+        g->dir = dir->ino;
+        g->type = n->type;
+        memcpy(g->name, n->name, sizeof(g->name));
+    }
+    pthread_mutex_unlock(&fs->gone_lock);
+    return rc;
+}
+
+// Bracket a save or export: removals are logged while it runs, and once it is done every node
+// numbered so far may be in a backup.
+static void backup_begin(fs_t *fs) {
+    __atomic_add_fetch(&fs->backups, 1, __ATOMIC_SEQ_CST);
+}
+
+static void backup_end(fs_t *fs) {
+    uint64_t last = __atomic_load_n(&fs->next_ino, __ATOMIC_SEQ_CST);
+    uint64_t was = __atomic_load_n(&fs->backup_ino, __ATOMIC_SEQ_CST);
+    while (was < last && !__atomic_compare_exchange_n(&fs->backup_ino, &was, last, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {}
+    __atomic_sub_fetch(&fs->backups, 1, __ATOMIC_SEQ_CST);
+}
+
+// Serial search:
+// A depth-first traversal with an explicit stack, so deep trees cannot overflow the call stack.
+// The path is built incrementally in one buffer: each frame remembers the length of its
+// directory's path, and a child's name is appended after it. Directories on the stack stay
+// read-locked while we descend, so the paths handed to fn stay valid.
+
+typedef struct search_frame {
+    node_t *dir;   // Read-locked directory being listed.
+    size_t next;   // Next child to visit.
+    size_t len;    // Length of dir's path in the path buffer.
+} search_frame_t;
+
+// Search the subtree at start (read-locked by the caller) for names containing term, calling fn
+// for each match in tree order until it returns nonzero. Returns the number of matches reported.
+static int search_serial(fs_t *fs, node_t *start, const char *term, fs_search_fn fn, void *arg) {
+    size_t len, cap;
+    char *path = node_path_dup(start, &len);
+    if (!path) return -1;
+    cap = len + 1;
+
+    int matches = 0, rc = 0;
+    time_t now = time(NULL);
+
+    // Visiting a node counts as an access. Skip root's empty name when matching.
+    stamp(&start->accessed, now);
+    if (start->parent && strstr(start->name, term)) {
+        matches++;
+        if (fn(start, path, len, arg)) goto out_path;
+    }
+
+    size_t depth = 1, max_depth = 16;
+    search_frame_t *stack = malloc(max_depth * sizeof(*stack));
+    if (!stack) {
+        rc = -1;
+        goto out_path;
+    }
+    stack[0] = (search_frame_t){ start, 0, len };
+
+    while (depth > 0) {
+        search_frame_t *f = &stack[depth - 1];
+        dir_node_t *d = as_dir(f->dir);
+        if (f->next == d->child_count) {
+            if (depth > 1) node_unlock(f->dir); // The caller unlocks start.
+            depth--;
+            continue;
+        }
+        node_t *c = d->children[f->next++];
+        stamp(&c->accessed, now);
+
+        // Append "/name" to the directory's path (root's path already ends in '/').
+        size_t nlen = strlen(c->name);
+        if (f->len + nlen + 2 > cap) {
+            size_t newcap = cap * 2 > f->len + nlen + 2 ? cap * 2 : f->len + nlen + 2;
+            char *p = realloc(path, newcap);
+            if (!p) {
+                rc = -1;
+                break;
+            }
+            path = p;
+            cap = newcap;
+        }
+        size_t clen = f->len;
+        if (path[clen - 1] != '/') path[clen++] = '/';
+        memcpy(path + clen, c->name, nlen + 1);
+        clen += nlen;
+
+        if (strstr(c->name, term)) {
+            matches++;
+            if (fn(c, path, clen, arg)) break;
+        }
+
+        if (c->type == N_DIR) {
+            if (depth == max_depth) {
+                search_frame_t *s = realloc(stack, max_depth * 2 * sizeof(*s));
+                if (!s) {
+                    rc = -1;
+                    break;
+                }
+                stack = s;
+                max_depth *= 2;
+            }
+            if (dir_ready(fs, c) < 0) {
+                rc = -1;
+                break;
+            }
+            node_lock(c, LK_READ);
+            stack[depth++] = (search_frame_t){ c, 0, clen };
+        }
+    }
+
+    // Stopped early: release the directories still on the stack.
+    while (depth > 1) node_unlock(stack[--depth].dir);
+    free(stack);
+
+out_path:
+    free(path);
+    return rc < 0 ? -1 : matches;
+}
+
+// Path tokenizer:
+// Yields the next component of a path as a (pointer, length) slice into the caller's string,
+// skipping repeated slashes. Returns 0 once the path is exhausted. Paths have no length limit.
+static int path_next(const char **p, const char **tok, size_t *len) {
+    const char *s = *p;
+    while (*s == '/') s++;
+    if (!*s) {
+        *p = s;
+        return 0;
+    }
+
+    const char *e = s;
+    while (*e && *e != '/') e++;
+    *tok = s;
+    *len = (size_t)(e - s);
+    *p = e;
+    return 1;
+}
+
+// Component checks by length, so "..." or ".hidden" never match.
+static int tok_is_dot(const char *tok, size_t len) {
+    return len == 1 && tok[0] == '.';
+}
+
+static int tok_is_dotdot(const char *tok, size_t len) {
+    return len == 2 && tok[0] == '.' && tok[1] == '.';
+}
+
+// Resolve a path from start (root for absolute paths) without taking any locks. The caller is
+// inside a read section, so every node seen stays allocated, but it may be removed at any moment.
+// With want_parent the containing directory is returned and the last component is copied to out_leaf.
+static node_t *walk_uncached(fs_t *fs, node_t *start,
+                             const char *path,
+                             int want_parent,
+                             char out_leaf[NAME_MAX+1]) {
+    int absolute = (path[0] == '/');
+    node_t *cur = absolute ? fs->root : (start ? start : fs->root);
+
+    const char *tok;
+    size_t len;
+
+    // Case: path is just "/" or ""
+    if (!path_next(&path, &tok, &len)) return cur;
+
+    for (;;) {
+        if (len > NAME_MAX) return NULL;
+
+        // Look ahead so we know whether this is the last component.
+        const char *next;
+        size_t next_len;
+        int last = !path_next(&path, &next, &next_len);
+
+        if (tok_is_dot(tok, len)) {
+            // stay in cur
+        } else if (tok_is_dotdot(tok, len)) {
+            // Root stays at root. A directory removed under us stays put too; whatever the walk
+            // ends on is then unlinked as well, which walk() detects.
+            node_t *p = node_parent(cur);
+            if (p) cur = p;
+        } else if (last) {
+            // last component
+            if (!want_parent && dir_ready(fs, cur) < 0) return NULL;
+            if (want_parent) {
+                if (out_leaf) {
+                    memcpy(out_leaf, tok, len);
+                    out_leaf[len] = '\0';
+                }
+                return cur;
+            }
+            return dir_find(cur, tok, len);
+        } else {
+            // middle component: must be a directory we can descend into
+            if (dir_ready(fs, cur) < 0) return NULL;
+            node_t *n = dir_find(cur, tok, len);
+            if (!n || n->type != N_DIR) return NULL;
+            cur = n;
+        }
+
+        if (last) break;
+        tok = next;
+        len = next_len;
+    }
+
+    // if we consumed everything cleanly and there was no special last component
+    return cur;
+}
+
+// Hash a (start directory, path) pair to pick a cache entry.
+static size_t dcache_hash(const node_t *start, const char *path) {
+    uint64_t h = 14695981039346656037ull ^ (uint64_t)(uintptr_t)start;
+    for (; *path; path++) {
+        h ^= (uint8_t)*path;
+        h *= 1099511628211ull;
+    }
+    return (size_t)(h ^ (h >> 32)) & (DCACHE_SIZE - 1);
+}
+
+// Read a cache entry for (key, path), where path is zero-padded to nwords words. Returns 1 and
+// the cached node (NULL for a cached miss) if the entry matches and is still current.
+static int dcache_lookup(dcache_entry_t *e, node_t *key, const uint64_t *path, size_t nwords,
+                         uint64_t gen_pos, uint64_t gen_neg, node_t **out) {
+    uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) return 0; // Being rewritten.
+
+    // Fields are loaded with acquire, so seeing any part of a rewrite also shows its odd sequence.
+    int match = __atomic_load_n(&e->start, __ATOMIC_ACQUIRE) == key;
+    for (size_t i = 0; match && i < nwords; i++) match = __atomic_load_n(&e->path[i], __ATOMIC_ACQUIRE) == path[i];
+    node_t *n = __atomic_load_n(&e->node, __ATOMIC_ACQUIRE);
+    uint64_t gen = __atomic_load_n(&e->gen, __ATOMIC_ACQUIRE);
+
+    // Anything read above is only trustworthy if nobody rewrote the entry meanwhile.
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) return 0;
+    if (!match || gen == 0 || gen != (n ? gen_pos : gen_neg)) return 0;
+    *out = n;
+    return 1;
+}
+
+// Rewrite a cache entry. Skipped (rather than waited for) if another thread is rewriting it.
+static void dcache_fill(dcache_entry_t *e, node_t *key, const uint64_t *path, uint64_t gen, node_t *n) {
+    uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+
+    __atomic_store_n(&e->start, key, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->node, n, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->gen, gen, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < DCACHE_PATH_MAX / 8; i++) __atomic_store_n(&e->path[i], path[i], __ATOMIC_RELEASE);
+
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Resolve a path, consulting the lookup cache first (same contract as walk_uncached()).
+// Only full lookups (want_parent = 0) are cached; parent lookups for create/remove go straight to the tree.
+// r is the caller's reader slot, which collects the cache counters.
+static node_t *walk_from(fs_t *fs, node_t *start,
+                         const char *path,
+                         int want_parent,
+                         char out_leaf[NAME_MAX+1],
+                         reader_slot_t *r) {
+    if (want_parent || !fs->dcache) return walk_uncached(fs, start, path, want_parent, out_leaf);
+
+    // Absolute paths resolve the same from anywhere, so they share one key.
+    node_t *key = (path[0] == '/') ? NULL : (start ? start : fs->root);
+
+    size_t len = strlen(path);
+    if (len >= DCACHE_PATH_MAX) {
+        __atomic_add_fetch(&r->bypassed, 1, __ATOMIC_RELAXED);
+        return walk_uncached(fs, start, path, 0, NULL);
+    }
+    uint64_t words[DCACHE_PATH_MAX / 8] = {0};
+    memcpy(words, path, len + 1);
+
+    dcache_entry_t *e = &fs->dcache[dcache_hash(key, path)];
+    uint64_t gen_pos = __atomic_load_n(&fs->dcache_pos_gen, __ATOMIC_ACQUIRE);
+    uint64_t gen_neg = __atomic_load_n(&fs->dcache_neg_gen, __ATOMIC_ACQUIRE);
+    node_t *n;
+    if (dcache_lookup(e, key, words, len / 8 + 1, gen_pos, gen_neg, &n)) {
+        __atomic_add_fetch(&r->hits, 1, __ATOMIC_RELAXED);
+        if (!n) __atomic_add_fetch(&r->negative_hits, 1, __ATOMIC_RELAXED);
+        return n;
+    }
+
+    // Miss: walk the tree and remember the answer (positive or negative). The generations were
+    // read before the walk, so a change made meanwhile leaves the new entry already stale.
+    __atomic_add_fetch(&r->misses, 1, __ATOMIC_RELAXED);
+    n = walk_uncached(fs, start, path, 0, NULL);
+    dcache_fill(e, key, words, n ? gen_pos : gen_neg, n);
+    return n;
+}
+
+// Retrieve path lookup cache counters.
+void fsi_get_dcache_stats(fs_t *fs, dcache_stats_t *stats) {
+    if (!stats) return;
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < EBR_SLOTS; i++) {
+        stats->hits += __atomic_load_n(&fs->readers[i].hits, __ATOMIC_RELAXED);
+        stats->negative_hits += __atomic_load_n(&fs->readers[i].negative_hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&fs->readers[i].misses, __ATOMIC_RELAXED);
+        stats->bypassed += __atomic_load_n(&fs->readers[i].bypassed, __ATOMIC_RELAXED);
+    }
+    stats->invalidations = __atomic_load_n(&fs->dcache_invalidations, __ATOMIC_RELAXED);
+    stats->capacity = fs->dcache ? DCACHE_SIZE : 0;
+}
+
+// A session's working directory, as seen by a lock-free walk. Another thread using the same
+// session may change directory at any time, so this is only valid inside a read section.
+static node_t *cwd_get(fs_session_t *ss) {
+    return __atomic_load_n(&ss->cwd, __ATOMIC_ACQUIRE);
+}
+
+// Resolve a path relative to a session's working directory.
+// The result is returned locked in mode (LK_READ or LK_WRITE); release it with node_unlock().
+// With want_parent the containing directory is returned (locked in mode) and the last component
+// is copied to out_leaf. Only the node returned is ever locked.
+static node_t *walk(fs_session_t *ss, const char *path, int want_parent, char out_leaf[NAME_MAX+1], int mode) {
+    if (!path) return NULL;
+    fs_t *fs = ss->fs;
+
+    for (;;) {
+        unsigned parity;
+        reader_slot_t *r = ebr_enter(fs, &parity);
+        node_t *start = path[0] == '/' ? NULL : cwd_get(ss);
+        node_t *n = walk_from(fs, start, path, want_parent, out_leaf, r);
+        if (n && dir_ready(fs, n) < 0) n = NULL; // Whatever the caller does next may need its children.
+        if (n) {
+            // Removal unlinks under the node's write lock, so once we hold the lock the node
+            // stays in the tree. If it was removed before that, the path may now name another node.
+            node_lock(n, mode);
+            if (!node_linked(fs, n)) {
+                node_unlock(n);
+                ebr_exit(r, parity);
+                continue;
+            }
+        }
+        ebr_exit(r, parity);
+        return n;
+    }
+}
+
+int fss_cd(fs_session_t *ss, const char *path) {
+    node_t *d = walk(ss, path, 0, NULL, LK_READ);
+    if (!d) return -1;
+    if (d->type != N_DIR) {
+        node_unlock(d);
+        return -1;
+    }
+
+    // The working directory stays pinned, so it cannot be removed.
+    node_pin(d);
+    
+    // Update access time since we accessed the directory.
+    stamp(&d->accessed, time(NULL));
+    node_unlock(d);
+
+    node_t *old = __atomic_exchange_n(&ss->cwd, d, __ATOMIC_ACQ_REL);
+    node_unpin(old);
+    
+    return 0;
+}
+
+int fss_mkdir_p(fs_session_t *ss, const char *path) {
+    fs_t *fs = ss->fs;
+    if (!path) return -1;
+
+    // Existing components are walked lock-free; only a directory we add to is locked.
+    unsigned parity;
+    reader_slot_t *r = ebr_enter(fs, &parity);
+    node_t *cur = path[0] == '/' ? fs->root : cwd_get(ss);
+    int rc = 0;
+    uint64_t seq = 0; // Last journal record of a directory created here.
+
+    // Case: just "/", "//" or "" yields no components and there is nothing to do.
+    const char *tok;
+    size_t len;
+    while (path_next(&path, &tok, &len)) {
+        if (len > NAME_MAX) {
+            rc = -1;
+            break;
+        }
+
+        if (tok_is_dot(tok, len)) {
+            // stay
+        } else if (tok_is_dotdot(tok, len)) {
+            node_t *p = node_parent(cur);
+            if (p) cur = p;
+        } else {
+            // normal directory name
+            if (dir_ready(fs, cur) < 0) {
+                rc = -1;
+                break;
+            }
+            node_t *n = dir_find(cur, tok, len);
+            if (!n) {
+                // Creating needs the write lock. Another thread may have created the same
+                // directory (or removed cur) meanwhile, so check again once we have it.
+                node_lock(cur, LK_WRITE);
+                if (!node_linked(fs, cur)) {
+                    node_unlock(cur);
+                    rc = -1;
+                    break;
+                }
+                n = dir_find(cur, tok, len);
+                if (!n) {
+                    if (node_cow(fs, cur) < 0) {
+                        node_unlock(cur);
+                        rc = -1;
+                        break;
+                    }
+                    n = node_new(fs, N_DIR, tok, len, cur);
+                    if (!dir_add(fs, cur, n)) {
+                        node_free(fs, n);
+                        node_unlock(cur);
+                        rc = -1;
+                        break;
+                    }
+                    node_archive(cur);
+                    node_archive(n);
+                    seq = journal_log(fs, (journal_record_t){ .op = JOP_MKDIR }, cur, n->name, NULL, 0);
+                }
+                node_unlock(cur);
+            } else if (n->type == N_DIR) {
+                // Update accessed time when traversing through existing directory.
+                stamp(&n->accessed, time(NULL));
+            }
+            if (n->type != N_DIR) {
+                // trying to mkdir where a file already exists
+                rc = -1;
+                break;
+            }
+            cur = n;
+        }
+    }
+
+    ebr_exit(r, parity);
+    journal_commit(fs, seq);
+    return rc;
+}
+
+// Implements empty file creation in file system.
+int fss_create_file(fs_session_t *ss, const char *path) {
+    fs_t *fs = ss->fs;
+
+    // Parse path for file creation using leaf buffer (stores the filename, which is the last component of the path).
+    char leaf[NAME_MAX + 1] = {0};
+
+    // Use want_parent = 1 to get the parent directory. 
+    // For example, for "/documents/myfile.txt", returns "documents/" and puts "myfile.txt" in leaf.
+    // The parent comes back write-locked, so the checks below and the insert are one step.
+    node_t *parent = walk(ss, path, 1, leaf, LK_WRITE);
+
+    // Validate that the parent exists and it is a directory node.
+    if (!parent) return -1;
+    int rc = -1;
+    uint64_t seq = 0;
+    if (parent->type!=N_DIR) goto out;
+
+    // Validate leaf before creation (some of these are already checked by shell.c and other fs.c functions, but we want to make our program more robust).
+    if (leaf[0] == '\0') goto out; // Don't want to create files with empty names.
+    if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) goto out; // Prevent "." and ".." as file names.
+    if (strlen(leaf) > NAME_MAX) goto out; // Prevent names that are too long.
+
+    // Prevent duplicate file creation so that we don't overwrite.
+    if (dir_find(parent, leaf, strlen(leaf))) goto out;
+
+    // Prevent file creation if parent directory is READ_ONLY.
+    if (parent->attributes & ATTR_READONLY) goto out;
+
+    // Create file node.
+    if (node_cow(fs, parent) < 0) goto out;
+    node_t *f = node_new(fs, N_FILE, leaf, strlen(leaf), parent);
+    if (!dir_add(fs, parent, f)) {
+        node_free(fs, f);
+        goto out;
+    }
+
+    // Though file metadata is handled by node_new(), we need to update the parent directory metadata.
+    time_t now = time(NULL);
+    stamp(&parent->modified, now);
+    stamp(&parent->accessed, now);
+    node_archive(parent);
+    node_archive(f);
+    rc = 0;
+    seq = journal_log(fs, (journal_record_t){ .op = JOP_CREATE }, parent, leaf, NULL, 0);
+
+out:
+    node_unlock(parent);
+    journal_commit(fs, seq);
+
+    // Return result.
+    return rc;
+}
+
+// File storage helpers:
+// A file's allocated chunks are kept in an array sorted by chunk index. Chunks missing from the
+// array are holes: they take no memory and read back as zeros. Allocated bytes at or beyond
+// the file size are always zero, so extending a file never exposes stale data.
+// Callers hold the file's lock: shared for reads and views, exclusive for anything that modifies.
+
+// Find the extent for chunk ci, or NULL if that chunk is a hole. Files written without holes
+// hit the direct-index fast path; sparse files fall back to binary search.
+// If pos is given, it receives the index where the chunk is (or would be inserted).
+static file_extent_t *extent_find(file_node_t *f, size_t ci, size_t *pos) {
+    if (ci < f->nextents && f->extents[ci].index == ci) {
+        if (pos) *pos = ci;
+        return &f->extents[ci];
+    }
+
+    size_t lo = 0, hi = f->nextents;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (f->extents[mid].index < ci) lo = mid + 1;
+        else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return (lo < f->nextents && f->extents[lo].index == ci) ? &f->extents[lo] : NULL;
+}
+
+// Make room in the extents array for at least extra more chunks (grows by doubling).
+static int extent_reserve(file_node_t *f, size_t extra) {
+    if (f->nextents + extra <= f->extent_cap) return 0;
+
+    size_t newcap = f->extent_cap ? f->extent_cap * 2 : 4;
+    if (newcap < f->nextents + extra) newcap = f->nextents + extra;
+    file_extent_t *t = realloc(f->extents, newcap * sizeof(*t));
+    if (!t) return -1;
+    f->extents = t;
+    f->extent_cap = newcap;
+    return 0;
+}
+
+// Make sure chunk ci is allocated, writable, and has room for at least want bytes
+// (want <= FS_CHUNK_SIZE). A chunk pinned by a read view is copied first (copy-on-write).
+static file_extent_t *extent_get(file_node_t *f, size_t ci, size_t want) {
+    size_t pos;
+    file_extent_t *e = extent_find(f, ci, &pos);
+    if (e && !chunk_shared(e->chunk) && e->chunk->cap >= want) return e;
+
+    // Only chunk 0 is kept smaller than a full chunk, so small files stay small. It starts at
+    // 64 bytes and doubles; every other chunk is allocated full size and never copied.
+    size_t old = e ? e->chunk->cap : 0;
+    size_t cap = FS_CHUNK_SIZE;
+    if (ci == 0) {
+        cap = old ? old : 64;
+        while (cap < want) cap *= 2; // Double space until we have sufficient storage capacity.
+        if (cap > FS_CHUNK_SIZE) cap = FS_CHUNK_SIZE;
+    }
+
+    if (e) {
+        fs_chunk_t *c;
+        if (!chunk_shared(e->chunk)) {
+            // Grow the unshared (partial) chunk 0 in place and zero the new bytes.
+            c = realloc(e->chunk, sizeof(*c) + cap);
+            if (!c) return NULL; // Error handling if allocation fails (out of memory).
+            memset(c->data + old, 0, cap - old);
+            c->cap = cap;
+        } else {
+            // A view still points at this chunk: give the file its own copy.
+            c = chunk_new(cap);
+            if (!c) return NULL;
+            memcpy(c->data, e->chunk->data, old);
+            chunk_put(e->chunk);
+        }
+        f->allocated += cap - old;
+        e->chunk = c;
+        return e;
+    }
+
+    // Otherwise insert a new zeroed chunk at its sorted position. Appending inserts at the end;
+    // filling a hole in the middle shifts the (small) extent entries after it.
+    if (extent_reserve(f, 1) < 0) return NULL;
+    fs_chunk_t *c = chunk_new(cap);
+    if (!c) return NULL;
+    memmove(&f->extents[pos + 1], &f->extents[pos], (f->nextents - pos) * sizeof(*f->extents));
+    f->extents[pos] = (file_extent_t){ ci, c };
+    f->nextents++;
+    f->allocated += cap;
+    return &f->extents[pos];
+}
+
+// Move inline contents into chunk 0 so the file can use chunks (the extents array starts empty).
+static int file_uninline(file_node_t *f) {
+    uint8_t keep[FS_INLINE_MAX];
+    size_t n = f->size < FS_INLINE_MAX ? f->size : FS_INLINE_MAX;
+    memcpy(keep, f->inline_data, n);
+
+    f->extents = NULL;
+    f->extent_cap = 0;
+    if (n == 0) return 0;
+
+    file_extent_t *e = extent_get(f, 0, n);
+    if (!e) {
+        // Put the contents back inline (extent_get may have allocated the array).
+        free(f->extents);
+        memset(f->inline_data, 0, FS_INLINE_MAX);
+        memcpy(f->inline_data, keep, n);
+        return -1;
+    }
+    memcpy(e->chunk->data, keep, n);
+    return 0;
+}
+
+// Free every chunk and the extents array, returning the file to (zeroed) inline storage.
+static void file_drop_extents(file_node_t *f) {
+    for (size_t i = 0; i < f->nextents; i++) chunk_put(f->extents[i].chunk);
+    free(f->extents);
+    f->nextents = 0;
+    f->allocated = 0;
+    memset(f->inline_data, 0, FS_INLINE_MAX);
+}
+
+// Mapped files:
+// A file materialized from a mapped image (see fs_map()) keeps reading its contents from the image,
+// through the extent table there, until the first change copies them into ordinary storage.
+
+// Give an empty file ordinary storage holding count extents of an image (inline if they fit,
+// chunks otherwise). On failure the file is left empty.
+static int file_fill(file_node_t *f, const uint8_t *img, const image_extent_t *ext, size_t count) {
+    if (count == 0) return 0;
+    if (count == 1 && ext[0].index == 0 && ext[0].len <= FS_INLINE_MAX) {
+        memcpy(f->inline_data, img + ext[0].off, ext[0].len);
+        return 0;
+    }
+
+    file_extent_t *e = malloc(count * sizeof(*e));
+    if (!e) return -1;
+    f->extents = e;
+    f->extent_cap = count;
+    for (size_t j = 0; j < count; j++) {
+        // Chunk 0 gets the same doubling size a write of these bytes would have given it.
+        size_t cap = FS_CHUNK_SIZE;
+        if (ext[j].index == 0) {
+            for (cap = 64; cap < ext[j].len; cap *= 2) continue;
+        }
+        fs_chunk_t *c = chunk_new(cap);
+        if (!c) {
+            file_drop_extents(f);
+            return -1;
+        }
+        memcpy(c->data, img + ext[j].off, ext[j].len);
+        f->extents[f->nextents++] = (file_extent_t){ ext[j].index, c };
+        f->allocated += cap;
+    }
+    return 0;
+}
+
+// Move a mapped file's contents into ordinary storage before it is changed (the caller holds its
+// write lock). Does nothing for other files.
+static int file_unmap(file_node_t *f) {
+    if (!f->image) return 0;
+    const uint8_t *img = f->image;
+    const image_extent_t *ext = f->image_ext;
+    size_t count = f->image_count;
+
+    f->image = NULL;
+    memset(f->inline_data, 0, FS_INLINE_MAX);
+    if (file_fill(f, img, ext, count) < 0) {
+        f->image = img;
+        f->image_ext = ext;
+        f->image_count = count;
+        return -1;
+    }
+    return 0;
+}
+
+// Stored bytes of chunk ci (not for inline files): a pointer to them and how many there are in
+// *have (0 for a hole). *chunk receives the chunk to pin, or NULL if the bytes are in a mapped image.
+static const uint8_t *file_chunk(file_node_t *f, size_t ci, size_t *have, fs_chunk_t **chunk) {
+    *have = 0;
+    *chunk = NULL;
+    if (f->image) {
+        size_t lo = 0, hi = f->image_count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (f->image_ext[mid].index < ci) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == f->image_count || f->image_ext[lo].index != ci) return NULL;
+        *have = f->image_ext[lo].len;
+        return f->image + f->image_ext[lo].off;
+    }
+    file_extent_t *e = extent_find(f, ci, NULL);
+    if (!e) return NULL;
+    *have = e->chunk->cap;
+    *chunk = e->chunk;
+    return e->chunk->data;
+}
+
+// Implements dynamic memory management to handle growing file storage as per needs.
+// Makes sure every chunk touched by the byte range [off, off+len) is allocated. Nothing outside
+// the range is allocated, so writing far past the end of a file leaves a hole instead of
+// materializing the bytes in between.
+static int ensure_cap(file_node_t *f, size_t off, size_t len) {
+    if (len == 0) return 0;
+    if (file_unmap(f) < 0) return -1;
+
+    // Tiny files need no allocation until a write reaches past the inline buffer.
+    if (f->nextents == 0) {
+        if (off + len <= FS_INLINE_MAX) return 0;
+        if (file_uninline(f) < 0) return -1;
+    }
+
+    // Size the extents array once for chunks past the current last one (the common append case).
+    size_t first = off / FS_CHUNK_SIZE, last = (off + len - 1) / FS_CHUNK_SIZE;
+    if (f->nextents && f->extents[f->nextents - 1].index >= first) first = f->extents[f->nextents - 1].index + 1;
+    if (last >= first && extent_reserve(f, last - first + 1) < 0) goto fail;
+
+    for (size_t pos = off, left = len; left > 0; ) {
+        size_t in_chunk = pos % FS_CHUNK_SIZE; // Offset within the chunk.
+        size_t n = FS_CHUNK_SIZE - in_chunk; // Bytes until the end of the chunk.
+        if (n > left) n = left;
+        if (!extent_get(f, pos / FS_CHUNK_SIZE, in_chunk + n)) goto fail;
+        pos += n;
+        left -= n;
+    }
+    return 0; 
+
+fail:
+    // An empty file that was just moved out of inline storage goes back to it.
+    if (f->nextents == 0) file_drop_extents(f);
+    return -1;
+}
+
+// Copy len bytes from src into the file at offset off, one chunk at a time.
+// The range must already be backed by writable chunks (see ensure_cap()).
+static void file_copy_in(file_node_t *f, size_t off, const uint8_t *src, size_t len) {
+    if (len == 0) return;
+    if (f->nextents == 0) {
+        memcpy(f->inline_data + off, src, len); // ensure_cap() left the range inline.
+        return;
+    }
+    for (size_t pos = off, left = len; left > 0; ) {
+        size_t in_chunk = pos % FS_CHUNK_SIZE; // Offset within the chunk.
+        size_t n = FS_CHUNK_SIZE - in_chunk; // Bytes until the end of the chunk.
+        if (n > left) n = left;
+        memcpy(extent_find(f, pos / FS_CHUNK_SIZE, NULL)->chunk->data + in_chunk, src, n);
+        src += n;
+        pos += n;
+        left -= n;
+    }
+}
+
+// Copy len bytes at offset off out of the file into dst, one chunk at a time.
+// Holes, and the part of a partial chunk 0 beyond its capacity, read as zeros.
+static void file_copy_out(file_node_t *f, size_t off, uint8_t *dst, size_t len) {
+    if (f->nextents == 0 && !f->image) {
+        size_t have = off < FS_INLINE_MAX ? FS_INLINE_MAX - off : 0; // Inline bytes available here.
+        if (have > len) have = len;
+        if (have) memcpy(dst, f->inline_data + off, have);
+        if (have < len) memset(dst + have, 0, len - have);
+        return;
+    }
+    for (size_t pos = off, left = len; left > 0; ) {
+        size_t in_chunk = pos % FS_CHUNK_SIZE; // Offset within the chunk.
+        size_t k = FS_CHUNK_SIZE - in_chunk; // Bytes until the end of the chunk.
+        if (k > left) k = left;
+
+        size_t have;
+        fs_chunk_t *c;
+        const uint8_t *data = file_chunk(f, pos / FS_CHUNK_SIZE, &have, &c);
+        have = have > in_chunk ? have - in_chunk : 0; // Stored bytes available here.
+        if (have > k) have = k;
+        if (have) memcpy(dst, data + in_chunk, have);
+        if (have < k) memset(dst + have, 0, k - have);
+
+        dst += k;
+        pos += k;
+        left -= k;
+    }
+}
+
+// Write iovcnt buffers back to back into file node f starting at offset off
+// (shared by write_file, fs_pwrite and fs_writev).
+static ssize_t file_writev(file_node_t *f, size_t off, const struct iovec *iov, int iovcnt) {
+
+    // Calculate the total space needed for write operation.
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SIZE_MAX - len) return -1;
+        len += iov[i].iov_len;
+    }
+    if (len > SIZE_MAX - off) return -1; // Reject offsets that would overflow.
+    size_t need = off + len; // Need is the total file size required AFTER the write.
+
+    // Ensure the whole written range is backed by storage with a single call to ensure_cap().
+    if (ensure_cap(f, off, len) < 0) return -1;
+
+    // Copy each buffer to its write location.
+    size_t pos = off;
+    for (int i = 0; i < iovcnt; i++) {
+        file_copy_in(f, pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+
+    // Update the file size if write extended file.
+    if (need > f->size) f->size = need;
+
+    // Update metadata once for the batch: file was modified and accessed.
+    time_t now = time(NULL);
+    stamp(&f->base.modified, now);
+    stamp(&f->base.accessed, now);
+
+    // Return success.
+    return (ssize_t)len;
+}
+
+// Change the size of file node f (shared by fs_truncate).
+// Shrinking frees every chunk wholly past the new end and zeroes the rest of the last one;
+// extending just moves the end, leaving a hole that reads back as zeros.
+static int file_truncate(file_node_t *f, size_t size) {
+    // Emptying a mapped file needs nothing from the image; otherwise copy out what is kept.
+    if (f->image && size == 0) {
+        f->image = NULL;
+        memset(f->inline_data, 0, FS_INLINE_MAX);
+    } else if (file_unmap(f) < 0) {
+        return -1;
+    }
+
+    if (size < f->size && f->nextents == 0) {
+
+        // Inline contents: just zero the bytes past the new end.
+        if (size < FS_INLINE_MAX) memset(f->inline_data + size, 0, FS_INLINE_MAX - size);
+    } else if (size < f->size && size <= FS_INLINE_MAX) {
+
+        // Small enough to live inline again: keep the remaining bytes and free every chunk.
+        uint8_t keep[FS_INLINE_MAX];
+        file_copy_out(f, 0, keep, size);
+        file_drop_extents(f);
+        memcpy(f->inline_data, keep, size);
+    } else if (size < f->size) {
+
+        // Drop chunks that lie entirely at or beyond the new end. Chunks still pinned by a
+        // read view are freed when the view is released.
+        size_t keep = size / FS_CHUNK_SIZE + (size % FS_CHUNK_SIZE != 0); // Chunks that may still hold data.
+        size_t pos;
+        extent_find(f, keep, &pos);
+        for (size_t i = pos; i < f->nextents; i++) {
+            f->allocated -= f->extents[i].chunk->cap;
+            chunk_put(f->extents[i].chunk);
+        }
+        f->nextents = pos;
+        if (f->nextents == 0) file_drop_extents(f); // Only holes remain.
+
+        // Give back a partial chunk 0's memory above the new size (it is kept at a power of two, >= 64).
+        file_extent_t *e = f->nextents ? extent_find(f, 0, NULL) : NULL;
+        if (e && size < FS_CHUNK_SIZE) {
+            size_t cap = 64, old = e->chunk->cap;
+            while (cap < size) cap *= 2;
+            if (cap < old) {
+                fs_chunk_t *c;
+                if (!chunk_shared(e->chunk)) {
+                    c = realloc(e->chunk, sizeof(*c) + cap);
+                    if (!c) return -1;
+                } else {
+                    c = chunk_new(cap);
+                    if (!c) return -1;
+                    memcpy(c->data, e->chunk->data, cap);
+                    chunk_put(e->chunk);
+                }
+                f->allocated -= old - cap;
+                c->cap = cap;
+                e->chunk = c;
+            }
+        }
+
+        // Zero the bytes past the new end in the last remaining chunk (copying it first if a view holds it).
+        size_t in_chunk = size % FS_CHUNK_SIZE;
+        e = in_chunk ? extent_find(f, size / FS_CHUNK_SIZE, NULL) : NULL;
+        if (e && e->chunk->cap > in_chunk) {
+            e = extent_get(f, size / FS_CHUNK_SIZE, 0);
+            if (!e) return -1;
+            memset(e->chunk->data + in_chunk, 0, e->chunk->cap - in_chunk);
+        }
+
+        // Release most of the extents array too once it is largely empty.
+        if (f->nextents && f->extent_cap > 4 && f->nextents < f->extent_cap / 4) {
+            size_t newcap = f->nextents > 2 ? f->nextents * 2 : 4;
+            file_extent_t *t = realloc(f->extents, newcap * sizeof(*t));
+            if (t) {
+                f->extents = t;
+                f->extent_cap = newcap;
+            }
+        }
+    }
+    f->size = size;
+
+    // Update metadata: file was modified and accessed.
+    time_t now = time(NULL);
+    stamp(&f->base.modified, now);
+    stamp(&f->base.accessed, now);
+    return 0;
+}
+
+// Write len bytes from buf into file node f at offset off.
+static ssize_t file_write(file_node_t *f, size_t off, const void *buf, size_t len) {
+    struct iovec iov = { (void *)buf, len };
+    return file_writev(f, off, &iov, 1);
+}
+
+// Write len bytes at the current end of file node f. The offset is read and the write done as
+// one step under the file's write lock, so concurrent appenders never overwrite each other. *off receives where the data landed.
+static ssize_t file_append(file_node_t *f, const void *buf, size_t len, size_t *off) {
+    size_t at = f->size;
+    ssize_t n = file_write(f, at, buf, len);
+    if (n >= 0 && off) *off = at;
+    return n;
+}
+
+// Read into iovcnt buffers in order from file node f starting at offset off
+// (shared by read_file, fs_pread and fs_readv). Stops early at end-of-file.
+static ssize_t file_readv(file_node_t *f, size_t off, const struct iovec *iov, int iovcnt) {
+
+    // Check for end-of-file (offset is at or beyond file size).
+    if (off >= f->size) return 0; // If EOF detected, return 0 to indicate no bytes were read.
+
+    // Bytes available from offset to EOF.
+    size_t avail = f->size - off;
+
+    // Fill each buffer in turn until the data runs out.
+    size_t total = 0;
+    for (int i = 0; i < iovcnt && total < avail; i++) {
+        size_t n = iov[i].iov_len;
+        if (n > avail - total) n = avail - total; // Don't read past EOF.
+        file_copy_out(f, off + total, iov[i].iov_base, n);
+        total += n;
+    }
+
+    // Update metadata once for the batch: file was accessed.
+    stamp(&f->base.accessed, time(NULL));
+
+    // Return bytes read, similar to UNIX readv().
+    return (ssize_t)total;
+}
+
+// Read up to len bytes from file node f at offset off into buf.
+static ssize_t file_read(file_node_t *f, size_t off, void *buf, size_t len) {
+    struct iovec iov = { buf, len };
+    return file_readv(f, off, &iov, 1);
+}
+
+// Holes (and the unallocated tail of a partial chunk 0) are viewed through this shared zero chunk.
+static const uint8_t zero_chunk[FS_CHUNK_SIZE];
+
+// Build a zero-copy view of up to len bytes at offset off.
+// Each piece of a chunk becomes one segment, and every stored chunk referenced is pinned.
+static ssize_t file_pin(file_node_t *f, size_t off, size_t len, fs_view_t *view) {
+    memset(view, 0, sizeof(*view));
+
+    // Clamp to end-of-file exactly like file_read().
+    size_t n = off < f->size ? f->size - off : 0;
+    if (n > len) n = len;
+    if (n == 0) return 0;
+
+    // A segment never spans a chunk boundary; a piece of a partial chunk 0 may need two
+    // (stored bytes, then zeros), hence the extra one.
+    size_t first = off / FS_CHUNK_SIZE, last = (off + n - 1) / FS_CHUNK_SIZE;
+    size_t max = last - first + 2;
+    view->segs = malloc(max * sizeof(*view->segs));
+    view->pins = malloc(max * sizeof(*view->pins));
+    if (!view->segs || !view->pins) {
+        fs_view_release(view);
+        return -1;
+    }
+
+    // Inline contents live in the node itself, which writers update in place. The view gets its
+    // own copy of those (at most FS_INLINE_MAX) bytes, pinned like any other chunk.
+    fs_chunk_t *inl = NULL;
+    if (f->nextents == 0 && !f->image && off < FS_INLINE_MAX) {
+        inl = chunk_new(FS_INLINE_MAX);
+        if (!inl) {
+            fs_view_release(view);
+            return -1;
+        }
+        memcpy(inl->data, f->inline_data, FS_INLINE_MAX);
+    }
+
+    for (size_t pos = off, left = n; left > 0; ) {
+        size_t in_chunk = pos % FS_CHUNK_SIZE; // Offset within the chunk.
+        size_t k = FS_CHUNK_SIZE - in_chunk; // Bytes until the end of the chunk.
+        if (k > left) k = left;
+
+        // Bytes in a mapped image need no pin: they stay put until the image is unmapped.
+        size_t have = 0;
+        fs_chunk_t *c = inl;
+        const uint8_t *data = NULL;
+        if (inl && pos < FS_CHUNK_SIZE) {
+            data = inl->data;
+            have = inl->cap;
+        } else if (!inl) {
+            data = file_chunk(f, pos / FS_CHUNK_SIZE, &have, &c);
+        }
+        have = have > in_chunk ? have - in_chunk : 0;
+        if (have > k) have = k;
+        if (have) {
+            if (c) {
+                chunk_get(c);
+                view->pins[view->npins++] = c;
+            }
+            view->segs[view->nsegs++] = (fs_segment_t){ data + in_chunk, have };
+        }
+        if (have < k) view->segs[view->nsegs++] = (fs_segment_t){ zero_chunk, k - have };
+
+        pos += k;
+        left -= k;
+    }
+    view->len = n;
+    chunk_put(inl); // The view's pin now owns the copy.
+    return (ssize_t)n;
+}
+
+// The same, counting as an access to the file (shared by read_file_view and fs_pread_view;
+// snapshot reads use file_pin() directly).
+static ssize_t file_view(file_node_t *f, size_t off, size_t len, fs_view_t *view) {
+    ssize_t n = file_pin(f, off, len, view);
+
+    // Update metadata: file was accessed.
+    if (n > 0) stamp(&f->base.accessed, time(NULL));
+    return n;
+}
+
+// Implementats file write operation at a specific offset.
+// path: file path.
+// off: byte offset indicating where to start writing.
+// buf: pointer to data to write.
+// len: number of bytes to write.
+ssize_t fss_write_file(fs_session_t *ss, const char *path, size_t off, const void *buf, size_t len) {
+
+    // Find the file to write to using walk() & want_parent = 0, which will return actual file node (write-locked).
+    node_t *f = walk(ss, path, 0, NULL, LK_WRITE);
+    if (!f) return -1;
+
+    // Validate that the file is not a directory.
+    ssize_t n = f->type == N_FILE && node_cow(ss->fs, f) == 0 ? file_write(as_file(f), off, buf, len) : -1;
+    if (n >= 0) node_archive(f);
+    struct iovec iov = { (void *)buf, len };
+    uint64_t seq = n >= 0 ? journal_log(ss->fs, (journal_record_t){ .op = JOP_WRITE, .a = off, .b = len }, f, NULL, &iov, 1) : 0;
+    node_unlock(f);
+    journal_commit(ss->fs, seq);
+    return n;
+}
+
+// Implements file read operation starting from a specific offset.
+// Same parameters as write_file().
+ssize_t fss_read_file(fs_session_t *ss, const char *path, size_t off, void *buf, size_t len) {
+
+    // Find the file to read from using walk() and want_parent = 0 to find the file node (read-locked).
+    node_t *f = walk(ss, path, 0, NULL, LK_READ);
+    if (!f) return -1;
+
+    // Validate that the file is not a directory.
+    ssize_t n = f->type == N_FILE ? file_read(as_file(f), off, buf, len) : -1;
+    node_unlock(f);
+    return n;
+}
+
+// Write several buffers back to back into a file starting at offset off.
+// Like write_file(), but the path is resolved, capacity reserved and metadata updated once for all of them.
+ssize_t fss_writev(fs_session_t *ss, const char *path, size_t off, const struct iovec *iov, int iovcnt) {
+    if (!iov || iovcnt < 0) return -1;
+
+    // Find the file to write to using walk() & want_parent = 0, which will return actual file node (write-locked).
+    node_t *f = walk(ss, path, 0, NULL, LK_WRITE);
+    if (!f) return -1;
+
+    // Validate that the file is not a directory.
+    ssize_t n = f->type == N_FILE && node_cow(ss->fs, f) == 0 ? file_writev(as_file(f), off, iov, iovcnt) : -1;
+    if (n >= 0) node_archive(f);
+    uint64_t seq = n >= 0 ? journal_log(ss->fs, (journal_record_t){ .op = JOP_WRITE, .a = off, .b = (uint64_t)n }, f, NULL, iov, iovcnt) : 0;
+    node_unlock(f);
+    journal_commit(ss->fs, seq);
+    return n;
+}
+
+// Read from a file starting at offset off into several buffers in order.
+// Like read_file(), but the path is resolved and metadata updated once for all of them.
+ssize_t fss_readv(fs_session_t *ss, const char *path, size_t off, const struct iovec *iov, int iovcnt) {
+    if (!iov || iovcnt < 0) return -1;
+
+    // Find the file to read from using walk() and want_parent = 0 to find the file node (read-locked).
+    node_t *f = walk(ss, path, 0, NULL, LK_READ);
+    if (!f) return -1;
+
+    // Validate that the file is not a directory.
+    ssize_t n = f->type == N_FILE ? file_readv(as_file(f), off, iov, iovcnt) : -1;
+    node_unlock(f);
+    return n;
+}
+
+// Set a file's size. Shrinking releases storage above the new size; extending adds a hole
+// that reads back as zeros.
+int fss_truncate(fs_session_t *ss, const char *path, size_t size) {
+    node_t *f = walk(ss, path, 0, NULL, LK_WRITE);
+    if (!f) return -1;
+    int rc = f->type == N_FILE && node_cow(ss->fs, f) == 0 ? file_truncate(as_file(f), size) : -1;
+    if (rc == 0) node_archive(f);
+    uint64_t seq = rc == 0 ? journal_log(ss->fs, (journal_record_t){ .op = JOP_TRUNCATE, .a = size }, f, NULL, NULL, 0) : 0;
+    node_unlock(f);
+    journal_commit(ss->fs, seq);
+    return rc;
+}
+
+// Allocate storage for the byte range [off, off+len) without changing the file size, so
+// later writes there need no allocation. Already allocated chunks are left as they are.
+int fss_fallocate(fs_session_t *ss, const char *path, size_t off, size_t len) {
+    if (len > SIZE_MAX - off) return -1; // Reject ranges that would overflow.
+    node_t *f = walk(ss, path, 0, NULL, LK_WRITE);
+    if (!f) return -1;
+    int rc = f->type == N_FILE && node_cow(ss->fs, f) == 0 ? ensure_cap(as_file(f), off, len) : -1;
+    uint64_t seq = rc == 0 ? journal_log(ss->fs, (journal_record_t){ .op = JOP_FALLOCATE, .a = off, .b = len }, f, NULL, NULL, 0) : 0;
+    node_unlock(f);
+    journal_commit(ss->fs, seq);
+    return rc;
+}
+
+// Borrow a range of a file without copying it (see fs_view_t in fs.h).
+// Same parameters as read_file(), except the data is returned through view.
+ssize_t fss_read_file_view(fs_session_t *ss, const char *path, size_t off, size_t len, fs_view_t *view) {
+    if (!view) return -1;
+
+    // Find the file to view using walk() and want_parent = 0 to find the file node (read-locked).
+    node_t *f = walk(ss, path, 0, NULL, LK_READ);
+    if (!f) return -1;
+
+    // Validate that the file is not a directory.
+    ssize_t n = f->type == N_FILE ? file_view(as_file(f), off, len, view) : -1;
+    node_unlock(f);
+    return n;
+}
+
+// Release a view: unpin its chunks (freeing any the file no longer uses) and free the segment list.
+void fs_view_release(fs_view_t *view) {
+    if (!view) return;
+    for (size_t i = 0; i < view->npins; i++) chunk_put(view->pins[i]);
+    free(view->segs);
+    free(view->pins);
+    memset(view, 0, sizeof(*view));
+}
+
+// Drop a file that was detached from the tree (the caller holds its write lock, which this releases).
+// It is retired now unless open handles still refer to it, in which case the last fs_close()
+// retires it (parent == NULL marks it unlinked).
+static void node_unlink(fs_t *fs, node_t *n) {
+    int unused = __atomic_load_n(&n->refcount, __ATOMIC_ACQUIRE) == 0;
+    node_unlock(n);
+    if (unused) node_retire(fs, n);
+}
+
+// Implements file deletion/removal from file system.
+int fss_rm_file(fs_session_t *ss, const char *path) {
+    fs_t *fs = ss->fs;
+
+    // Parse path to get parent directory.
+    char leaf[NAME_MAX+1]={0}; // Stores filename to be deleted.
+    node_t *parent = walk(ss, path, 1, leaf, LK_WRITE); // Use walk() & want_parent = 1 to get the containing directory (write-locked).
+    if (!parent) return -1; 
+
+    // Prevent removal of a file in a READ_ONLY directory.
+    if (parent->attributes & ATTR_READONLY) {
+        node_unlock(parent);
+        return -1;
+    }
+
+    // Look the file up in the parent directory's hash table.
+    node_t *c = dir_find(parent, leaf, strlen(leaf));
+
+    // Name must match filename (leaf) and the node type must be a file, not a directory.
+    if (!c || c->type != N_FILE) {
+        node_unlock(parent);
+        return -1;
+    }
+
+    // Wait for everyone still reading or writing the file.
+    node_lock(c, LK_WRITE);
+
+    // Prevent removal of a READ_ONLY file.
+    if (c->attributes & ATTR_READONLY) {
+        node_unlock(c);
+        node_unlock(parent);
+        return -1;
+    }
+
+    // Snapshots that can see the parent keep its listing with the file in it.
+    if (node_cow(fs, parent) < 0 || node_gone(fs, parent, c) < 0) {
+        node_unlock(c);
+        node_unlock(parent);
+        return -1;
+    }
+
+    // IMPORTANT: Detach first, then retire to avoid use-after-free bug.
+    // Open handles keep the node alive until they are closed.
+    dir_remove(fs, parent, c);
+    node_unlink(fs, c);
+
+    // Update parent metadata for modification time and also accessed time.
+    time_t now = time(NULL);
+    stamp(&parent->modified, now);
+    stamp(&parent->accessed, now);
+    node_archive(parent);
+    uint64_t seq = journal_log(fs, (journal_record_t){ .op = JOP_RM }, parent, leaf, NULL, 0);
+    node_unlock(parent);
+    journal_commit(fs, seq);
+
+    return 0;
+}
+
+// Implements empty directory removal for file system.
+int fss_rmdir_empty(fs_session_t *ss, const char *path) {
+    fs_t *fs = ss->fs;
+
+    // Find the parent of the directory to remove using walk() & want_parent = 1 (write-locked).
+    // Root has no parent, so "/" yields an empty leaf and is never removed.
+    char leaf[NAME_MAX+1]={0};
+    node_t *p = walk(ss, path, 1, leaf, LK_WRITE);
+    if (!p) return -1;
+
+    // Safety validation: directory must exist and must be directory type.
+    node_t *d = dir_find(p, leaf, strlen(leaf));
+    if (!d || d->type!=N_DIR) {
+        node_unlock(p);
+        return -1;
+    }
+
+    // Wait for walks passing through the directory.
+    node_lock(d, LK_WRITE);
+
+    // Check if the directory is empty (only empty directories can be removed, similar to UNIX rmdir).
+    // A pinned directory (someone's working directory) is still in use.
+    int rc = -1;
+    // A lazily mapped directory is never empty (see dir_materialize()).
+    if (as_dir(d)->child_count || as_dir(d)->lazy || __atomic_load_n(&d->refcount, __ATOMIC_ACQUIRE)) goto out;
+
+    // Prevent removal of a directory in a READ_ONLY parent directory.
+    if (p->attributes & ATTR_READONLY) goto out;
+    
+    // Prevent removal of a READ_ONLY directory.
+    if (d->attributes & ATTR_READONLY) goto out;
+    if (node_cow(fs, p) < 0 || node_gone(fs, p, d) < 0) goto out;
+
+    // Detach first, then retire node (it is freed once no walk can still be inside it)!
+    dir_remove(fs, p, d);
+    node_unlock(d);
+    node_retire(fs, d);
+
+    // Update parent metadata.
+    time_t now = time(NULL);
+    stamp(&p->modified, now);
+    stamp(&p->accessed, now);
+    node_archive(p);
+    uint64_t seq = journal_log(fs, (journal_record_t){ .op = JOP_RMDIR }, p, leaf, NULL, 0);
+    node_unlock(p);
+    journal_commit(fs, seq);
+
+    return 0;
+
+out:
+    node_unlock(d);
+    node_unlock(p);
+    return rc;
+}
+
+// Implements directory content listing, similar to UNIX ls.
+int fss_ls_dir(fs_session_t *ss, const char *path) {
+
+    // An empty path (or ".") lists the working directory.
+    node_t *d = walk(ss, path ? path : "", 0, NULL, LK_READ);
+    if (!d) return -1;
+    if (d->type != N_DIR) {
+        node_unlock(d);
+        return -1;
+    }
+
+    // Update metadata: directory was accessed.
+    stamp(&d->accessed, time(NULL));
+
+    dir_node_t *dd = as_dir(d);
+    for (size_t i = 0; i < dd->child_count; i++) {
+        node_t *c = dd->children[i];
+        printf("%s%s\n", c->name, c->type == N_DIR ? "/" : "");
+    }
+    node_unlock(d);
+    return 0;
+}
+
+// Metadata operations implementation:
+
+// Fill a file_info_t from a node (shared by get_file_info and fs_fstat). The caller holds the node's lock.
+static void node_fill_info(node_t *n, file_info_t *info) {
+
+    // Fill the info structure (see header file for structure details).
+    info->type = n->type;
+    strncpy(info->name, n->name, NAME_MAX);
+    info->name[NAME_MAX] = '\0';
+    info->created = n->created;
+    info->modified = stamp_get(&n->modified);
+    info->accessed = stamp_get(&n->accessed);
+    info->attributes = __atomic_load_n(&n->attributes, __ATOMIC_RELAXED);
+    
+    // If file node, we need to retrieve the size and there are no children.
+    if (n->type == N_FILE) {
+        info->size = as_file(n)->size;
+        info->allocated = as_file(n)->allocated;
+        info->child_count = 0;
+    // If directory node, there is no size and there are children.
+    } else {
+        info->size = 0;
+        info->allocated = 0;
+        info->child_count = as_dir(n)->child_count;
+    }
+}
+
+// Get comprehensive file/directory information.
+int fss_get_file_info(fs_session_t *ss, const char *path, file_info_t *info) {
+    if (!info) return -1;
+    
+    // Find the file or directory.
+    node_t *n = walk(ss, path, 0, NULL, LK_READ);
+    if (!n) return -1;
+    
+    node_fill_info(n, info);
+    
+    // Update access time since we accessed the node.
+    stamp(&n->accessed, time(NULL));
+    node_unlock(n);
+    
+    return 0;
+}
+
+// Set file/directory attributes. 
+// Can set multiple using bitwise | (OR) operator.
+int fss_set_file_attributes(fs_session_t *ss, const char *path, uint8_t attributes) {
+    
+    // Find the file using walk() & want_parent = 0, which returns the final component/file to be set (write-locked).
+    node_t *n = walk(ss, path, 0, NULL, LK_WRITE);
+    if (!n) return -1;
+    if (node_cow(ss->fs, n) < 0) {
+        node_unlock(n);
+        return -1;
+    }
+    
+    // Update attributes. Setting them is a change, so the archive bit is set whatever was given.
+    __atomic_store_n(&n->attributes, attributes | ATTR_ARCHIVE, __ATOMIC_SEQ_CST);
+    node_archive(n);
+    stamp(&n->modified, time(NULL)); // Changing attributes counts as modification.
+    uint64_t seq = journal_log(ss->fs, (journal_record_t){ .op = JOP_ATTR, .attributes = attributes }, n, NULL, NULL, 0);
+    node_unlock(n);
+    journal_commit(ss->fs, seq);
+    
+    return 0;
+}
+
+// Update access and modification times (like UNIX touch command).
+int fss_touch_file(fs_session_t *ss, const char *path) {
+
+    // Find the file using walk() & want_parent = 0, which returns the final component/file to be set.
+    // Timestamps are stored atomically, so a shared lock is enough, unless a snapshot needs a copy
+    // of the node first (see node_cow()).
+    node_t *n = walk(ss, path, 0, NULL, LK_READ);
+    if (n && __atomic_load_n(&ss->fs->snap_newest, __ATOMIC_SEQ_CST) > node_gen(n)) {
+        node_unlock(n);
+        n = walk(ss, path, 0, NULL, LK_WRITE);
+        if (n && node_cow(ss->fs, n) < 0) {
+            node_unlock(n);
+            return -1;
+        }
+    }
+    if (!n) return -1;
+    
+    // Need to update both the access time and modification time.
+    time_t now = time(NULL);
+    stamp(&n->accessed, now);
+    stamp(&n->modified, now);
+    node_archive(n);
+    uint64_t seq = journal_log(ss->fs, (journal_record_t){ .op = JOP_TOUCH }, n, NULL, NULL, 0);
+    node_unlock(n);
+    journal_commit(ss->fs, seq);
+    
+    return 0;
+}
+
+// Open file handle operations:
+// A handle pins its file, so the node stays valid without holding any lock between calls.
+// Closing a handle while another thread still uses it is a caller error, as with close(2).
+
+// Drop a handle's pin on a file, retiring the file if it was removed while open and this was its
+// last handle. The file's lock makes this and rm_file() agree on who retires it.
+static void file_unpin(fs_t *fs, node_t *f) {
+    node_lock(f, LK_WRITE);
+    node_unpin(f);
+    int unused = !f->parent && __atomic_load_n(&f->refcount, __ATOMIC_ACQUIRE) == 0;
+    node_unlock(f);
+    if (unused) node_retire(fs, f);
+}
+
+// Look up the node behind a handle (NULL if the handle is not open), and its FS_O_* flags.
+static node_t *handle_node(fs_t *fs, int fd, int *flags) {
+    node_t *n = NULL;
+    pthread_mutex_lock(&fs->open_lock);
+    if (fd >= 0 && fd < fs->open_cap) {
+        n = fs->open_files[fd].node;
+        if (flags) *flags = fs->open_files[fd].flags;
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    return n;
+}
+
+// Open a file and return a handle for it.
+int fss_open(fs_session_t *ss, const char *path, int flags) {
+    fs_t *fs = ss->fs;
+
+    // Resolve the path once; later operations on the handle use the node directly.
+    // With FS_O_CREAT, look again whether or not the create worked: another thread may have
+    // created the file first.
+    node_t *f = walk(ss, path, 0, NULL, LK_READ);
+    if (!f && (flags & FS_O_CREAT)) {
+        fss_create_file(ss, path);
+        f = walk(ss, path, 0, NULL, LK_READ);
+    }
+    if (!f) return -1;
+
+    // Only regular files can be opened.
+    if (f->type != N_FILE) {
+        node_unlock(f);
+        return -1;
+    }
+
+    // Pin the node while it is still locked, so a concurrent rm_file() cannot free it.
+    node_pin(f);
+
+    // Opening counts as an access.
+    stamp(&f->accessed, time(NULL));
+    node_unlock(f);
+
+    pthread_mutex_lock(&fs->open_lock);
+
+    // Grow the table when no free handle is left, chaining the new entries onto the free list.
+    if (fs->open_free < 0) {
+        int newcap = fs->open_cap ? fs->open_cap * 2 : 16;
+        open_file_t *p = realloc(fs->open_files, (size_t)newcap * sizeof(*p));
+        if (!p) {
+            pthread_mutex_unlock(&fs->open_lock);
+            file_unpin(fs, f);
+            return -1;
+        }
+        for (int i = newcap - 1; i >= fs->open_cap; i--) {
+            p[i].node = NULL;
+            p[i].flags = 0;
+            p[i].next_free = fs->open_free;
+            fs->open_free = i;
+        }
+        fs->open_files = p;
+        fs->open_cap = newcap;
+    }
+
+    // Take the first free handle.
+    int fd = fs->open_free;
+    fs->open_free = fs->open_files[fd].next_free;
+    fs->open_files[fd].node = f;
+    fs->open_files[fd].flags = flags;
+    pthread_mutex_unlock(&fs->open_lock);
+
+    return fd;
+}
+
+// Close a handle, freeing the file if it was removed while open and this was its last handle.
+int fsi_close(fs_t *fs, int fd) {
+    pthread_mutex_lock(&fs->open_lock);
+    node_t *f = (fd >= 0 && fd < fs->open_cap) ? fs->open_files[fd].node : NULL;
+    if (f) {
+        fs->open_files[fd].node = NULL;
+        fs->open_files[fd].next_free = fs->open_free;
+        fs->open_free = fd;
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    if (!f) return -1;
+
+    file_unpin(fs, f);
+    return 0;
+}
+
+// Read from an open file at an offset (same semantics as read_file()).
+ssize_t fsi_pread(fs_t *fs, int fd, size_t off, void *buf, size_t len) {
+    node_t *f = handle_node(fs, fd, NULL);
+    if (!f) return -1;
+    node_lock(f, LK_READ);
+    ssize_t n = file_read(as_file(f), off, buf, len);
+    node_unlock(f);
+    return n;
+}
+
+// Write to an open file at an offset (same semantics as write_file()).
+// On a handle opened with FS_O_APPEND the offset is ignored and the data goes at end-of-file.
+ssize_t fsi_pwrite(fs_t *fs, int fd, size_t off, const void *buf, size_t len) {
+    int flags;
+    node_t *f = handle_node(fs, fd, &flags);
+    if (!f) return -1;
+    node_lock(f, LK_WRITE);
+    ssize_t n = node_cow(fs, f) < 0 ? -1
+              : (flags & FS_O_APPEND) ? file_append(as_file(f), buf, len, &off)
+                                      : file_write(as_file(f), off, buf, len);
+    if (n >= 0) node_archive(f);
+    struct iovec iov = { (void *)buf, len };
+    uint64_t seq = n >= 0 ? journal_log(fs, (journal_record_t){ .op = JOP_WRITE, .a = off, .b = len }, f, NULL, &iov, 1) : 0;
+    node_unlock(f);
+    journal_commit(fs, seq);
+    return n;
+}
+
+// Append to an open file without the caller knowing its size.
+// Returns the bytes written and stores the offset they were written at in *off (if non-NULL).
+ssize_t fsi_append(fs_t *fs, int fd, const void *buf, size_t len, size_t *off) {
+    node_t *f = handle_node(fs, fd, NULL);
+    if (!f) return -1;
+    node_lock(f, LK_WRITE);
+    size_t at;
+    ssize_t n = node_cow(fs, f) == 0 ? file_append(as_file(f), buf, len, &at) : -1;
+    if (n >= 0) node_archive(f);
+    struct iovec iov = { (void *)buf, len };
+    uint64_t seq = n >= 0 ? journal_log(fs, (journal_record_t){ .op = JOP_WRITE, .a = at, .b = len }, f, NULL, &iov, 1) : 0;
+    node_unlock(f);
+    journal_commit(fs, seq);
+    if (n >= 0 && off) *off = at;
+    return n;
+}
+
+// Borrow a range of an open file without copying it (same semantics as read_file_view()).
+ssize_t fsi_pread_view(fs_t *fs, int fd, size_t off, size_t len, fs_view_t *view) {
+    node_t *f = handle_node(fs, fd, NULL);
+    if (!f || !view) return -1;
+    node_lock(f, LK_READ);
+    ssize_t n = file_view(as_file(f), off, len, view);
+    node_unlock(f);
+    return n;
+}
+
+// Retrieve metadata for an open file (same semantics as get_file_info()).
+int fsi_fstat(fs_t *fs, int fd, file_info_t *info) {
+    node_t *f = handle_node(fs, fd, NULL);
+    if (!f || !info) return -1;
+
+    node_lock(f, LK_READ);
+    node_fill_info(f, info);
+    stamp(&f->accessed, time(NULL));
+    node_unlock(f);
+    return 0;
+}
+
+// Format timestamp for human-readable display.
+const char* format_time(time_t timestamp) {
+    static char buffer[32];
+    struct tm *tm_info = localtime(&timestamp);
     
-    // Find the file or directory.
-    node_t *n = walk(path, 0, NULL);
-    if (!n) return -1;
+    if (!tm_info) {
+        strncpy(buffer, "Invalid time", sizeof(buffer));
+        return buffer;
+    }
     
-    // Fill the info structure (see header file for structure details).
-    info->type = n->type;
-    strncpy(info->name, n->name, NAME_MAX);
-    info->name[NAME_MAX] = '\0';
-    info->created = n->created;
-    info->modified = n->modified;
-    info->accessed = n->accessed;
-    info->attributes = n->attributes;
+    // Format: "YYYY-MM-DD HH:MM:SS".
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", tm_info);
+    return buffer;
+}
+
+// Format attributes for human-readable display.
+const char* format_attributes(uint8_t attributes) {
+    static char buffer[32];
+    buffer[0] = '\0';
     
-    // If file node, we need to retrieve the size and there are no children.
-    if (n->type == N_FILE) {
-        info->size = n->size;
-        info->child_count = 0;
-    // If directory node, there is no size and there are children.
+    if (attributes == ATTR_NONE) {
+        strncpy(buffer, "none", sizeof(buffer));
+        return buffer;
+    }
+    
+    int first = 1;
+    if (attributes & ATTR_HIDDEN) {
+        strncat(buffer, first ? "hidden" : ",hidden", sizeof(buffer) - strlen(buffer) - 1);
+        first = 0;
+    }
+    if (attributes & ATTR_READONLY) {
+        strncat(buffer, first ? "readonly" : ",readonly", sizeof(buffer) - strlen(buffer) - 1);
+        first = 0;
+    }
+    if (attributes & ATTR_SYSTEM) {
+        strncat(buffer, first ? "system" : ",system", sizeof(buffer) - strlen(buffer) - 1);
+        first = 0;
+    }
+    if (attributes & ATTR_ARCHIVE) {
+        strncat(buffer, first ? "archive" : ",archive", sizeof(buffer) - strlen(buffer) - 1);
+        first = 0;
+    }
+    
+    return buffer;
+}
+
+// Parallel search:
+// The tree below the start directory is split into one task per directory, spread over a pool of
+// worker threads. Each worker owns a deque of tasks: it pushes the subdirectories it finds and
+// takes back the newest (staying depth first), while an idle worker steals the oldest task from
+// another, which tends to be the largest remaining subtree. Matches are collected per worker and
+// then sorted by their position in the tree, so the output is the same as the serial search.
+// Workers lock one directory at a time while listing it; the whole search runs inside one read
+// section, so nodes removed meanwhile stay valid (such changes may or may not be reported).
+
+// A directory still to search, or a match. key[] holds the node's child index at each depth below
+// the start directory; it is allocated together with the path, which follows it.
+typedef struct search_entry {
+    node_t *node;
+    size_t depth;
+    size_t *key;
+    char *path; // Full path (matches that are directories are printed with a trailing '/').
+} search_entry_t;
+
+typedef struct search_worker {
+    pthread_t thread;
+    pthread_mutex_t lock; // Guards the deque (owner and thieves).
+    search_entry_t *tasks; // Deque: the owner pushes and pops at tail, thieves take from head.
+    size_t head, tail, cap;
+    search_entry_t *matches;
+    size_t nmatches, match_cap;
+    struct search_pool *pool;
+} search_worker_t;
+
+typedef struct search_pool {
+    fs_t *fs;
+    const char *term;
+    search_worker_t *workers;
+    int nworkers;
+    size_t pending; // Tasks queued or being searched; the search is over when this reaches 0.
+    int failed; // Set if any allocation failed.
+} search_pool_t;
+
+// Make an entry for child index idx of parent (NULL for the start directory, whose path is given).
+static int search_entry_make(search_entry_t *e, const search_entry_t *parent, size_t idx, node_t *n, const char *path) {
+    size_t depth = parent ? parent->depth + 1 : 0;
+    size_t plen = parent ? strlen(parent->path) : strlen(path);
+    size_t nlen = parent ? strlen(n->name) : 0;
+    size_t *key = malloc(depth * sizeof(size_t) + plen + nlen + 2);
+    if (!key) return -1;
+
+    char *p = (char *)(key + depth);
+    if (parent) {
+        memcpy(key, parent->key, parent->depth * sizeof(size_t));
+        key[depth - 1] = idx;
+        memcpy(p, parent->path, plen);
+        if (plen > 1) p[plen++] = '/'; // The root's path "/" already ends in one.
+        memcpy(p + plen, n->name, nlen + 1);
+    } else {
+        memcpy(p, path, plen + 1);
+    }
+    *e = (search_entry_t){ n, depth, key, p };
+    return 0;
+}
+
+static void search_fail(search_pool_t *pool) {
+    __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void search_push(search_worker_t *w, const search_entry_t *t) {
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap && w->head > 0) {
+        // Reuse the space thieves freed at the front.
+        memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(*w->tasks));
+        w->tail -= w->head;
+        w->head = 0;
+    }
+    if (w->tail == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 64;
+        search_entry_t *p = realloc(w->tasks, cap * sizeof(*p));
+        if (!p) {
+            pthread_mutex_unlock(&w->lock);
+            free(t->key);
+            search_fail(w->pool);
+            return;
+        }
+        w->tasks = p;
+        w->cap = cap;
+    }
+    __atomic_add_fetch(&w->pool->pending, 1, __ATOMIC_ACQ_REL);
+    w->tasks[w->tail++] = *t;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Take a task from victim: the newest if it is the caller's own deque, otherwise the oldest.
+static int search_take(search_worker_t *victim, int own, search_entry_t *t) {
+    pthread_mutex_lock(&victim->lock);
+    int got = victim->head < victim->tail;
+    if (got) *t = own ? victim->tasks[--victim->tail] : victim->tasks[victim->head++];
+    pthread_mutex_unlock(&victim->lock);
+    return got;
+}
+
+static void search_match(search_worker_t *w, search_entry_t *m) {
+    if (w->nmatches == w->match_cap) {
+        size_t cap = w->match_cap ? w->match_cap * 2 : 64;
+        search_entry_t *p = realloc(w->matches, cap * sizeof(*p));
+        if (!p) {
+            free(m->key);
+            search_fail(w->pool);
+            return;
+        }
+        w->matches = p;
+        w->match_cap = cap;
+    }
+    w->matches[w->nmatches++] = *m;
+}
+
+// Search the children of directory t, queueing subdirectories as new tasks.
+static void search_dir(search_worker_t *w, const search_entry_t *t) {
+    const char *term = w->pool->term;
+    time_t now = time(NULL);
+
+    if (dir_ready(w->pool->fs, t->node) < 0) {
+        search_fail(w->pool);
+        return;
+    }
+    node_lock(t->node, LK_READ);
+    dir_node_t *d = as_dir(t->node);
+    for (size_t i = 0; i < d->child_count; i++) {
+        node_t *c = d->children[i];
+        stamp(&c->accessed, now); // Visiting a node counts as an access.
+
+        search_entry_t e;
+        if (strstr(c->name, term)) {
+            if (search_entry_make(&e, t, i, c, NULL) == 0) search_match(w, &e);
+            else search_fail(w->pool);
+        }
+        if (c->type == N_DIR) {
+            if (search_entry_make(&e, t, i, c, NULL) == 0) search_push(w, &e);
+            else search_fail(w->pool);
+        }
+    }
+    node_unlock(t->node);
+}
+
+static void *search_worker_main(void *arg) {
+    search_worker_t *w = arg;
+    search_pool_t *pool = w->pool;
+    size_t self = (size_t)(w - pool->workers);
+
+    for (;;) {
+        search_entry_t t;
+        int got = search_take(w, 1, &t);
+        for (int i = 1; !got && i < pool->nworkers; i++) {
+            got = search_take(&pool->workers[(self + i) % pool->nworkers], 0, &t);
+        }
+        if (!got) {
+            if (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0) break;
+            sched_yield(); // Others are still searching and may queue more work.
+            continue;
+        }
+        search_dir(w, &t);
+        free(t.key);
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    }
+    return NULL;
+}
+
+// Order matches by position in the tree: a directory comes before its contents, and siblings
+// follow the directory's listing order (the order search_serial() visits them in).
+static int search_entry_cmp(const void *a, const void *b) {
+    const search_entry_t *x = a, *y = b;
+    size_t n = x->depth < y->depth ? x->depth : y->depth;
+    for (size_t i = 0; i < n; i++) {
+        if (x->key[i] != y->key[i]) return x->key[i] < y->key[i] ? -1 : 1;
+    }
+    return (x->depth > y->depth) - (x->depth < y->depth);
+}
+
+// Search the session's working directory with nthreads workers, then report matches to fn in
+// tree order like search_serial(). Returns the number of matches reported.
+static int search_parallel(fs_session_t *ss, const char *term, int nthreads, fs_search_fn fn, void *arg) {
+    search_pool_t pool = { .fs = ss->fs, .term = term, .nworkers = nthreads };
+    pool.workers = calloc((size_t)nthreads, sizeof(*pool.workers));
+    if (!pool.workers) return -1;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+        pool.workers[i].pool = &pool;
+    }
+
+    // The start directory is matched here; everything below it is left to the workers.
+    unsigned parity;
+    reader_slot_t *r = ebr_enter(ss->fs, &parity);
+    node_t *start = walk(ss, "", 0, NULL, LK_READ);
+    char *path = node_path_dup(start, NULL);
+    stamp(&start->accessed, time(NULL));
+    search_entry_t e;
+    if (!path) search_fail(&pool);
+    else {
+        if (start->parent && strstr(start->name, term)) {
+            if (search_entry_make(&e, NULL, 0, start, path) == 0) search_match(&pool.workers[0], &e);
+            else search_fail(&pool);
+        }
+        if (search_entry_make(&e, NULL, 0, start, path) == 0) search_push(&pool.workers[0], &e);
+        else search_fail(&pool);
+        free(path);
+    }
+    node_unlock(start);
+
+    // The calling thread works too, as worker 0. A worker that fails to start just leaves its
+    // share to the others.
+    int started[FS_SEARCH_MAX_THREADS];
+    for (int i = 1; i < nthreads; i++) {
+        started[i] = pthread_create(&pool.workers[i].thread, NULL, search_worker_main, &pool.workers[i]) == 0;
+    }
+    search_worker_main(&pool.workers[0]);
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i]) pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    // Merge and report in tree order.
+    size_t total = 0;
+    for (int i = 0; i < nthreads; i++) total += pool.workers[i].nmatches;
+    search_entry_t *all = malloc((total ? total : 1) * sizeof(*all));
+    if (!all) pool.failed = 1;
+    size_t k = 0;
+    for (int i = 0; i < nthreads; i++) {
+        search_worker_t *w = &pool.workers[i];
+        if (all && w->nmatches) memcpy(all + k, w->matches, w->nmatches * sizeof(*all));
+        else for (size_t j = 0; j < w->nmatches; j++) free(w->matches[j].key);
+        k += w->nmatches;
+        free(w->matches);
+        free(w->tasks);
+        pthread_mutex_destroy(&w->lock);
+    }
+    free(pool.workers);
+    if (!all) {
+        ebr_exit(r, parity);
+        return -1;
+    }
+
+    qsort(all, total, sizeof(*all), search_entry_cmp);
+    size_t reported = 0;
+    int stop = pool.failed;
+    for (size_t i = 0; i < total; i++) {
+        if (!stop) {
+            reported++;
+            stop = fn(all[i].node, all[i].path, strlen(all[i].path), arg);
+        }
+        free(all[i].key);
+    }
+    free(all);
+    ebr_exit(r, parity);
+    return pool.failed ? -1 : (int)reported;
+}
+
+// Indexed search:
+// Fill in e for candidate c: its position key below start and its full path, found by following
+// parent pointers up to root. Returns 1, 0 if c is not (or no longer) in start's subtree, or -1
+// if out of memory. Runs inside a read section and takes no locks, so the tree may be changing.
+static int search_entry_locate(fs_t *fs, node_t *start, node_t *c, search_entry_t *e) {
+    size_t levels = 0, depth = SIZE_MAX, plen = 0;
+    node_t *cur = c, *p;
+    for (; (p = node_parent(cur)); cur = p, levels++) {
+        if (cur == start) depth = levels;
+        plen += 1 + strlen(cur->name);
+    }
+    if (cur == start) depth = levels;
+    if (cur != fs->root || depth == SIZE_MAX) return 0;
+
+    size_t *key = malloc(depth * sizeof(size_t) + (plen ? plen : 1) + 1);
+    if (!key) return -1;
+    char *path = (char *)(key + depth);
+    strcpy(path, "/");
+
+    // Second pass: the chain can only have been cut short meanwhile (nodes are never moved).
+    size_t level = 0, pos = plen;
+    if (plen) path[plen] = '\0';
+    for (cur = c; (p = node_parent(cur)); cur = p, level++) {
+        if (level < depth) key[depth - 1 - level] = __atomic_load_n(&cur->dir_index, __ATOMIC_RELAXED);
+        size_t k = strlen(cur->name);
+        pos -= k;
+        memcpy(path + pos, cur->name, k);
+        path[--pos] = '/';
+    }
+    if (level != levels) {
+        free(key);
+        return 0;
+    }
+    *e = (search_entry_t){ c, depth, key, path };
+    return 1;
+}
+
+// Search the session's working directory using the name index (term has at least three bytes),
+// reporting matches to fn in tree order like search_serial(). Only the matches are visited.
+static int search_indexed(fs_session_t *ss, const char *term, fs_search_fn fn, void *arg) {
+    fs_t *fs = ss->fs;
+    unsigned parity;
+    reader_slot_t *r = ebr_enter(fs, &parity);
+
+    posting_entry_t *cand;
+    ssize_t nc = nidx_candidates(fs, term, &cand);
+    search_entry_t *found = nc >= 0 ? malloc((nc ? (size_t)nc : 1) * sizeof(*found)) : NULL;
+    if (!found) {
+        if (nc >= 0) free(cand);
+        ebr_exit(r, parity);
+        return -1;
+    }
+
+    node_t *start = walk(ss, "", 0, NULL, LK_READ);
+    stamp(&start->accessed, time(NULL));
+    node_unlock(start);
+
+    // Verify candidates and place them in the tree.
+    size_t nf = 0;
+    int rc = 0;
+    for (ssize_t i = 0; i < nc && rc == 0; i++) {
+        node_t *c = cand[i].node;
+        if (!strstr(c->name, term)) continue;
+        int got = search_entry_locate(fs, start, c, &found[nf]);
+        if (got < 0) rc = -1;
+        nf += got > 0;
+    }
+    free(cand);
+
+    qsort(found, nf, sizeof(*found), search_entry_cmp);
+    size_t reported = 0;
+    time_t now = time(NULL);
+    for (size_t i = 0; i < nf; i++) {
+        if (rc == 0) {
+            stamp(&found[i].node->accessed, now);
+            reported++;
+            if (fn(found[i].node, found[i].path, strlen(found[i].path), arg)) rc = 1;
+        }
+        free(found[i].key);
+    }
+    free(found);
+    ebr_exit(r, parity);
+    return rc < 0 ? -1 : (int)reported;
+}
+
+// Set the number of threads searches use (1 searches serially on the calling thread).
+int fsi_set_search_threads(fs_t *fs, int nthreads) {
+    if (nthreads < 1 || nthreads > FS_SEARCH_MAX_THREADS) return -1;
+    __atomic_store_n(&fs->search_threads, nthreads, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Let searches use the name index (on, the default) or make every search walk the tree (off).
+int fsi_set_search_index(fs_t *fs, int on) {
+    __atomic_store_n(&fs->search_index, on != 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int fss_search_cb(fs_session_t *ss, const char *term, fs_search_fn fn, void *arg) {
+    if (!term || term[0] == '\0' || !fn) return -1;
+    // Nodes still in a mapped image are not indexed yet.
+    if (strlen(term) >= 3 && __atomic_load_n(&ss->fs->search_index, __ATOMIC_RELAXED) &&
+        !__atomic_load_n(&ss->fs->nidx_broken, __ATOMIC_RELAXED) &&
+        !__atomic_load_n(&ss->fs->lazy_dirs, __ATOMIC_ACQUIRE)) {
+        return search_indexed(ss, term, fn, arg);
+    }
+    int nthreads = __atomic_load_n(&ss->fs->search_threads, __ATOMIC_RELAXED);
+    if (nthreads > 1) return search_parallel(ss, term, nthreads, fn, arg);
+
+    node_t *start = walk(ss, "", 0, NULL, LK_READ);
+    int matches = search_serial(ss->fs, start, term, fn, arg);
+    node_unlock(start);
+    return matches;
+}
+
+// fs_search() prints each match's full path, with a trailing '/' for directories.
+static int search_print(const node_t *n, const char *path, size_t len, void *arg) {
+    (void)arg;
+    printf("%.*s%s\n", (int)len, path, n->type == N_DIR ? "/" : "");
+    return 0;
+}
+
+int fss_search(fs_session_t *ss, const char *term) {
+    return fss_search_cb(ss, term, search_print, NULL);
+}
+
+// Images:
+// Saving lists the tree breadth-first, taking each directory's read lock while its children are
+// copied, then writes names, file data and the node table; loading checks the whole image before
+// building anything (see "Image format" above).
+
+// Append n bytes to an image being written, advancing *off. Returns 0, or -1 on a write error.
+static int image_put(FILE *out, const void *p, size_t n, uint64_t *off) {
+    if (n && fwrite(p, 1, n, out) != n) return -1;
+    *off += n;
+    return 0;
+}
+
+// Pad an image being written with zeros up to the next multiple of 8 bytes.
+static int image_align(FILE *out, uint64_t *off) {
+    static const uint8_t zeros[8];
+    return image_put(out, zeros, (8 - *off % 8) % 8, off);
+}
+
+// Write one file's extent table and data (the caller read-locks the file). Inline contents are
+// stored as chunk 0; chunks past end-of-file are skipped. A mapped file's extents are copied over.
+static int image_put_file(FILE *out, file_node_t *f, image_node_t *rec, uint64_t *off) {
+    size_t n = 0, max = f->image ? f->image_count : f->nextents ? f->nextents : 1;
+    image_extent_t *ext = malloc(max * sizeof(*ext));
+    const uint8_t **src = malloc(max * sizeof(*src));
+    int rc = (ext && src) ? 0 : -1;
+
+    uint64_t data = *off + max * sizeof(*ext); // Data follows the table (sized for max entries).
+    for (size_t i = 0; rc == 0 && f->image && i < f->image_count; i++) {
+        ext[n] = (image_extent_t){ f->image_ext[i].index, f->image_ext[i].len, data };
+        src[n++] = f->image + f->image_ext[i].off;
+        data += ext[n - 1].len;
+    }
+    if (rc == 0 && !f->image && f->nextents == 0 && f->size > 0) {
+        size_t len = f->size < FS_INLINE_MAX ? f->size : FS_INLINE_MAX;
+        ext[n] = (image_extent_t){ 0, len, data };
+        src[n++] = f->inline_data;
+    }
+    for (size_t i = 0; rc == 0 && i < f->nextents; i++) {
+        size_t start = f->extents[i].index * FS_CHUNK_SIZE;
+        if (start >= f->size) break;
+        size_t len = f->size - start < f->extents[i].chunk->cap ? f->size - start : f->extents[i].chunk->cap;
+        ext[n] = (image_extent_t){ f->extents[i].index, len, data };
+        src[n++] = f->extents[i].chunk->data;
+        data += len;
+    }
+
+    rec->first = *off;
+    rec->count = n;
+    rec->size = f->size;
+    if (rc == 0) {
+        // Unused table entries (chunks past end-of-file) are written as zeros.
+        memset(ext + n, 0, (max - n) * sizeof(*ext));
+        rc = image_put(out, ext, max * sizeof(*ext), off);
+    }
+    for (size_t i = 0; rc == 0 && i < n; i++) rc = image_put(out, src[i], ext[i].len, off);
+    if (rc == 0) rc = image_align(out, off);
+    free(ext);
+    free(src);
+    return rc;
+}
+
+// Write an image of the n nodes listed, breadth-first with root first, to path. Their records are
+// filled in except for names and file data, which are written here (each file under its read
+// lock); files whose records have IMAGE_KEEP get no data. A record without a node was copied from
+// the mapped image (see image_save()), and its name and data are copied from there. If snap is not 0, files are written as
+// that snapshot sees them. Called inside a read section. The image is written next to path and
+// renamed over it, so an existing image is replaced only once the new one is complete.
+static int image_write(fs_t *fs, const char *path, const char *magic, node_t **nodes, image_node_t *recs, size_t n,
+                       uint64_t snap) {
+    size_t plen = strlen(path);
+    char *tmp = malloc(plen + 5);
+    if (!tmp) return -1;
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+    FILE *out = fopen(tmp, "wb");
+    int rc = out ? 0 : -1;
+
+    // Header (filled in last), then the names, then each file's data under its read lock.
+    image_header_t h = { .version = FS_IMAGE_VERSION, .order = FS_IMAGE_ORDER };
+    memcpy(h.magic, magic, sizeof(h.magic));
+    uint64_t off = 0;
+    if (rc == 0) rc = image_put(out, &h, sizeof(h), &off);
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        const char *name = nodes[i] ? nodes[i]->name : (const char *)fs->map + recs[i].name_off;
+        recs[i].name_off = off;
+        rc = image_put(out, name, recs[i].name_len, &off);
+    }
+    if (rc == 0) rc = image_align(out, &off);
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        if (recs[i].type != N_FILE || (recs[i].flags & (IMAGE_KEEP | IMAGE_GONE))) continue;
+        if (!nodes[i]) {
+            // Read from the mapping the way a materialized file would be.
+            file_node_t f = { .size = recs[i].size };
+            if (recs[i].count) {
+                f.image = fs->map;
+                f.image_ext = (const image_extent_t *)(fs->map + recs[i].first);
+                f.image_count = recs[i].count;
+            }
+            rc = image_put_file(out, &f, &recs[i], &off);
+            continue;
+        }
+        if (!snap) {
+            node_lock(nodes[i], LK_READ);
+            rc = image_put_file(out, as_file(nodes[i]), &recs[i], &off);
+            node_unlock(nodes[i]);
+            continue;
+        }
+
+        // A snapshot's file that has not changed is frozen (sharing its chunks) rather than
+        // written out under its lock.
+        int locked;
+        node_t *x = snap_state(nodes[i], snap, &locked), *frozen = NULL;
+        if (x && locked) {
+            frozen = x = node_freeze(fs, x);
+            node_unlock(nodes[i]);
+        }
+        rc = x ? image_put_file(out, as_file(x), &recs[i], &off) : -1;
+        if (frozen) node_free(fs, frozen);
+    }
+
+    // Node table, then the finished header.
+    h.node_count = n;
+    h.nodes_off = off;
+    h.next_ino = __atomic_load_n(&fs->next_ino, __ATOMIC_RELAXED);
+    if (rc == 0) rc = image_put(out, recs, n * sizeof(*recs), &off);
+    h.size = off;
+    if (rc == 0 && (fseek(out, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, out) != 1)) rc = -1;
+    if (rc == 0 && (fflush(out) != 0 || fsync(fileno(out)) != 0)) rc = -1;
+    if (out && fclose(out) != 0) rc = -1;
+    if (rc == 0 && rename(tmp, path) != 0) rc = -1;
+    if (rc != 0 && out) remove(tmp);
+    free(tmp);
+    return rc;
+}
+
+// Make room for count more entries in the node and record lists of an image being collected.
+static int image_grow(node_t ***nodes, image_node_t **recs, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t c = *cap;
+    while (need > c) c *= 2;
+    node_t **nn = realloc(*nodes, c * sizeof(*nn));
+    if (nn) *nodes = nn;
+    image_node_t *nr = realloc(*recs, c * sizeof(*nr));
+    if (nr) *recs = nr;
+    if (!nn || !nr) return -1;
+    *cap = c;
+    return 0;
+}
+
+// A node's record, except for the parts image_write() and the caller fill in.
+static image_node_t image_record(node_t *x) {
+    return (image_node_t){
+        .ino = x->ino, .type = x->type, .name_len = (uint8_t)strlen(x->name),
+        .attributes = __atomic_load_n(&x->attributes, __ATOMIC_SEQ_CST),
+        .created = stamp_get(&x->created), .modified = stamp_get(&x->modified),
+        .accessed = stamp_get(&x->accessed),
+        .flags = x->type == N_DIR && __atomic_load_n(&as_dir(x)->dirty, __ATOMIC_SEQ_CST) ? IMAGE_DIRTY : 0,
+    };
+}
+
+// Append copies of the records of rec's children (rec being a directory record in the mapped image)
+// to the nodes and records of an image being collected, with no nodes, and where each came from in
+// the mapping's table to from[]. They are checked as dir_materialize() checks them.
+static int image_copy_children(fs_t *fs, const image_node_t *rec, node_t ***nodes, image_node_t **recs, size_t *cap,
+                               uint64_t **from, size_t *from_cap, size_t *n) {
+    size_t count = rec->count, ndirs;
+    if (count == 0) return 0;
+    const image_node_t *kids = map_children(fs, rec, &ndirs);
+    if (!kids || image_grow(nodes, recs, cap, *n + count) < 0) return -1;
+    if (snap_reserve(from, from_cap, *n + count, sizeof(**from)) < 0) return -1;
+    const image_node_t *table = (const image_node_t *)(fs->map + ((const image_header_t *)fs->map)->nodes_off);
+    for (size_t j = 0; j < count; j++) {
+        (*nodes)[*n] = NULL;
+        (*recs)[*n] = kids[j];
+        (*recs)[*n].flags &= IMAGE_DIRTY; // Nothing of a delta's.
+        (*from)[(*n)++] = (uint64_t)(kids + j - table);
+    }
+    return 0;
+}
+
+// Save the tree, or if snap is not 0 that snapshot of it, into an image at path.
+static int image_save(fs_t *fs, const char *path, uint64_t snap) {
+
+    // Nodes removed while we save stay readable until we leave the read section.
+    backup_begin(fs);
+    unsigned parity;
+    reader_slot_t *r = ebr_enter(fs, &parity);
+
+    // List every node breadth-first. Each directory is read-locked while its record and its
+    // children are taken, so the image holds every directory as it was at that moment (or,
+    // for a snapshot, as the snapshot sees it: see snap_state()). A directory still lazy in a
+    // mapped image has not changed below since it was mapped, so rather than materializing it,
+    // the records below it are copied from the mapping (from[i] is where copy i came from).
+    size_t n = 1, cap = 1024, from_cap = 0;
+    node_t **nodes = malloc(cap * sizeof(*nodes));
+    image_node_t *recs = malloc(cap * sizeof(*recs));
+    uint64_t *from = NULL;
+    int rc = (nodes && recs) ? 0 : -1;
+    if (rc == 0) nodes[0] = fs->root;
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        node_t *x = nodes[i];
+        if (!x) {
+            if (recs[i].type != N_DIR) continue;
+            const image_node_t *table = (const image_node_t *)(fs->map + ((const image_header_t *)fs->map)->nodes_off);
+            recs[i].first = n;
+            rc = image_copy_children(fs, &table[from[i]], &nodes, &recs, &cap, &from, &from_cap, &n);
+            continue;
+        }
+        int locked = 1;
+        if (snap) x = snap_state(x, snap, &locked);
+        else node_lock(x, LK_READ);
+        if (!x) {
+            rc = -1;
+            break;
+        }
+        const image_node_t *lazy = x->type == N_DIR ? __atomic_load_n(&as_dir(x)->lazy, __ATOMIC_ACQUIRE) : NULL;
+        size_t count = x->type == N_DIR ? as_dir(x)->child_count : 0;
+        rc = image_grow(&nodes, &recs, &cap, n + count);
+        if (rc == 0) {
+            recs[i] = image_record(x);
+            recs[i].first = n;
+            recs[i].count = lazy ? lazy->count : count;
+            if (count) memcpy(&nodes[n], as_dir(x)->children, count * sizeof(*nodes));
+            n += count;
+            if (lazy) rc = image_copy_children(fs, lazy, &nodes, &recs, &cap, &from, &from_cap, &n);
+        }
+        if (locked) node_unlock(x);
+    }
+
+    if (rc == 0) rc = image_write(fs, path, FS_IMAGE_MAGIC, nodes, recs, n, snap);
+    ebr_exit(r, parity);
+    backup_end(fs);
+    free(nodes);
+    free(recs);
+    free(from);
+    return rc;
+}
+
+// Save the tree into an image at path.
+int fsi_save(fs_t *fs, const char *path) {
+    if (!fs || !path) return -1;
+    return image_save(fs, path, 0);
+}
+
+static int delta_gone_cmp(const void *a, const void *b) {
+    uint64_t x = ((const delta_gone_t *)a)->dir, y = ((const delta_gone_t *)b)->dir;
+    return x < y ? -1 : x > y;
+}
+
+// Append a removal record for g to the nodes and records of a delta being collected. Its node is a
+// stub holding just the name and type, for the caller to free.
+static int delta_gone_record(node_t ***nodes, image_node_t **recs, size_t *cap, size_t *n, const delta_gone_t *g) {
+    node_t *stub = calloc(1, sizeof(*stub));
+    if (!stub || image_grow(nodes, recs, cap, *n + 1) < 0) {
+        free(stub);
+        return -1;
+    }
+    stub->type = g->type;
+    memcpy(stub->name, g->name, sizeof(stub->name));
+    (*nodes)[*n] = stub;
+    (*recs)[(*n)++] = (image_node_t){ .type = g->type, .name_len = (uint8_t)strlen(g->name), .flags = IMAGE_GONE };
+    return 0;
+}
+
+// Write the nodes changed since the last export into a delta image at path, clearing their archive
+// bits (see "Incremental backup" above). Only flagged directories are descended into, and each lists
+// just its children that changed or lead to changes, after IMAGE_GONE records for the children it
+// lost (see "Removal log" above). An unchanged directory is an IMAGE_KEEP record, as is an unchanged
+// node on the way to changes; neither carries data. Records carry attributes as they are after the
+// export.
+int fsi_export_delta(fs_t *fs, const char *path) {
+    if (!fs || !path) return -1;
+    backup_begin(fs);
+    unsigned parity;
+    reader_slot_t *r = ebr_enter(fs, &parity);
+
+    // The removals logged so far, by directory. Those logged while we export are taken from the
+    // live log and added after them (past nsorted), so a failed export can give them all back.
+    pthread_mutex_lock(&fs->gone_lock);
+    delta_gone_t *gone = fs->gone;
+    size_t ngone = fs->ngone, gone_cap = fs->gone_cap, nsorted = ngone;
+    fs->gone = NULL;
+    fs->ngone = fs->gone_cap = 0;
+    pthread_mutex_unlock(&fs->gone_lock);
+    if (nsorted) qsort(gone, nsorted, sizeof(*gone), delta_gone_cmp);
+
+    // was[i] keeps the flags node i had before the export cleared them, to put back on failure.
+    typedef struct { uint8_t archive, dirty; } export_was_t;
+    size_t n = 1, cap = 1024, was_cap = 0, done = 0;
+    node_t **nodes = malloc(cap * sizeof(*nodes));
+    image_node_t *recs = malloc(cap * sizeof(*recs));
+    export_was_t *was = NULL;
+    int rc = (nodes && recs && snap_reserve(&was, &was_cap, cap, sizeof(*was)) == 0) ? 0 : -1;
+    if (rc == 0) {
+        nodes[0] = fs->root;
+        recs[0].flags = __atomic_load_n(&fs->root->attributes, __ATOMIC_SEQ_CST) & ATTR_ARCHIVE ? 0 : IMAGE_KEEP;
+    }
+    for (size_t i = 0; rc == 0 && i < n; i++, done++) {
+        node_t *x = nodes[i];
+        int keep = recs[i].flags & IMAGE_KEEP;
+        was[i] = (export_was_t){ 0, 0 };
+        int dir = x->type == N_DIR;
+        if (recs[i].flags & IMAGE_GONE) {
+            recs[i].first = dir ? n : 0;
+            continue;
+        }
+        int descend = dir && (!keep || __atomic_load_n(&as_dir(x)->dirty, __ATOMIC_SEQ_CST));
+        if (!descend && keep) {
+            // Unchanged, and nothing below it changed either: just its name.
+            recs[i] = (image_node_t){
+                .ino = x->ino, .first = dir ? n : 0, .type = x->type, .name_len = (uint8_t)strlen(x->name),
+                .flags = IMAGE_KEEP,
+            };
+            continue;
+        }
+        if (descend && dir_ready(fs, x) < 0) {
+            rc = -1;
+            break;
+        }
+
+        // Clear the flags before reading what they cover: a change made meanwhile sets them again.
+        node_lock(x, LK_READ);
+        if (!keep) was[i].archive = __atomic_fetch_and(&x->attributes, (uint8_t)~ATTR_ARCHIVE, __ATOMIC_SEQ_CST) & ATTR_ARCHIVE;
+        if (dir) was[i].dirty = __atomic_exchange_n(&as_dir(x)->dirty, 0, __ATOMIC_SEQ_CST);
+        size_t first = n;
+
+        // Removals first, so a name removed and made again is removed before it comes back.
+        if (descend) {
+            size_t lo = 0, hi = nsorted;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (gone[mid].dir < x->ino) lo = mid + 1;
+                else hi = mid;
+            }
+            for (; rc == 0 && lo < nsorted && gone[lo].dir == x->ino; lo++) {
+                rc = delta_gone_record(&nodes, &recs, &cap, &n, &gone[lo]);
+            }
+            pthread_mutex_lock(&fs->gone_lock);
+            size_t kept = 0;
+            for (size_t j = 0; j < fs->ngone; j++) {
+                delta_gone_t *g = &fs->gone[j];
+                if (g->dir == x->ino && rc == 0 && snap_reserve(&gone, &gone_cap, ngone + 1, sizeof(*gone)) == 0) {
+                    gone[ngone++] = *g;
+                    rc = delta_gone_record(&nodes, &recs, &cap, &n, g);
+                } else {
+                    if (g->dir == x->ino) rc = -1;
+                    fs->gone[kept++] = *g;
+                }
+            }
+            fs->ngone = kept;
+            pthread_mutex_unlock(&fs->gone_lock);
+        }
+        size_t count = descend ? as_dir(x)->child_count : 0;
+        if (rc == 0) rc = image_grow(&nodes, &recs, &cap, n + count);
+        if (rc == 0) rc = snap_reserve(&was, &was_cap, n + count, sizeof(*was));
+        for (size_t j = 0; rc == 0 && j < count; j++) {
+            node_t *c = as_dir(x)->children[j];
+            int changed = __atomic_load_n(&c->attributes, __ATOMIC_SEQ_CST) & ATTR_ARCHIVE;
+            int below = c->type == N_DIR && __atomic_load_n(&as_dir(c)->dirty, __ATOMIC_SEQ_CST);
+            if (!changed && !below) continue;
+            nodes[n] = c;
+            recs[n++].flags = changed ? 0 : IMAGE_KEEP;
+        }
+        if (rc == 0) {
+            recs[i] = image_record(x);
+            recs[i].first = first;
+            recs[i].count = n - first;
+            recs[i].flags = (uint16_t)keep;
+        }
+        node_unlock(x);
+    }
+
+    if (rc == 0) rc = image_write(fs, path, FS_DELTA_MAGIC, nodes, recs, n, 0);
+
+    // Nothing was exported after all: put back exactly the flags the export cleared, leaving the
+    // rest of each node's attributes as they are now, and the removals it took.
+    for (size_t i = 0; rc < 0 && i < done; i++) {
+        if (was[i].archive) __atomic_or_fetch(&nodes[i]->attributes, ATTR_ARCHIVE, __ATOMIC_SEQ_CST);
+        if (was[i].dirty) __atomic_store_n(&as_dir(nodes[i])->dirty, 1, __ATOMIC_SEQ_CST);
+    }
+    if (rc < 0 && ngone) {
+        pthread_mutex_lock(&fs->gone_lock);
+        if (snap_reserve(&gone, &gone_cap, ngone + fs->ngone, sizeof(*gone)) == 0) {
+            if (fs->ngone) memcpy(gone + ngone, fs->gone, fs->ngone * sizeof(*gone));
+            free(fs->gone);
+            fs->gone = gone;
+            fs->ngone += ngone;
+            fs->gone_cap = gone_cap;
+            gone = NULL;
+        }
+        pthread_mutex_unlock(&fs->gone_lock);
+    }
+    for (size_t i = 0; nodes && recs && i < n; i++) {
+        if (recs[i].flags & IMAGE_GONE) free(nodes[i]);
+    }
+    ebr_exit(r, parity);
+    backup_end(fs);
+    free(gone);
+    free(nodes);
+    free(recs);
+    free(was);
+    return rc;
+}
+
+// Check that a whole image in memory is well formed, so that loading cannot fail halfway on
+// bad input. Sets *max_ino to the largest node number in it. Returns 0, or -1 if it is not.
+static int image_check(const uint8_t *img, size_t size, const char *magic, uint64_t *max_ino) {
+    if (image_check_header(img, size, magic) < 0) return -1;
+    const image_header_t *h = (const image_header_t *)img;
+
+    // Children must follow their parents in breadth-first order, each run right after the last,
+    // which also rules out cycles and nodes with two parents.
+    const image_node_t *recs = (const image_node_t *)(img + h->nodes_off);
+    uint64_t next = 1;
+    *max_ino = 0;
+    for (uint64_t i = 0; i < h->node_count; i++) {
+        const image_node_t *rec = &recs[i];
+        if (image_check_node(img, size, rec, i) < 0) return -1;
+        if (rec->ino > *max_ino) *max_ino = rec->ino;
+        if (rec->type == N_DIR) {
+            if (rec->first != next || rec->count > h->node_count - next) return -1;
+            next += rec->count;
+        }
+    }
+    return next == h->node_count ? 0 : -1;
+}
+
+// Fill a loaded file's size and contents from its record.
+static int image_load_file(file_node_t *f, const uint8_t *img, const image_node_t *rec) {
+    f->size = rec->size;
+    return file_fill(f, img, (const image_extent_t *)(img + rec->first), rec->count);
+}
+
+// Build the tree of a checked image into a freshly set up instance (which only has a root).
+// On failure the partly built tree is left for the caller to tear down.
+static int image_build(fs_t *fs, const uint8_t *img) {
+    const image_header_t *h = (const image_header_t *)img;
+    const image_node_t *recs = (const image_node_t *)(img + h->nodes_off);
+    size_t n = h->node_count, ndirs = 0;
+    for (size_t i = 1; i < n; i++) ndirs += recs[i].type == N_DIR;
+
+    // Allocate every node up front, a pool at a time, then hand them out in record order.
+    node_t **nodes = malloc(n * sizeof(*nodes));
+    node_t **spare = malloc(n * sizeof(*spare));
+    int rc = (nodes && spare) ? 0 : -1;
+    if (rc == 0) rc = pool_alloc_many(&fs->dir_pool, ndirs, spare);
+    if (rc == 0) rc = pool_alloc_many(&fs->file_pool, n - 1 - ndirs, spare + ndirs);
+    if (rc == 0) {
+        size_t di = 0, fi = ndirs;
+        nodes[0] = fs->root;
+        for (size_t i = 1; i < n; i++) {
+            node_t *x = nodes[i] = spare[recs[i].type == N_DIR ? di++ : fi++];
+            x->type = recs[i].type;
+            memcpy(x->name, img + recs[i].name_off, recs[i].name_len);
+            x->name_hash = name_hash(x->name, recs[i].name_len);
+            pthread_rwlock_init(&x->lock, NULL);
+        }
+    }
+
+    // Give every directory its exact children, in one allocation each, and every file its data.
+    // Nobody else can see the instance yet, so none of this needs the usual atomics.
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        node_t *x = nodes[i];
+        x->ino = recs[i].ino;
+        x->attributes = recs[i].attributes;
+        if (x->type == N_FILE) {
+            rc = image_load_file(as_file(x), img, &recs[i]);
+            continue;
+        }
+        dir_node_t *d = as_dir(x);
+        d->dirty = recs[i].flags & IMAGE_DIRTY;
+        size_t count = recs[i].count;
+        if (count == 0) continue;
+        size_t tcap = DIR_MIN_SLOTS;
+        while ((count + 1) * 2 > tcap) tcap *= 2;
+        d->children = malloc((count > DIR_MIN_SLOTS ? count : DIR_MIN_SLOTS) * sizeof(*d->children));
+        d->table = calloc(1, sizeof(*d->table) + tcap * sizeof(d->table->slots[0]));
+        if (!d->children || !d->table) {
+            rc = -1;
+            break;
+        }
+        d->child_cap = count > DIR_MIN_SLOTS ? count : DIR_MIN_SLOTS;
+        d->table->cap = tcap;
+        for (size_t j = 0; j < count; j++) {
+            node_t *c = nodes[recs[i].first + j];
+            if (dir_find(x, c->name, recs[recs[i].first + j].name_len)) { // Duplicate name.
+                rc = -1;
+                break;
+            }
+            c->parent = x;
+            c->dir_index = j;
+            d->children[d->child_count++] = c;
+            dir_slot_insert(d, d->table, c);
+            nidx_insert(fs, c);
+        }
+    }
+
+    // Timestamps last, since nothing above may touch them.
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        nodes[i]->created = recs[i].created;
+        nodes[i]->modified = recs[i].modified;
+        nodes[i]->accessed = recs[i].accessed;
+    }
+    free(nodes);
+    free(spare);
+    return rc;
+}
+
+// Read a whole image file with one sequential read into a malloc'd buffer (NULL on error).
+static uint8_t *image_read(const char *path, size_t *size) {
+    FILE *in = fopen(path, "rb");
+    if (!in) return NULL;
+    struct stat st;
+    uint8_t *img = NULL;
+    *size = 0;
+    if (fstat(fileno(in), &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        *size = (size_t)st.st_size;
+        img = malloc(*size);
+        if (img && fread(img, 1, *size, in) != *size) {
+            free(img);
+            img = NULL;
+        }
+    }
+    fclose(in);
+    return img;
+}
+
+// Replace the tree with the one saved in an image at path (see fs.h for the conditions).
+int fsi_load(fs_t *fs, const char *path) {
+    if (!fs || !path) return -1;
+    if (__atomic_load_n(&fs->snap_newest, __ATOMIC_SEQ_CST)) return -1; // Open snapshots point into the tree.
+    size_t size;
+    uint8_t *img = image_read(path, &size);
+    uint64_t max_ino;
+    if (!img || image_check(img, size, FS_IMAGE_MAGIC, &max_ino) < 0) {
+        free(img);
+        return -1;
+    }
+
+    // The image is good: drop the old tree and build the new one in its place.
+    const image_header_t *h = (const image_header_t *)img;
+    int threads = fs->search_threads, use_index = fs->search_index;
+    fs_teardown(fs);
+    int rc = fs_setup(fs) < 0 ? -1 : image_build(fs, img);
+    if (rc < 0) {
+        fs_teardown(fs); // Out of memory partway: leave an empty tree rather than half of one.
+        fs_setup(fs);
     } else {
-        info->size = 0;
-        info->child_count = n->child_count;
+        fs->next_ino = h->next_ino > max_ino ? h->next_ino : max_ino;
+        fs->backup_ino = fs->next_ino; // Any of these may be in a backup.
+    }
+    fs->search_threads = threads;
+    fs->search_index = use_index;
+    free(img);
+    return rc;
+}
+
+// Replace the tree with the one in an image at path, mapped rather than read (see fs.h). Only the
+// header and root are checked here; the rest is checked as it is materialized.
+int fsi_map(fs_t *fs, const char *path) {
+    if (!fs || !path) return -1;
+    if (__atomic_load_n(&fs->snap_newest, __ATOMIC_SEQ_CST)) return -1; // Open snapshots point into the tree.
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    const uint8_t *img = MAP_FAILED;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        size = (size_t)st.st_size;
+        img = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd); // The mapping keeps the file open.
+    if (img == MAP_FAILED) return -1;
+
+    const image_header_t *h = (const image_header_t *)img;
+    const image_node_t *root = NULL;
+    if (image_check_header(img, size, FS_IMAGE_MAGIC) == 0) root = (const image_node_t *)(img + h->nodes_off);
+    if (!root || image_check_node(img, size, root, 0) < 0 || root->ino > h->next_ino) {
+        munmap((void *)img, size);
+        return -1;
+    }
+
+    // Start over with just the root, whose children wait in the image.
+    int threads = fs->search_threads, use_index = fs->search_index;
+    fs_teardown(fs);
+    if (fs_setup(fs) < 0) {
+        munmap((void *)img, size);
+        return -1;
+    }
+    fs->search_threads = threads;
+    fs->search_index = use_index;
+    fs->map = img;
+    fs->map_size = size;
+    fs->next_ino = fs->backup_ino = h->next_ino;
+    fs->root->ino = root->ino;
+    fs->root->attributes = root->attributes;
+    fs->root->created = root->created;
+    fs->root->modified = root->modified;
+    fs->root->accessed = root->accessed;
+    as_dir(fs->root)->dirty = root->flags & IMAGE_DIRTY;
+    if (root->count) {
+        as_dir(fs->root)->lazy = root;
+        fs->lazy_dirs = 1;
     }
-    
-    // Update access time since we accessed the node.
-    n->accessed = time(NULL);
-    
     return 0;
 }
 
-// Set file/directory attributes. 
-// Can set multiple using bitwise | (OR) operator.
-int set_file_attributes(const char *path, uint8_t attributes) {
-    
-    // Find the file using walk() & want_parent = 0, which returns the final component/file to be set.
-    node_t *n = walk(path, 0, NULL);
-    if (!n) return -1;
-    
-    // Update attributes.
-    n->attributes = attributes;
-    n->modified = time(NULL); // Changing attributes counts as modification.
-    
+// Applying delta images:
+// A delta is applied through the ordinary operations, top-down: each removal record takes its node
+// (and everything below it) away, and each changed node is created or rewritten. Read-only
+// directories are opened up while their children change, and all metadata is set at the end,
+// children before parents, so the changes themselves leave no trace in the timestamps.
+
+// Join a directory path and a child name into a malloc'd path.
+static char *delta_join(const char *dir, const char *name, size_t len) {
+    size_t dlen = strlen(dir);
+    char *p = malloc(dlen + len + 2);
+    if (!p) return NULL;
+    memcpy(p, dir, dlen);
+    if (dlen > 1) p[dlen++] = '/'; // Root is already "/".
+    memcpy(p + dlen, name, len);
+    p[dlen + len] = '\0';
+    return p;
+}
+
+// List the names of the children of the directory at path into a malloc'd array of count entries
+// (*names is NULL if there are none). Returns 0, or -1.
+static int delta_list(fs_t *fs, const char *path, char (**names)[NAME_MAX + 1], size_t *count) {
+    node_t *d = walk(&fs->session, path, 0, NULL, LK_READ);
+    if (!d) return -1;
+    size_t n = d->type == N_DIR ? as_dir(d)->child_count : 0;
+    *names = n ? malloc(n * sizeof(**names)) : NULL;
+    int rc = n && !*names ? -1 : 0;
+    for (size_t j = 0; rc == 0 && j < n; j++) memcpy((*names)[j], as_dir(d)->children[j]->name, NAME_MAX + 1);
+    node_unlock(d);
+    *count = n;
+    return rc;
+}
+
+// Remove the node at path and everything below it, read-only or not. Depth-first with an explicit
+// stack, so deep trees cannot overflow the call stack; a directory goes once its children have.
+static int delta_remove(fs_t *fs, const char *path) {
+    typedef struct { char *path; node_type type; int listed; } entry_t;
+    size_t n = 0, cap = 16;
+    entry_t *stack = malloc(cap * sizeof(*stack));
+    char *first = strdup(path);
+    int rc = stack && first ? 0 : -1;
+    if (rc == 0) stack[n++] = (entry_t){ first, N_FILE, 0 };
+    else free(first);
+    while (rc == 0 && n) {
+        size_t top = n - 1;
+        if (stack[top].listed) {
+            rc = stack[top].type == N_DIR ? fsi_rmdir_empty(fs, stack[top].path) : fsi_rm_file(fs, stack[top].path);
+            free(stack[top].path);
+            n--;
+            continue;
+        }
+
+        // Make the node removable, then stack its children above it.
+        node_t *x = walk(&fs->session, stack[top].path, 0, NULL, LK_WRITE);
+        if (!x) {
+            rc = -1;
+            break;
+        }
+        __atomic_and_fetch(&x->attributes, (uint8_t)~ATTR_READONLY, __ATOMIC_SEQ_CST);
+        stack[top].type = x->type;
+        stack[top].listed = 1;
+        node_unlock(x);
+        if (stack[top].type != N_DIR) continue;
+
+        char (*names)[NAME_MAX + 1];
+        size_t count;
+        if (delta_list(fs, stack[top].path, &names, &count) < 0) {
+            rc = -1;
+            break;
+        }
+        if (n + count > cap) {
+            while (n + count > cap) cap *= 2;
+            entry_t *p = realloc(stack, cap * sizeof(*p));
+            if (p) stack = p;
+            else rc = -1;
+        }
+        for (size_t j = 0; rc == 0 && j < count; j++) {
+            char *child = delta_join(stack[top].path, names[j], strlen(names[j]));
+            if (child) stack[n++] = (entry_t){ child, N_FILE, 0 };
+            else rc = -1;
+        }
+        free(names);
+    }
+    while (n) free(stack[--n].path);
+    free(stack);
+    return rc;
+}
+
+// Write a changed file's contents from its delta record, replacing what it had.
+static int delta_file(fs_t *fs, const char *path, const uint8_t *img, const image_node_t *rec) {
+    if (fsi_truncate(fs, path, 0) < 0) return -1;
+    const image_extent_t *ext = (const image_extent_t *)(img + rec->first);
+    for (uint64_t j = 0; j < rec->count; j++) {
+        if (fsi_write_file(fs, path, ext[j].index * FS_CHUNK_SIZE, img + ext[j].off, ext[j].len) < 0) return -1;
+    }
+    return fsi_truncate(fs, path, rec->size);
+}
+
+// Apply a delta image at path to fs (see fs.h).
+int fsi_apply_delta(fs_t *fs, const char *path) {
+    if (!fs || !path) return -1;
+    size_t size;
+    uint8_t *img = image_read(path, &size);
+    uint64_t max_ino;
+    if (!img || image_check(img, size, FS_DELTA_MAGIC, &max_ino) < 0) {
+        free(img);
+        return -1;
+    }
+    const image_header_t *h = (const image_header_t *)img;
+    const image_node_t *recs = (const image_node_t *)(img + h->nodes_off);
+    size_t n = h->node_count;
+
+    // Every record's path (parents come before their children), and the attributes of unchanged
+    // directories opened up below (-1 if untouched).
+    char **paths = calloc(n, sizeof(*paths));
+    int *saved = malloc(n * sizeof(*saved));
+    int rc = paths && saved ? 0 : -1;
+    if (rc == 0 && !(paths[0] = strdup("/"))) rc = -1;
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        saved[i] = -1;
+        for (uint64_t j = 0; rc == 0 && recs[i].type == N_DIR && j < recs[i].count; j++) {
+            const image_node_t *c = &recs[recs[i].first + j];
+            paths[recs[i].first + j] = delta_join(paths[i], (const char *)img + c->name_off, c->name_len);
+            if (!paths[recs[i].first + j]) rc = -1;
+        }
+    }
+
+    // Unchanged nodes must be there already: otherwise the delta belongs to another tree. Removal
+    // records are just a name. Check before changing anything.
+    file_info_t info;
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        if (recs[i].flags & IMAGE_GONE) {
+            if (i == 0 || (recs[i].flags & IMAGE_KEEP) || recs[i].count) rc = -1;
+            continue;
+        }
+        if (!(recs[i].flags & IMAGE_KEEP)) continue;
+        if (fsi_get_file_info(fs, paths[i], &info) < 0 || info.type != (node_type)recs[i].type) rc = -1;
+    }
+
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        const image_node_t *rec = &recs[i];
+        int keep = rec->flags & IMAGE_KEEP;
+        if (rec->flags & IMAGE_GONE) {
+            // Already gone if it was made after the backup this delta follows.
+            if (fsi_get_file_info(fs, paths[i], &info) == 0) rc = delta_remove(fs, paths[i]);
+            continue;
+        }
+        if (!keep) {
+            int have = fsi_get_file_info(fs, paths[i], &info) == 0;
+            if (have && info.type != (node_type)rec->type) {
+                rc = delta_remove(fs, paths[i]);
+                have = 0;
+            }
+            if (rc == 0 && !have) rc = rec->type == N_DIR ? fsi_mkdir_p(fs, paths[i]) : fsi_create_file(fs, paths[i]);
+            if (rc == 0 && rec->type == N_FILE) rc = delta_file(fs, paths[i], img, rec);
+        }
+        if (rc < 0 || rec->type != N_DIR || (keep && rec->count == 0)) continue;
+
+        // Let children come and go below a read-only directory until its metadata is set.
+        node_t *d = walk(&fs->session, paths[i], 0, NULL, LK_WRITE);
+        if (d && node_cow(fs, d) < 0) {
+            node_unlock(d);
+            d = NULL;
+        }
+        if (!d) {
+            rc = -1;
+            break;
+        }
+        saved[i] = __atomic_fetch_and(&d->attributes, (uint8_t)~ATTR_READONLY, __ATOMIC_SEQ_CST);
+        node_unlock(d);
+    }
+
+    // Metadata last, children before parents: changed nodes take their records', and unchanged
+    // directories get back what they had.
+    for (size_t i = n; rc == 0 && i-- > 0;) {
+        const image_node_t *rec = &recs[i];
+        if ((rec->flags & IMAGE_GONE) || ((rec->flags & IMAGE_KEEP) && saved[i] < 0)) continue;
+        node_t *x = walk(&fs->session, paths[i], 0, NULL, LK_WRITE);
+        if (x && node_cow(fs, x) < 0) {
+            node_unlock(x);
+            x = NULL;
+        }
+        if (!x) {
+            rc = -1;
+            break;
+        }
+        if (rec->flags & IMAGE_KEEP) {
+            __atomic_store_n(&x->attributes, (uint8_t)saved[i], __ATOMIC_SEQ_CST);
+        } else {
+            __atomic_store_n(&x->attributes, rec->attributes, __ATOMIC_SEQ_CST);
+            x->created = rec->created;
+            stamp(&x->modified, rec->modified);
+            stamp(&x->accessed, rec->accessed);
+        }
+        node_unlock(x);
+    }
+
+    for (size_t i = 0; paths && i < n; i++) free(paths[i]);
+    free(paths);
+    free(saved);
+    free(img);
+    return rc;
+}
+
+// Journal files (see "Journal" above):
+
+// Map a journal file for reading. Returns the mapping, NULL for an empty file, or MAP_FAILED.
+static const uint8_t *journal_map(int fd, size_t *size) {
+    struct stat st;
+    *size = 0;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size > SIZE_MAX) return MAP_FAILED;
+    if (st.st_size == 0) return NULL;
+    *size = (size_t)st.st_size;
+    return mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+}
+
+// Check a mapped journal's header. Returns 0 if it is a journal this build can read.
+static int journal_check_header(const uint8_t *log, size_t size) {
+    journal_header_t h;
+    if (size < sizeof(h)) return -1;
+    memcpy(&h, log, sizeof(h));
+    if (memcmp(h.magic, FS_JOURNAL_MAGIC, sizeof(h.magic)) != 0) return -1;
+    return h.version == FS_JOURNAL_VERSION && h.order == FS_IMAGE_ORDER ? 0 : -1;
+}
+
+// Decode the record at *pos of a mapped journal into rec, its path and its data, and advance *pos.
+// Returns 0 at the end of the intact records: the end of the file, or a record torn by a crash.
+static int journal_next(const uint8_t *log, size_t size, size_t *pos, journal_record_t *rec,
+                        const char **path, const uint8_t **data) {
+    if (size - *pos < sizeof(*rec)) return 0;
+    memcpy(rec, log + *pos, sizeof(*rec));
+    // Lengths come from the file: check them before any arithmetic that could wrap.
+    if (rec->len < sizeof(*rec) || rec->len > size - *pos) return 0;
+    if (rec->path_len == 0 || rec->path_len > rec->len - sizeof(*rec)) return 0;
+    const uint8_t *p = log + *pos + sizeof(*rec);
+    if (p[rec->path_len - 1] != '\0') return 0;
+
+    uint32_t sum = rec->sum;
+    rec->sum = 0;
+    uint32_t h = journal_sum(2166136261u, rec, sizeof(*rec));
+    h = journal_sum(h, p, rec->len - sizeof(*rec));
+    rec->sum = sum;
+    if (h != sum) return 0;
+
+    *path = (const char *)p;
+    *data = p + rec->path_len;
+    *pos += rec->len;
+    return 1;
+}
+
+// Start logging changes to fs in a journal at path (see fs.h). A new file starts with a header;
+// an existing journal keeps its intact records, and a tail torn by a crash is cut off.
+int fsi_journal_open(fs_t *fs, const char *path, int policy, int interval_ms) {
+    if (!fs || !path || fs->journal) return -1;
+    if (policy != FS_SYNC_ALWAYS && policy != FS_SYNC_INTERVAL && policy != FS_SYNC_NEVER) return -1;
+    if (policy == FS_SYNC_INTERVAL && interval_ms <= 0) return -1;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    size_t size, end = 0;
+    const uint8_t *log = journal_map(fd, &size);
+    if (log == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (log) {
+        // Not a journal: leave the file alone.
+        if (journal_check_header(log, size) < 0) {
+            munmap((void *)log, size);
+            close(fd);
+            return -1;
+        }
+        journal_record_t rec;
+        const char *p;
+        const uint8_t *data;
+        end = sizeof(journal_header_t);
+        while (journal_next(log, size, &end, &rec, &p, &data)) {}
+        munmap((void *)log, size);
+    }
+
+    int rc = 0;
+    if (end == 0) {
+        journal_header_t h = { FS_JOURNAL_MAGIC, FS_JOURNAL_VERSION, FS_IMAGE_ORDER };
+        rc = journal_write_all(fd, &h, sizeof(h));
+        end = sizeof(h);
+    } else if (end < size) {
+        rc = ftruncate(fd, (off_t)end);
+    }
+    if (rc == 0 && end != size && policy != FS_SYNC_NEVER) rc = fdatasync(fd);
+    if (rc == 0 && lseek(fd, (off_t)end, SEEK_SET) < 0) rc = -1;
+
+    journal_t *j = rc == 0 ? calloc(1, sizeof(*j)) : NULL;
+    char *name = j ? strdup(path) : NULL;
+    if (!name) {
+        free(j);
+        close(fd);
+        return -1;
+    }
+    j->fd = fd;
+    j->path = name;
+    j->policy = policy;
+    j->interval_ms = interval_ms;
+    j->size = end;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    if (policy == FS_SYNC_INTERVAL && pthread_create(&j->flusher, NULL, journal_flusher, j) != 0) {
+        j->policy = FS_SYNC_NEVER; // No flusher to stop.
+        fs->journal = j;
+        journal_stop(fs);
+        return -1;
+    }
+    __atomic_store_n(&fs->journal, j, __ATOMIC_RELEASE);
     return 0;
 }
 
-// Update access and modification times (like UNIX touch command).
-int touch_file(const char *path) {
+// Write out everything logged so far and get it to disk, whatever the policy.
+int fsi_journal_sync(fs_t *fs) {
+    journal_t *j = fs ? __atomic_load_n(&fs->journal, __ATOMIC_ACQUIRE) : NULL;
+    if (!j) return -1;
+    pthread_mutex_lock(&j->lock);
+    int rc = journal_wait(j, j->appended, 1);
+    pthread_mutex_unlock(&j->lock);
+    return rc;
+}
 
-    // Find the file using walk() & want_parent = 0, which returns the final component/file to be set.
-    node_t *n = walk(path, 0, NULL);
-    if (!n) return -1;
-    
-    // Need to update both the access time and modification time.
-    time_t now = time(NULL);
-    n->accessed = now;
-    n->modified = now;
-    
+// Stop logging and close the journal.
+int fsi_journal_close(fs_t *fs) {
+    if (!fs || !fs->journal) return -1;
+    return journal_stop(fs);
+}
+
+// Redo a logged change on fs. Returns what the operation returned (negative if it failed).
+static int journal_apply(fs_t *fs, const journal_record_t *rec, const char *path, const uint8_t *data) {
+    switch (rec->op) {
+    case JOP_MKDIR: return fsi_mkdir_p(fs, path);
+    case JOP_CREATE: return fsi_create_file(fs, path);
+    case JOP_WRITE:
+        if (rec->b != rec->len - sizeof(*rec) - rec->path_len) return -1;
+        return fsi_write_file(fs, path, rec->a, data, rec->b) < 0 ? -1 : 0;
+    case JOP_RM: return fsi_rm_file(fs, path);
+    case JOP_RMDIR: return fsi_rmdir_empty(fs, path);
+    case JOP_ATTR: return fsi_set_file_attributes(fs, path, rec->attributes);
+    case JOP_TOUCH: return fsi_touch_file(fs, path);
+    case JOP_TRUNCATE: return fsi_truncate(fs, path, rec->a);
+    case JOP_FALLOCATE: return fsi_fallocate(fs, path, rec->a, rec->b);
+    }
+    return -1;
+}
+
+// Give the nodes a redone change touched the times the original change gave them, rather than now.
+static void journal_restamp(fs_t *fs, const journal_record_t *rec, const char *path) {
+    time_t t = (time_t)rec->time;
+    if (rec->op == JOP_CREATE || rec->op == JOP_RM || rec->op == JOP_RMDIR) {
+        char leaf[NAME_MAX + 1];
+        node_t *p = walk(&fs->session, path, 1, leaf, LK_WRITE);
+        if (p && node_cow(fs, p) == 0) {
+            stamp(&p->modified, t);
+            stamp(&p->accessed, t);
+        }
+        if (p) node_unlock(p);
+    }
+    if (rec->op == JOP_RM || rec->op == JOP_RMDIR || rec->op == JOP_FALLOCATE) return;
+    node_t *n = walk(&fs->session, path, 0, NULL, LK_WRITE);
+    if (!n) return;
+    if (node_cow(fs, n) < 0) {
+        node_unlock(n);
+        return;
+    }
+    if (rec->op == JOP_CREATE || rec->op == JOP_MKDIR) n->created = t;
+    stamp(&n->modified, t);
+    if (rec->op != JOP_ATTR) stamp(&n->accessed, t);
+    node_unlock(n);
+}
+
+// Redo the changes logged in a journal at path on fs (see fs.h). Returns the number of records
+// read, or -1 if the file is not a journal.
+int fsi_journal_replay(fs_t *fs, const char *path) {
+    if (!fs || !path || fs->journal) return -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    size_t size;
+    const uint8_t *log = journal_map(fd, &size);
+    close(fd); // The mapping keeps the file open.
+    if (!log) return 0; // Created but never written: nothing to redo.
+    if (log == MAP_FAILED) return -1;
+    if (journal_check_header(log, size) < 0) {
+        munmap((void *)log, size);
+        return -1;
+    }
+
+    // Changes that fail now were already in the tree (see fs_journal_checkpoint()) or failed
+    // before they were logged for a reason the log does not show; either way, skip them.
+    int count = 0;
+    size_t pos = sizeof(journal_header_t);
+    journal_record_t rec;
+    const char *p;
+    const uint8_t *data;
+    while (journal_next(log, size, &pos, &rec, &p, &data)) {
+        if (journal_apply(fs, &rec, p, data) >= 0) journal_restamp(fs, &rec, p);
+        count++;
+    }
+    munmap((void *)log, size);
+    return count;
+}
+
+// Replace j's file with one holding only the records from byte offset mark on. Called with j->lock
+// held and nothing left to write. On failure the old file is kept (it is longer, but still right).
+static int journal_rewrite(journal_t *j, uint64_t mark) {
+    size_t plen = strlen(j->path);
+    char *tmp = malloc(plen + 5);
+    if (!tmp) return -1;
+    memcpy(tmp, j->path, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    journal_header_t h = { FS_JOURNAL_MAGIC, FS_JOURNAL_VERSION, FS_IMAGE_ORDER };
+    int rc = fd < 0 ? -1 : journal_write_all(fd, &h, sizeof(h));
+    uint8_t buf[65536];
+    for (uint64_t off = mark; rc == 0 && off < j->size;) {
+        size_t n = j->size - off < sizeof(buf) ? (size_t)(j->size - off) : sizeof(buf);
+        ssize_t k = pread(j->fd, buf, n, (off_t)off);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0 || journal_write_all(fd, buf, (size_t)k) < 0) rc = -1;
+        off += k > 0 ? (uint64_t)k : 0;
+    }
+    if (rc == 0) rc = fdatasync(fd);
+    if (rc == 0) rc = rename(tmp, j->path);
+    if (rc < 0) {
+        if (fd >= 0) close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    close(j->fd);
+    j->fd = fd;
+    j->size = sizeof(h) + (j->size - mark);
     return 0;
 }
 
-// Format timestamp for human-readable display.
-const char* format_time(time_t timestamp) {
-    static char buffer[32];
-    struct tm *tm_info = localtime(&timestamp);
-    
-    if (!tm_info) {
-        strncpy(buffer, "Invalid time", sizeof(buffer));
-        return buffer;
+// Save fs to an image at path and drop the journal records the image makes unnecessary.
+int fsi_journal_checkpoint(fs_t *fs, const char *path) {
+    journal_t *j = fs ? __atomic_load_n(&fs->journal, __ATOMIC_ACQUIRE) : NULL;
+    if (!j) return -1;
+
+    // Every change logged before mark is in the tree by now, so the image will hold it.
+    pthread_mutex_lock(&j->lock);
+    int rc = journal_wait(j, j->appended, 1);
+    uint64_t mark = j->size;
+    pthread_mutex_unlock(&j->lock);
+    if (rc < 0 || fsi_save(fs, path) < 0) return -1;
+
+    // The image must be on disk before the records are dropped.
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    rc = fsync(fd);
+    close(fd);
+    if (rc < 0) return -1;
+
+    // Changes made during the save stay in the log: some may be in the image too, and are
+    // simply redone on replay.
+    pthread_mutex_lock(&j->lock);
+    rc = journal_wait(j, j->appended, 1);
+    if (rc == 0) rc = journal_rewrite(j, mark);
+    pthread_mutex_unlock(&j->lock);
+    return rc;
+}
+
+// Snapshots (see "Snapshots" above):
+
+// Take a snapshot of fs. It costs the same whatever the size of the tree: nothing is copied here.
+fs_snapshot_t *fsi_snapshot(fs_t *fs) {
+    if (!fs) return NULL;
+    fs_snapshot_t *snap = malloc(sizeof(*snap));
+    if (!snap) return NULL;
+    pthread_mutex_lock(&fs->snap_lock);
+    if (snap_reserve(&fs->snaps, &fs->snaps_cap, fs->nsnaps + 1, sizeof(uint64_t)) < 0) {
+        pthread_mutex_unlock(&fs->snap_lock);
+        free(snap);
+        return NULL;
     }
-    
-    // Format: "YYYY-MM-DD HH:MM:SS".
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", tm_info);
-    return buffer;
+    snap->fs = fs;
+    snap->id = fs->snap_gen + 1;
+    fs->snaps[fs->nsnaps++] = snap->id;
+
+    // Open before the generation moves on, so a writer that sees the new generation also sees a
+    // snapshot that needs its node's state (see node_cow()).
+    __atomic_store_n(&fs->snap_newest, snap->id, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&fs->snap_gen, snap->id, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&fs->snap_lock);
+    return snap;
 }
 
-// Format attributes for human-readable display.
-const char* format_attributes(uint8_t attributes) {
-    static char buffer[32];
-    buffer[0] = '\0';
-    
-    if (attributes == ATTR_NONE) {
-        strncpy(buffer, "none", sizeof(buffer));
-        return buffer;
+// Put a node back on the list of nodes with versions, or of zombies (died != 0), after pruning.
+// Out of memory, it is left until the pools are released.
+static void snap_requeue(fs_t *fs, node_t *n, uint64_t died) {
+    pthread_mutex_lock(&fs->snap_lock);
+    if (!died && snap_reserve(&fs->versioned, &fs->versioned_cap, fs->nversioned + 1, sizeof(node_t *)) == 0) {
+        fs->versioned[fs->nversioned++] = n;
+    } else if (died && snap_reserve(&fs->zombies, &fs->zombies_cap, fs->nzombies + 1, sizeof(snap_zombie_t)) == 0) {
+        fs->zombies[fs->nzombies++] = (snap_zombie_t){ n, died };
     }
-    
-    int first = 1;
-    if (attributes & ATTR_HIDDEN) {
-        strncat(buffer, first ? "hidden" : ",hidden", sizeof(buffer) - strlen(buffer) - 1);
-        first = 0;
+    pthread_mutex_unlock(&fs->snap_lock);
+}
+
+// Free what no open snapshot can see any more: versions first, then zombies left without any.
+// Both lists are taken over whole and what is still needed is put back, so writers adding to them
+// meanwhile are not held up. Snapshot readers may still be on a pruned version, so it is retired.
+static void snap_collect(fs_t *fs) {
+    pthread_mutex_lock(&fs->snap_gc_lock);
+    pthread_mutex_lock(&fs->snap_lock);
+    size_t nsnaps = fs->nsnaps;
+    uint64_t *ids = malloc((nsnaps ? nsnaps : 1) * sizeof(*ids));
+    if (!ids) {
+        pthread_mutex_unlock(&fs->snap_lock);
+        pthread_mutex_unlock(&fs->snap_gc_lock);
+        return; // Left for the next release.
     }
-    if (attributes & ATTR_READONLY) {
-        strncat(buffer, first ? "readonly" : ",readonly", sizeof(buffer) - strlen(buffer) - 1);
-        first = 0;
+    memcpy(ids, fs->snaps, nsnaps * sizeof(*ids));
+    node_t **nodes = fs->versioned;
+    size_t nnodes = fs->nversioned;
+    snap_zombie_t *zombies = fs->zombies;
+    size_t nzombies = fs->nzombies;
+    fs->versioned = NULL;
+    fs->nversioned = fs->versioned_cap = 0;
+    fs->zombies = NULL;
+    fs->nzombies = fs->zombies_cap = 0;
+    pthread_mutex_unlock(&fs->snap_lock);
+
+    // A version is seen by the snapshots after its generation, up to that of the next newer state.
+    for (size_t i = 0; i < nnodes; i++) {
+        node_t *n = nodes[i];
+        node_lock(n, LK_WRITE);
+        uint64_t upper = n->snap->gen;
+        node_t **link = &n->snap->versions;
+        for (node_t *v = n->snap->versions; v; ) {
+            node_t *older = v->snap->versions;
+            uint64_t gen = v->snap->gen;
+            if (snap_open_in(ids, nsnaps, gen, upper)) {
+                link = &v->snap->versions;
+            } else {
+                __atomic_store_n(link, older, __ATOMIC_RELEASE);
+                ebr_retire(fs, v, NULL);
+            }
+            upper = gen;
+            v = older;
+        }
+        if (n->snap->versions) snap_requeue(fs, n, 0);
+        node_unlock(n);
     }
-    if (attributes & ATTR_SYSTEM) {
-        strncat(buffer, first ? "system" : ",system", sizeof(buffer) - strlen(buffer) - 1);
-        first = 0;
+
+    // A zombie is seen by the snapshots after its creation, up to its removal.
+    for (size_t i = 0; i < nzombies; i++) {
+        node_t *z = zombies[i].node;
+        if (node_versions(z) || snap_open_in(ids, nsnaps, node_born(z), zombies[i].died)) snap_requeue(fs, z, zombies[i].died);
+        else ebr_retire(fs, z, NULL);
     }
-    if (attributes & ATTR_ARCHIVE) {
-        strncat(buffer, first ? "archive" : ",archive", sizeof(buffer) - strlen(buffer) - 1);
-        first = 0;
+
+    free(ids);
+    free(nodes);
+    free(zombies);
+    pthread_mutex_unlock(&fs->snap_gc_lock);
+}
+
+// Release a snapshot, freeing the versions and removed nodes that only it could see.
+void fs_snapshot_release(fs_snapshot_t *snap) {
+    if (!snap) return;
+    fs_t *fs = snap->fs;
+    pthread_mutex_lock(&fs->snap_lock);
+    size_t i = 0;
+    while (i < fs->nsnaps && fs->snaps[i] != snap->id) i++;
+    if (i < fs->nsnaps) {
+        memmove(&fs->snaps[i], &fs->snaps[i + 1], (fs->nsnaps - i - 1) * sizeof(*fs->snaps));
+        fs->nsnaps--;
     }
-    
-    return buffer;
+    __atomic_store_n(&fs->snap_newest, fs->nsnaps ? fs->snaps[fs->nsnaps - 1] : 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&fs->snap_lock);
+    free(snap);
+    snap_collect(fs);
+}
+
+// Look a name up in directory d as snapshot k sees it. Returns the child, or NULL.
+static node_t *snap_lookup(fs_t *fs, node_t *d, uint64_t k, const char *name, size_t len) {
+    if (d->type != N_DIR || dir_ready(fs, d) < 0) return NULL;
+    int locked;
+    node_t *s = snap_state(d, k, &locked);
+    node_t *c = s ? dir_find(s, name, len) : NULL;
+    if (locked) node_unlock(s);
+    return c;
+}
+
+// Resolve a path in a snapshot, from the root. Returns the node (not its state: see snap_state()),
+// or NULL. Called inside a read section.
+static node_t *snap_walk(fs_snapshot_t *snap, const char *path) {
+    if (!path) return NULL;
+    fs_t *fs = snap->fs;
+
+    // Directories above the current one, for "..".
+    size_t depth = 0, cap = 16;
+    node_t **up = malloc(cap * sizeof(*up));
+    if (!up) return NULL;
+
+    node_t *cur = fs->root;
+    const char *tok;
+    size_t len;
+    while (cur && path_next(&path, &tok, &len)) {
+        if (tok_is_dot(tok, len)) continue;
+        if (tok_is_dotdot(tok, len)) {
+            if (depth) cur = up[--depth];
+            continue;
+        }
+        if (depth == cap) {
+            node_t **p = realloc(up, cap * 2 * sizeof(*p));
+            if (!p) {
+                cur = NULL;
+                break;
+            }
+            up = p;
+            cap *= 2;
+        }
+        up[depth++] = cur;
+        cur = snap_lookup(fs, cur, snap->id, tok, len);
+    }
+    free(up);
+    return cur;
+}
+
+// Get metadata of a file or directory as snapshot snap saw it.
+int fs_snapshot_get_file_info(fs_snapshot_t *snap, const char *path, file_info_t *info) {
+    if (!snap || !info) return -1;
+    unsigned parity;
+    reader_slot_t *r = ebr_enter(snap->fs, &parity);
+    node_t *n = snap_walk(snap, path);
+    int locked = 0;
+    node_t *s = n && dir_ready(snap->fs, n) == 0 ? snap_state(n, snap->id, &locked) : NULL;
+    if (s) node_fill_info(s, info);
+    if (locked) node_unlock(s);
+    ebr_exit(r, parity);
+    return s ? 0 : -1;
+}
+
+// Read from a file as snapshot snap saw it (same parameters and result as read_file()). A file that
+// has not changed is locked only while the chunks to read are pinned.
+ssize_t fs_snapshot_read_file(fs_snapshot_t *snap, const char *path, size_t off, void *buf, size_t len) {
+    if (!snap || (!buf && len)) return -1;
+    unsigned parity;
+    reader_slot_t *r = ebr_enter(snap->fs, &parity);
+    node_t *n = snap_walk(snap, path);
+    int locked = 0;
+    node_t *s = n ? snap_state(n, snap->id, &locked) : NULL;
+    fs_view_t view;
+    ssize_t got = s && s->type == N_FILE ? file_pin(as_file(s), off, len, &view) : -1;
+    if (locked) node_unlock(s);
+    ebr_exit(r, parity);
+
+    for (size_t i = 0, pos = 0; got > 0 && i < view.nsegs; i++) {
+        memcpy((uint8_t *)buf + pos, view.segs[i].data, view.segs[i].len);
+        pos += view.segs[i].len;
+    }
+    if (got >= 0) fs_view_release(&view);
+    return got;
+}
+
+// Copy the children of directory n as snapshot k sees them into a malloc'd array (*out).
+// Returns their number, or -1 on error.
+static ssize_t snap_children(fs_t *fs, node_t *n, uint64_t k, node_t ***out) {
+    *out = NULL;
+    if (dir_ready(fs, n) < 0) return -1;
+    int locked;
+    node_t *s = snap_state(n, k, &locked);
+    if (!s) return -1;
+    size_t count = as_dir(s)->child_count;
+    ssize_t rc = (ssize_t)count;
+    if (count && !(*out = malloc(count * sizeof(**out)))) rc = -1;
+    if (rc > 0) memcpy(*out, as_dir(s)->children, count * sizeof(**out));
+    if (locked) node_unlock(s);
+    return rc;
+}
+
+typedef struct snap_frame {
+    node_t **children; // Copy of the directory's children in the snapshot.
+    size_t count, next; // Their number, and the next one to visit.
+    size_t len; // Length of the directory's path in the path buffer.
+} snap_frame_t;
+
+// Search a whole snapshot (see fs.h): the same depth-first traversal as search_serial(), over
+// copies of each directory's children, so nothing stays locked while fn runs. fn gets each node's
+// state in the snapshot; one that has not changed is the live node itself.
+int fs_snapshot_search_cb(fs_snapshot_t *snap, const char *term, fs_search_fn fn, void *arg) {
+    if (!snap || !term || !fn) return -1;
+    fs_t *fs = snap->fs;
+    unsigned parity;
+    reader_slot_t *r = ebr_enter(fs, &parity);
+
+    size_t cap = 256, depth = 0, max_depth = 16;
+    char *path = malloc(cap);
+    snap_frame_t *stack = malloc(max_depth * sizeof(*stack));
+    int matches = 0, rc = (path && stack) ? 0 : -1;
+    if (rc == 0) {
+        path[0] = '/';
+        path[1] = '\0';
+        ssize_t count = snap_children(fs, fs->root, snap->id, &stack[0].children);
+        if (count < 0) rc = -1;
+        else stack[depth++] = (snap_frame_t){ stack[0].children, (size_t)count, 0, 1 };
+    }
+
+    while (rc == 0 && depth > 0) {
+        snap_frame_t *f = &stack[depth - 1];
+        if (f->next == f->count) {
+            free(f->children);
+            depth--;
+            continue;
+        }
+        node_t *c = f->children[f->next++];
+
+        // Append "/name" to the directory's path (root's path already ends in '/').
+        size_t nlen = strlen(c->name);
+        if (f->len + nlen + 2 > cap) {
+            size_t newcap = cap * 2 > f->len + nlen + 2 ? cap * 2 : f->len + nlen + 2;
+            char *p = realloc(path, newcap);
+            if (!p) {
+                rc = -1;
+                break;
+            }
+            path = p;
+            cap = newcap;
+        }
+        size_t clen = f->len;
+        if (path[clen - 1] != '/') path[clen++] = '/';
+        memcpy(path + clen, c->name, nlen + 1);
+        clen += nlen;
+
+        if (strstr(c->name, term)) {
+            // The live node, unless it changed since: then the version the snapshot sees.
+            node_t *s = c;
+            if (node_gen(c) >= snap->id) {
+                s = node_versions(c);
+                while (s && s->snap->gen >= snap->id) s = node_versions(s);
+            }
+            matches++;
+            if (s && fn(s, path, clen, arg)) break;
+        }
+
+        if (c->type == N_DIR) {
+            if (depth == max_depth) {
+                snap_frame_t *st = realloc(stack, max_depth * 2 * sizeof(*st));
+                if (!st) {
+                    rc = -1;
+                    break;
+                }
+                stack = st;
+                max_depth *= 2;
+            }
+            node_t **children;
+            ssize_t count = snap_children(fs, c, snap->id, &children);
+            if (count < 0) {
+                rc = -1;
+                break;
+            }
+            stack[depth++] = (snap_frame_t){ children, (size_t)count, 0, clen };
+        }
+    }
+
+    // Stopped early: free the copies still on the stack.
+    while (depth > 0) free(stack[--depth].children);
+    free(stack);
+    free(path);
+    ebr_exit(r, parity);
+    return rc < 0 ? -1 : matches;
+}
+
+// Save a snapshot into an image at path (see fs_save()). Files that have not changed are frozen
+// one at a time while written, so writers are not held up by the save either.
+int fs_snapshot_save(fs_snapshot_t *snap, const char *path) {
+    if (!snap || !path) return -1;
+    return image_save(snap->fs, path, snap->id);
+}
+
+// Instance operations:
+// The path-based fsi_* functions use the instance's built-in session.
+
+int fsi_cd(fs_t *fs, const char *path) { return fss_cd(&fs->session, path); }
+
+int fsi_mkdir_p(fs_t *fs, const char *path) { return fss_mkdir_p(&fs->session, path); }
+int fsi_rmdir_empty(fs_t *fs, const char *path) { return fss_rmdir_empty(&fs->session, path); }
+int fsi_ls_dir(fs_t *fs, const char *path) { return fss_ls_dir(&fs->session, path); }
+int fsi_search(fs_t *fs, const char *term) { return fss_search(&fs->session, term); }
+int fsi_search_cb(fs_t *fs, const char *term, fs_search_fn fn, void *arg) { return fss_search_cb(&fs->session, term, fn, arg); }
+
+int fsi_create_file(fs_t *fs, const char *path) { return fss_create_file(&fs->session, path); }
+int fsi_rm_file(fs_t *fs, const char *path) { return fss_rm_file(&fs->session, path); }
+
+ssize_t fsi_write_file(fs_t *fs, const char *path, size_t off, const void *buf, size_t len) {
+    return fss_write_file(&fs->session, path, off, buf, len);
+}
+
+ssize_t fsi_read_file(fs_t *fs, const char *path, size_t off, void *buf, size_t len) {
+    return fss_read_file(&fs->session, path, off, buf, len);
+}
+
+ssize_t fsi_writev(fs_t *fs, const char *path, size_t off, const struct iovec *iov, int iovcnt) {
+    return fss_writev(&fs->session, path, off, iov, iovcnt);
+}
+
+ssize_t fsi_readv(fs_t *fs, const char *path, size_t off, const struct iovec *iov, int iovcnt) {
+    return fss_readv(&fs->session, path, off, iov, iovcnt);
+}
+
+int fsi_truncate(fs_t *fs, const char *path, size_t size) { return fss_truncate(&fs->session, path, size); }
+int fsi_fallocate(fs_t *fs, const char *path, size_t off, size_t len) { return fss_fallocate(&fs->session, path, off, len); }
+
+int fsi_get_file_info(fs_t *fs, const char *path, file_info_t *info) { return fss_get_file_info(&fs->session, path, info); }
+int fsi_set_file_attributes(fs_t *fs, const char *path, uint8_t attributes) {
+    return fss_set_file_attributes(&fs->session, path, attributes);
+}
+int fsi_touch_file(fs_t *fs, const char *path) { return fss_touch_file(&fs->session, path); }
+
+int fsi_open(fs_t *fs, const char *path, int flags) { return fss_open(&fs->session, path, flags); }
+
+ssize_t fsi_read_file_view(fs_t *fs, const char *path, size_t off, size_t len, fs_view_t *view) {
+    return fss_read_file_view(&fs->session, path, off, len, view);
+}
+
+// Default instance:
+// The original single-file-system API, kept as thin wrappers over default_fs.
+
+void fs_init(void) { fs_setup(&default_fs); }
+void fs_destroy(void) { fs_teardown(&default_fs); }
+int fs_cd(const char *path) { return fsi_cd(&default_fs, path); }
+
+int mkdir_p(const char *path) { return fsi_mkdir_p(&default_fs, path); }
+int rmdir_empty(const char *path) { return fsi_rmdir_empty(&default_fs, path); }
+int ls_dir(const char *path) { return fsi_ls_dir(&default_fs, path); }
+int fs_search(const char *term) { return fsi_search(&default_fs, term); }
+int fs_search_cb(const char *term, fs_search_fn fn, void *arg) { return fsi_search_cb(&default_fs, term, fn, arg); }
+int fs_set_search_threads(int nthreads) { return fsi_set_search_threads(&default_fs, nthreads); }
+int fs_set_search_index(int on) { return fsi_set_search_index(&default_fs, on); }
+int fs_save(const char *path) { return fsi_save(&default_fs, path); }
+int fs_load(const char *path) { return fsi_load(&default_fs, path); }
+int fs_map(const char *path) { return fsi_map(&default_fs, path); }
+int fs_export_delta(const char *path) { return fsi_export_delta(&default_fs, path); }
+int fs_apply_delta(const char *path) { return fsi_apply_delta(&default_fs, path); }
+fs_snapshot_t *fs_snapshot(void) { return fsi_snapshot(&default_fs); }
+int fs_journal_open(const char *path, int policy, int interval_ms) { return fsi_journal_open(&default_fs, path, policy, interval_ms); }
+int fs_journal_sync(void) { return fsi_journal_sync(&default_fs); }
+int fs_journal_close(void) { return fsi_journal_close(&default_fs); }
+int fs_journal_replay(const char *path) { return fsi_journal_replay(&default_fs, path); }
+int fs_journal_checkpoint(const char *path) { return fsi_journal_checkpoint(&default_fs, path); }
+
+int create_file(const char *path) { return fsi_create_file(&default_fs, path); }
+int rm_file(const char *path) { return fsi_rm_file(&default_fs, path); }
+
+ssize_t write_file(const char *path, size_t off, const void *buf, size_t len) {
+    return fsi_write_file(&default_fs, path, off, buf, len);
+}
+
+ssize_t read_file(const char *path, size_t off, void *buf, size_t len) {
+    return fsi_read_file(&default_fs, path, off, buf, len);
+}
+
+ssize_t fs_writev(const char *path, size_t off, const struct iovec *iov, int iovcnt) {
+    return fsi_writev(&default_fs, path, off, iov, iovcnt);
+}
+
+ssize_t fs_readv(const char *path, size_t off, const struct iovec *iov, int iovcnt) {
+    return fsi_readv(&default_fs, path, off, iov, iovcnt);
+}
+
+int fs_truncate(const char *path, size_t size) { return fsi_truncate(&default_fs, path, size); }
+int fs_fallocate(const char *path, size_t off, size_t len) { return fsi_fallocate(&default_fs, path, off, len); }
+
+int get_file_info(const char *path, file_info_t *info) { return fsi_get_file_info(&default_fs, path, info); }
+int set_file_attributes(const char *path, uint8_t attributes) { return fsi_set_file_attributes(&default_fs, path, attributes); }
+int touch_file(const char *path) { return fsi_touch_file(&default_fs, path); }
+void get_dcache_stats(dcache_stats_t *stats) { fsi_get_dcache_stats(&default_fs, stats); }
+
+int fs_open(const char *path, int flags) { return fsi_open(&default_fs, path, flags); }
+int fs_close(int fd) { return fsi_close(&default_fs, fd); }
+ssize_t fs_pread(int fd, size_t off, void *buf, size_t len) { return fsi_pread(&default_fs, fd, off, buf, len); }
+ssize_t fs_pwrite(int fd, size_t off, const void *buf, size_t len) { return fsi_pwrite(&default_fs, fd, off, buf, len); }
+ssize_t fs_append(int fd, const void *buf, size_t len, size_t *off) { return fsi_append(&default_fs, fd, buf, len, off); }
+int fs_fstat(int fd, file_info_t *info) { return fsi_fstat(&default_fs, fd, info); }
+
+ssize_t read_file_view(const char *path, size_t off, size_t len, fs_view_t *view) {
+    return fsi_read_file_view(&default_fs, path, off, len, view);
 }
 
-int fs_search(const char *term) {
-    if (!term || term[0] == '\0') return -1;
-    int matches = search_subtree(cwd, term);
-    return matches >= 0 ? matches : -1;
+ssize_t fs_pread_view(int fd, size_t off, size_t len, fs_view_t *view) {
+    return fsi_pread_view(&default_fs, fd, off, len, view);
 }
@@ -4,13 +4,14 @@
 */
 
 #pragma once // Prevents multiple inclusions of the header.
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #define NAME_MAX 32 // Defines maximum length for file/directory names (31 characters + null terminator).
-#define MAX_CHILDREN 64 // Defines maximum number of files/subdirectories per directory.
 
 // File attribute flags (can be combined using bitwise OR).
 // For example, if you wanted a hidden and read-only file, you would set node->attributes = ATTR_HIDDEN | ATTR_READONLY to get 0x03.
@@ -18,36 +19,100 @@
 #define ATTR_HIDDEN   0x01  // Hidden file/directory.
 #define ATTR_READONLY 0x02  // Read-only file/directory.
 #define ATTR_SYSTEM   0x04  // System file/directory.
-#define ATTR_ARCHIVE  0x08  // Archive bit (modified since last backup).
+#define ATTR_ARCHIVE  0x08  // Archive bit (modified since last backup, see fs_export_delta()).
 
 // Defines two types of file system nodes: N_DIR & N_FILE.
 // N_DIR: directory (can contain other files/directories).
 // N_FILE: regular file (contains data).
 typedef enum { N_DIR=1, N_FILE=2 } node_type;
 
-// Core data structure:
+// Core data structures:
+// Every node starts with this common header. Directories and files extend it with their own
+// payload (dir_node_t / file_node_t below), so each node only carries the fields its type needs.
+// Fields are ordered to avoid padding.
 typedef struct node {
     node_type type; // N_DIR or N_FILE.
+    uint32_t name_hash; // Cached hash of name (used by the parent's child table).
+    uint64_t ino; // Node number: unique within a file system, increasing in creation order.
     char name[NAME_MAX+1]; // File/directory name.
+    uint8_t attributes; // File attributes (ATTR_* flags).
+    uint32_t refcount; // Pins: open handles (see fs_open()) and, for directories, working directories.
     struct node *parent; // Pointer to parent directory.
+    union {
+        size_t dir_index; // Position of this node in the parent's children array.
+        struct node *next_retired; // Once removed: next node waiting to be freed (see fs.c).
+    };
+    pthread_rwlock_t lock; // Guards the payload: a directory's children, a file's data and size.
 
     // Metadata:
     time_t created;    // Creation timestamp.
     time_t modified;   // Last modification timestamp.
     time_t accessed;   // Last access timestamp.
-    uint8_t attributes; // File attributes (ATTR_* flags).
 
-    // For directories:
-    struct node *children[MAX_CHILDREN]; // Array of child nodes.
+    struct node_snap *snap; // Snapshot state (see fs_snapshot() and fs.c), NULL until a snapshot needs it.
+} node_t;
+
+// Directory node (type == N_DIR).
+typedef struct dir_node {
+    node_t base; // Common header (must be first).
+    node_t **children; // Growable array of child nodes (listing order).
     size_t child_count; // Number of children.
+    size_t child_cap; // Allocated length of the children array.
+    struct dir_table *table; // Open-addressing hash table over children (see fs.c), NULL until the first child is added.
+    size_t slot_used; // Occupied slots, including tombstones left behind by removals.
+    const struct image_node *lazy; // Image record whose children are not materialized yet (see fs_map()), or NULL.
+    uint8_t dirty; // A descendant changed since the last backup (see fs_export_delta()).
+} dir_node_t;
 
-    // For files:
-    uint8_t *data; // File content (dynamically allocated).
-    size_t size; // Current file size.
-    size_t cap; // Allocated capacity.
-} node_t;
+// File contents are stored in fixed-size chunks allocated on demand, so growing a file never
+// copies existing data. Files are sparse: chunks that were never written are not allocated and
+// read back as zeros. A small file keeps a smaller chunk 0 that grows by doubling up to FS_CHUNK_SIZE.
+// Tiny files skip chunks altogether and keep their first FS_INLINE_MAX bytes inside the node.
+#define FS_CHUNK_SIZE (64 * 1024)
+#define FS_INLINE_MAX 64
+
+// Reference-counted chunk storage. Read views (see read_file_view()) pin the chunks they point
+// into, and snapshots share them; a writer copies a shared chunk before modifying it, so pinned
+// bytes never change.
+typedef struct fs_chunk {
+    size_t refs; // References: the owning file plus any views and snapshot versions sharing the chunk.
+    size_t cap; // Bytes of data (only chunk 0 may be smaller than FS_CHUNK_SIZE).
+    uint8_t data[]; // Chunk contents.
+} fs_chunk_t;
+
+// One allocated chunk of a file.
+typedef struct file_extent {
+    size_t index; // Chunk number: covers bytes [index*FS_CHUNK_SIZE, (index+1)*FS_CHUNK_SIZE).
+    fs_chunk_t *chunk; // Chunk storage.
+} file_extent_t;
+
+// File node (type == N_FILE).
+// While nextents is 0 the contents live in inline_data (bytes past FS_INLINE_MAX read as zeros);
+// the first write reaching past FS_INLINE_MAX moves them into chunk 0. While image is set, they are
+// still in a mapped image instead (see fs_map()).
+typedef struct file_node {
+    node_t base; // Common header (must be first).
+    size_t size; // Current (logical) file size.
+    size_t allocated; // Bytes of chunk storage allocated (0 while the contents are inline).
+    size_t nextents; // Number of allocated chunks (0 means the contents are inline).
+    const uint8_t *image; // Mapped image still holding the contents (see fs_map()), or NULL.
+    union {
+        struct {
+            file_extent_t *extents; // Allocated chunks, sorted by index (missing chunks are holes).
+            size_t extent_cap; // Allocated length of the extents array.
+        };
+        uint8_t inline_data[FS_INLINE_MAX]; // Contents of a tiny file.
+        struct {
+            const struct image_extent *image_ext; // While image is set: the contents' extents in it.
+            size_t image_count; // Number of those extents.
+        };
+    };
+} file_node_t;
 
 // File system operations:
+// Every operation below may be called from several threads at once, except fs_init() and
+// fs_destroy(). Operations that only read (lookups, reads, metadata queries) do not block each other,
+// and path resolution itself takes no locks.
 // System management:
 void fs_init(void); // Initialize the file system.
 void fs_destroy(void); // Clean up and free memory.
@@ -59,12 +124,101 @@ int rmdir_empty(const char *path); // Remove empty directory.
 int ls_dir(const char *path); // List directory contents.
 int fs_search(const char *term); // Search file system for a file name that matches with term
 
+// Search with a callback: fn is called for every node in the working directory's subtree whose name
+// contains term, with the node's full path (len bytes, not valid after fn returns). Returning
+// nonzero from fn stops the search. Returns the number of matches reported, or -1 on error.
+// fn may read the file system but must not change it: directories being searched stay read-locked.
+// Terms of three or more bytes are looked up in an index of names instead of walking the tree,
+// unless the index is turned off with fs_set_search_index(0).
+typedef int (*fs_search_fn)(const node_t *node, const char *path, size_t len, void *arg);
+int fs_search_cb(const char *term, fs_search_fn fn, void *arg);
+
+// Parallel search: with more than one thread, fs_search() splits the tree across a pool of worker
+// threads. Matches are reported in the same order as a serial search once the whole tree is searched.
+#define FS_SEARCH_MAX_THREADS 256
+int fs_set_search_threads(int nthreads); // Threads fs_search() uses (1, the default, is serial).
+int fs_set_search_index(int on); // Use the name index for long terms (1, the default) or always walk (0).
+
+// Images:
+// fs_save() writes the whole tree (names, metadata, attributes and file contents) to a compact,
+// versioned binary image; fs_load() replaces the tree with the one in an image, reading it with one
+// sequential read and allocating its nodes in bulk. Saving may run while other threads use the file
+// system: each directory and file is captured as it was when the save reached it. Loading may not:
+// like fs_init(), it needs the file system to itself, it closes every open handle, and sessions
+// other than the built-in one must be freed first. An image that cannot be read or is malformed
+// leaves the tree unchanged; running out of memory while loading leaves it empty.
+int fs_save(const char *path); // Save the tree to an image file, returns 0 (or -1 on error).
+int fs_load(const char *path); // Replace the tree with an image file's, returns 0 (or -1 on error).
+
+// Mapped images: fs_map() replaces the tree with an image's like fs_load(), but maps the image
+// instead of reading it, so it costs the same however large the image is. A directory's children
+// are materialized the first time a walk descends into it or an operation touches something below
+// it, and files read their data straight from the image until they are first changed. Damage in the
+// image is found only when the part holding it is materialized, and makes that operation fail.
+// The image file must not be changed while mapped (fs_save() over it is fine: it replaces the file),
+// and read views of files still in the image must be released before the image is unmapped by
+// fs_destroy(), fs_load() or another fs_map(). Searches do not use the name index until every
+// directory has been materialized.
+int fs_map(const char *path); // Replace the tree with a mapped image file's, returns 0 (or -1 on error).
+
+// Incremental backup: every change to a node (creating it, writing, truncating, touching, setting
+// its attributes, adding or removing its children) sets its ATTR_ARCHIVE bit, and directories
+// remember whether anything below them has the bit set. The bit is the only record of a change:
+// set_file_attributes() always leaves it set, whatever it is given, and only fs_export_delta()
+// clears it. fs_export_delta() writes just the nodes with the bit set to a delta image and clears
+// it, visiting only directories on the way to them, so it costs time in proportion to what changed
+// rather than to the tree. A removal is written as a record of its own, so a directory that changed
+// is not listed in full. Images keep the bits, so backups can go on after fs_load() or fs_map().
+// fs_apply_delta() brings a tree that matches the previous backup (an fs_load() of a full image plus
+// every delta since, in order) up to date; it fails, changing nothing, if a node the delta expects
+// to be unchanged is missing. Node numbers are not kept. Exporting may run while other threads
+// change the tree: a change it misses leaves its bit set for the next export. Applying is meant for
+// a tree nothing else is changing.
+int fs_export_delta(const char *path); // Write changed nodes to a delta image file, returns 0 (or -1 on error).
+int fs_apply_delta(const char *path); // Apply a delta image file to the tree, returns 0 (or -1 on error).
+
+// Journal:
+// While a journal is open, every change to the tree (directories made or removed, files created,
+// written, truncated, allocated or removed, attributes set, touches) is appended to a log file on the
+// host before the operation returns, and fs_journal_replay() redoes a log's changes on a tree. Changes
+// made by concurrent threads are written out together (group commit). How often the log is forced to
+// disk is set by a policy:
+//   FS_SYNC_ALWAYS:   every change is on disk before its operation returns (changes arriving while
+//                     one fsync is in progress share the next).
+//   FS_SYNC_INTERVAL: a background thread fsyncs the log every interval_ms. A crash of the process
+//                     loses nothing; a crash of the host may lose the last interval.
+//   FS_SYNC_NEVER:    the host writes the log back whenever it likes.
+// A record torn by a crash ends the log: opening a journal cuts it off and replay stops there.
+// To recover, fs_load() (or fs_map()) the last checkpoint image, replay the journal, then open it
+// again to go on logging. fs_journal_checkpoint() saves an image and drops the records it makes
+// unnecessary; it may run while other threads change the tree. Opening, closing and replaying may
+// not, and fs_load(), fs_map() and fs_destroy() close the journal. If the log cannot be written,
+// changes go on but are no longer logged, and fs_journal_sync() and fs_journal_close() return -1.
+#define FS_SYNC_ALWAYS 0
+#define FS_SYNC_INTERVAL 1
+#define FS_SYNC_NEVER 2
+
+int fs_journal_open(const char *path, int policy, int interval_ms); // Start logging to a journal file, returns 0 (or -1 on error).
+int fs_journal_sync(void); // Get everything logged so far to disk, returns 0 (or -1 on error).
+int fs_journal_close(void); // Stop logging (writing out what is left), returns 0 (or -1 on error).
+int fs_journal_replay(const char *path); // Redo a journal's changes, returns the records read (or -1 on error).
+int fs_journal_checkpoint(const char *path); // Save an image to path and trim the journal, returns 0 (or -1 on error).
+
 // File operations:
 int create_file(const char *path); // Create empty file.
 ssize_t write_file(const char *path, size_t off, const void *buf, size_t len); // Write to file.
 ssize_t read_file(const char *path, size_t off, void *buf, size_t len); // Read from file.
 int rm_file(const char *path); // Remove file.
 
+// Scatter-gather file operations: transfer several buffers in one call, with one path
+// resolution and one metadata update for the whole batch.
+ssize_t fs_writev(const char *path, size_t off, const struct iovec *iov, int iovcnt); // Write buffers back to back.
+ssize_t fs_readv(const char *path, size_t off, const struct iovec *iov, int iovcnt); // Read into buffers in order.
+
+// File size management.
+int fs_truncate(const char *path, size_t size); // Shrink (releasing storage) or extend (as a hole) a file.
+int fs_fallocate(const char *path, size_t off, size_t len); // Reserve storage for a range without changing size.
+
 // Metadata operations:
 // Use new data structure to return just metadata information without other node information.
 typedef struct file_info {
@@ -75,18 +229,170 @@ typedef struct file_info {
     time_t accessed;     // Last access time.
     uint8_t attributes;  // File attributes.
     size_t size;         // File size (0 for directories).
+    size_t allocated;    // Bytes of storage allocated (less than size for sparse files, 0 for directories).
     size_t child_count;  // Number of children (for directories).
 } file_info_t;
 
 // Retrieve complete metadata for a file or directory.
 int get_file_info(const char *path, file_info_t *info); 
 
-// Set file attributes.
+// Set file attributes. ATTR_ARCHIVE is always set as well: see fs_export_delta().
 int set_file_attributes(const char *path, uint8_t attributes); 
 
 // Used when file is either accessed or modified.
 int touch_file(const char *path); 
 
+// Path lookup cache statistics (see get_dcache_stats()).
+typedef struct dcache_stats {
+    size_t hits;          // Lookups answered from the cache (including cached misses).
+    size_t negative_hits; // Subset of hits that returned a cached "does not exist".
+    size_t misses;        // Lookups that had to walk the tree.
+    size_t bypassed;      // Lookups with paths too long to cache.
+    size_t invalidations; // Times the cache was invalidated by a namespace change.
+    size_t capacity;      // Number of entries the cache can hold.
+} dcache_stats_t;
+
+// Retrieve path lookup cache counters (useful for sizing DCACHE_SIZE).
+void get_dcache_stats(dcache_stats_t *stats);
+
+// Open file handles:
+// A handle remembers the resolved file node, so repeated reads and writes skip path resolution.
+// A file removed while open stays usable through its handles and is freed on the last fs_close().
+#define FS_O_CREAT 0x01 // Create the file if it does not exist.
+#define FS_O_APPEND 0x02 // Every fs_pwrite() on the handle writes at end-of-file (the offset is ignored).
+
+int fs_open(const char *path, int flags); // Open a file, returns a handle >= 0 (or -1 on error).
+int fs_close(int fd); // Close a handle.
+ssize_t fs_pread(int fd, size_t off, void *buf, size_t len); // Read from an open file at an offset.
+ssize_t fs_pwrite(int fd, size_t off, const void *buf, size_t len); // Write to an open file at an offset.
+int fs_fstat(int fd, file_info_t *info); // Retrieve metadata for an open file.
+ssize_t fs_append(int fd, const void *buf, size_t len, size_t *off); // Write at end-of-file, reporting where the data landed.
+
+// Zero-copy reads:
+// A view describes a byte range as segments that point directly at file storage instead of
+// copying it. The bytes stay valid and unchanged until fs_view_release(), even if the file is
+// written to, truncated or removed meanwhile (writers copy pinned chunks instead).
+typedef struct fs_segment {
+    const uint8_t *data; // Start of the segment (read-only).
+    size_t len; // Length of the segment in bytes.
+} fs_segment_t;
+
+typedef struct fs_view {
+    fs_segment_t *segs; // Segments in file order.
+    size_t nsegs; // Number of segments.
+    size_t len; // Total bytes covered (short at end-of-file, like read_file()).
+    fs_chunk_t **pins; // Chunks pinned by this view (internal).
+    size_t npins; // Number of pinned chunks (internal).
+} fs_view_t;
+
+ssize_t read_file_view(const char *path, size_t off, size_t len, fs_view_t *view); // Borrow a range of a file, returns bytes covered.
+ssize_t fs_pread_view(int fd, size_t off, size_t len, fs_view_t *view); // Same, for an open file.
+void fs_view_release(fs_view_t *view); // Release a view's segments.
+
+// Snapshots:
+// fs_snapshot() takes a read-only, point-in-time view of the whole tree in O(1): it shares every node
+// and data chunk with the live tree. A node is copied only when it is first changed while a snapshot
+// can still see it, and the copy shares the file's chunks until a writer changes one of them (like a
+// read view's pins). Removed nodes are kept while a snapshot can still see them. Reads against a
+// snapshot take no lock on anything changed since it was taken; a node that has not changed is only
+// read-locked while a name is looked up in it or the chunks to read are pinned, never while data is
+// copied, so a long scan does not hold writers up. Paths are
+// resolved from the root. Access times and archive bits are not kept (a snapshot shows the live
+// ones where nothing else changed). Changes cost one extra copy of a node per snapshot that sees
+// it, and nothing at all while no snapshot is open. fs_load() and fs_map() fail while snapshots are
+// open; release them before fs_destroy() or fs_free().
+typedef struct fs_snapshot fs_snapshot_t;
+
+fs_snapshot_t *fs_snapshot(void); // Take a snapshot of the tree (NULL on allocation failure).
+void fs_snapshot_release(fs_snapshot_t *snap); // Drop a snapshot, freeing what only it kept.
+int fs_snapshot_get_file_info(fs_snapshot_t *snap, const char *path, file_info_t *info); // Metadata as of the snapshot.
+ssize_t fs_snapshot_read_file(fs_snapshot_t *snap, const char *path, size_t off, void *buf, size_t len); // Read a file as of the snapshot.
+// Like fs_search_cb() over the whole snapshot, with each node as the snapshot sees it. An empty term
+// matches every node, for scanning the whole snapshot. No locks are held while fn runs, so fn may
+// change the live tree.
+int fs_snapshot_search_cb(fs_snapshot_t *snap, const char *term, fs_search_fn fn, void *arg);
+int fs_snapshot_save(fs_snapshot_t *snap, const char *path); // Save the snapshot as an image (see fs_save()), returns 0 (or -1 on error).
+
+// File system instances:
+// Each fs_t is a separate namespace with its own tree, working directory, lookup cache and open
+// handles; instances share no state or locks. Every operation above has an fsi_* counterpart taking
+// the instance first. The functions above operate on a built-in default instance (fs_init()/fs_destroy()).
+typedef struct fs fs_t;
+
+fs_t *fs_new(void); // Create an empty file system (NULL on allocation failure).
+void fs_free(fs_t *fs); // Free a file system and everything in it.
+
+int fsi_cd(fs_t *fs, const char *path);
+int fsi_mkdir_p(fs_t *fs, const char *path);
+int fsi_rmdir_empty(fs_t *fs, const char *path);
+int fsi_ls_dir(fs_t *fs, const char *path);
+int fsi_search(fs_t *fs, const char *term);
+int fsi_search_cb(fs_t *fs, const char *term, fs_search_fn fn, void *arg);
+int fsi_set_search_threads(fs_t *fs, int nthreads);
+int fsi_set_search_index(fs_t *fs, int on);
+int fsi_save(fs_t *fs, const char *path);
+int fsi_load(fs_t *fs, const char *path);
+int fsi_map(fs_t *fs, const char *path);
+int fsi_export_delta(fs_t *fs, const char *path);
+int fsi_apply_delta(fs_t *fs, const char *path);
+int fsi_journal_open(fs_t *fs, const char *path, int policy, int interval_ms);
+int fsi_journal_sync(fs_t *fs);
+int fsi_journal_close(fs_t *fs);
+int fsi_journal_replay(fs_t *fs, const char *path);
+int fsi_journal_checkpoint(fs_t *fs, const char *path);
+fs_snapshot_t *fsi_snapshot(fs_t *fs);
+int fsi_create_file(fs_t *fs, const char *path);
+ssize_t fsi_write_file(fs_t *fs, const char *path, size_t off, const void *buf, size_t len);
+ssize_t fsi_read_file(fs_t *fs, const char *path, size_t off, void *buf, size_t len);
+int fsi_rm_file(fs_t *fs, const char *path);
+ssize_t fsi_writev(fs_t *fs, const char *path, size_t off, const struct iovec *iov, int iovcnt);
+ssize_t fsi_readv(fs_t *fs, const char *path, size_t off, const struct iovec *iov, int iovcnt);
+int fsi_truncate(fs_t *fs, const char *path, size_t size);
+int fsi_fallocate(fs_t *fs, const char *path, size_t off, size_t len);
+int fsi_get_file_info(fs_t *fs, const char *path, file_info_t *info);
+int fsi_set_file_attributes(fs_t *fs, const char *path, uint8_t attributes);
+int fsi_touch_file(fs_t *fs, const char *path);
+void fsi_get_dcache_stats(fs_t *fs, dcache_stats_t *stats);
+int fsi_open(fs_t *fs, const char *path, int flags);
+int fsi_close(fs_t *fs, int fd);
+ssize_t fsi_pread(fs_t *fs, int fd, size_t off, void *buf, size_t len);
+ssize_t fsi_pwrite(fs_t *fs, int fd, size_t off, const void *buf, size_t len);
+int fsi_fstat(fs_t *fs, int fd, file_info_t *info);
+ssize_t fsi_append(fs_t *fs, int fd, const void *buf, size_t len, size_t *off);
+ssize_t fsi_read_file_view(fs_t *fs, const char *path, size_t off, size_t len, fs_view_t *view);
+ssize_t fsi_pread_view(fs_t *fs, int fd, size_t off, size_t len, fs_view_t *view);
+
+// Sessions:
+// A session has its own working directory, so concurrent clients of one instance (shells, threads)
+// resolve relative paths independently. The fss_* functions are the path-based operations resolved
+// against a session; the fsi_* ones use a built-in session of the instance. Handles returned by
+// fss_open() belong to the instance and work with the fsi_* handle functions. Free every session
+// of an instance before the instance itself.
+typedef struct fs_session fs_session_t;
+
+fs_session_t *fs_session_new(fs_t *fs); // Open a session starting at the root directory (NULL on failure).
+void fs_session_free(fs_session_t *ss); // End a session.
+
+int fss_cd(fs_session_t *ss, const char *path);
+int fss_mkdir_p(fs_session_t *ss, const char *path);
+int fss_rmdir_empty(fs_session_t *ss, const char *path);
+int fss_ls_dir(fs_session_t *ss, const char *path);
+int fss_search(fs_session_t *ss, const char *term);
+int fss_search_cb(fs_session_t *ss, const char *term, fs_search_fn fn, void *arg);
+int fss_create_file(fs_session_t *ss, const char *path);
+ssize_t fss_write_file(fs_session_t *ss, const char *path, size_t off, const void *buf, size_t len);
+ssize_t fss_read_file(fs_session_t *ss, const char *path, size_t off, void *buf, size_t len);
+int fss_rm_file(fs_session_t *ss, const char *path);
+ssize_t fss_writev(fs_session_t *ss, const char *path, size_t off, const struct iovec *iov, int iovcnt);
+ssize_t fss_readv(fs_session_t *ss, const char *path, size_t off, const struct iovec *iov, int iovcnt);
+int fss_truncate(fs_session_t *ss, const char *path, size_t size);
+int fss_fallocate(fs_session_t *ss, const char *path, size_t off, size_t len);
+int fss_get_file_info(fs_session_t *ss, const char *path, file_info_t *info);
+int fss_set_file_attributes(fs_session_t *ss, const char *path, uint8_t attributes);
+int fss_touch_file(fs_session_t *ss, const char *path);
+int fss_open(fs_session_t *ss, const char *path, int flags);
+ssize_t fss_read_file_view(fs_session_t *ss, const char *path, size_t off, size_t len, fs_view_t *view);
+
 // Helper function to display timestamp.
 const char* format_time(time_t timestamp); 
 
@@ -3,8 +3,9 @@
 #include <string.h>
 #include <stdlib.h>
 
-int main(void){
+int main(int argc, char **argv){
     fs_init();
+    if (argc > 1 && fs_load(argv[1])) printf("Could not load image %s\n", argv[1]); // Optional image to start from.
     char line[1024];
     
 while (printf("fsh> "), fflush(stdout), fgets(line, sizeof(line), stdin)) {
@@ -46,6 +47,16 @@ while (printf("fsh> "), fflush(stdout), fgets(line, sizeof(line), stdin)) {
         printf("%zd\n", write_file(p1, 0, p2, strlen(p2)));
     }
 
+    else if (!strcmp(cmd,"append")) {
+        if (n < 3) { printf("usage: append PATH DATA...\n"); continue; }
+        int fd = fs_open(p1, 0);
+        size_t off = 0;
+        ssize_t w = fd < 0 ? -1 : fs_append(fd, p2, strlen(p2), &off);
+        if (fd >= 0) fs_close(fd);
+        if (w >= 0) printf("%zd bytes at offset %zu\n", w, off);
+        else puts("Error appending to file");
+    }
+
     else if (!strcmp(cmd,"read")) {
         if (n < 2) { printf("usage: read PATH\n"); continue; }
         char buf[1024] = {0};
@@ -77,6 +88,7 @@ while (printf("fsh> "), fflush(stdout), fgets(line, sizeof(line), stdin)) {
             printf("Type: %s\n", info.type == N_FILE ? "File" : "Directory");
             if (info.type == N_FILE) {
                 printf("Size: %zu bytes\n", info.size);
+                printf("Allocated: %zu bytes\n", info.allocated);
             } else {
                 printf("Children: %zu\n", info.child_count);
             }
@@ -114,6 +126,31 @@ while (printf("fsh> "), fflush(stdout), fgets(line, sizeof(line), stdin)) {
         }
     }
 
+    else if (!strcmp(cmd,"save")) {
+        if (n < 2) { printf("usage: save FILE\n"); continue; }
+        printf("%s\n", fs_save(p1) ? "Error saving image" : "Successfully saved image");
+    }
+
+    else if (!strcmp(cmd,"load")) {
+        if (n < 2) { printf("usage: load FILE\n"); continue; }
+        printf("%s\n", fs_load(p1) ? "Error loading image" : "Successfully loaded image");
+    }
+
+    else if (!strcmp(cmd,"map")) {
+        if (n < 2) { printf("usage: map FILE\n"); continue; }
+        printf("%s\n", fs_map(p1) ? "Error mapping image" : "Successfully mapped image");
+    }
+
+    else if (!strcmp(cmd,"backup")) {
+        if (n < 2) { printf("usage: backup FILE\n"); continue; }
+        printf("%s\n", fs_export_delta(p1) ? "Error writing delta" : "Successfully wrote delta");
+    }
+
+    else if (!strcmp(cmd,"restore")) {
+        if (n < 2) { printf("usage: restore FILE\n"); continue; }
+        printf("%s\n", fs_apply_delta(p1) ? "Error applying delta" : "Successfully applied delta");
+    }
+
     else if (!strcmp(cmd,"help")) {
         puts("Commands:");
         puts("  mkdir PATH - create directory");
@@ -121,6 +158,7 @@ while (printf("fsh> "), fflush(stdout), fgets(line, sizeof(line), stdin)) {
         puts("  create PATH - create file");
         puts("  cd PATH - change directory");
         puts("  write PATH TEXT - write to file");
+        puts("  append PATH TEXT - append to end of file");
         puts("  read PATH - read file");
         puts("  rm PATH - remove file");
         puts("  rmdir PATH - remove directory");
@@ -128,6 +166,11 @@ while (printf("fsh> "), fflush(stdout), fgets(line, sizeof(line), stdin)) {
         puts("  attr PATH FLAGS - set attributes");
         puts("  touch PATH - update timestamps");
         puts("  search TERM - find paths containing a term");
+        puts("  save FILE - save the tree to an image file");
+        puts("  load FILE - replace the tree with an image file's");
+        puts("  map FILE - like load, but read the image in place as it is used");
+        puts("  backup FILE - write what changed since the last backup to a delta file");
+        puts("  restore FILE - apply a delta file written by backup");
         puts("  help - show this help");
         puts("  exit - quit");
     }
@@ -4,9 +4,14 @@
 
 #include "fs.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 void test_metadata_initialization() {
     printf("=== Testing Metadata Initialization ===\n");
@@ -140,15 +145,15 @@ void test_attribute_combinations() {
         assert(get_file_info("/test/attributes.txt", &info) == 0);
         
         printf("✓ %s: %s\n", combinations[i].description, format_attributes(info.attributes));
-        assert(info.attributes == combinations[i].flags);
+        assert(info.attributes == (combinations[i].flags | ATTR_ARCHIVE)); // Setting them is a change.
     }
     
-    // Test clearing attributes.
+    // Test clearing attributes: all but the archive bit, which stays set until the next backup.
     assert(set_file_attributes("/test/attributes.txt", ATTR_NONE) == 0);
     file_info_t info;
     assert(get_file_info("/test/attributes.txt", &info) == 0);
     printf("✓ Cleared attributes: %s\n", format_attributes(info.attributes));
-    assert(info.attributes == ATTR_NONE);
+    assert(info.attributes == ATTR_ARCHIVE);
 }
 
 void test_error_handling() {
@@ -228,6 +233,34 @@ void test_large_file_metadata() {
     assert(info_after.size == total_size);
     assert(info_after.modified > info_before.modified);
     printf("✓ Large file metadata tracking works correctly\n");
+    
+    // Grow a file past two chunk boundaries in odd-sized appends, so writes straddle them.
+    static char data[2 * FS_CHUNK_SIZE + 5000], back[sizeof(data)];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (char)(i * 31 + i / FS_CHUNK_SIZE);
+    assert(create_file("/test/chunked.bin") == 0);
+    for (size_t off = 0; off < sizeof(data); off += 7777) {
+        size_t n = sizeof(data) - off < 7777 ? sizeof(data) - off : 7777;
+        assert(write_file("/test/chunked.bin", off, data + off, n) == (ssize_t)n);
+    }
+    file_info_t info;
+    assert(get_file_info("/test/chunked.bin", &info) == 0);
+    assert(info.size == sizeof(data) && info.allocated == 3 * FS_CHUNK_SIZE);
+    
+    // Read it back whole, and in a range that spans the first boundary.
+    assert(read_file("/test/chunked.bin", 0, back, sizeof(back)) == (ssize_t)sizeof(back));
+    assert(memcmp(data, back, sizeof(data)) == 0);
+    memset(back, 0, 100);
+    assert(read_file("/test/chunked.bin", FS_CHUNK_SIZE - 50, back, 100) == 100);
+    assert(memcmp(data + FS_CHUNK_SIZE - 50, back, 100) == 0);
+    
+    // Overwrite across the second boundary, then read past the end.
+    assert(write_file("/test/chunked.bin", 2 * FS_CHUNK_SIZE - 3, "boundary", 8) == 8);
+    assert(read_file("/test/chunked.bin", 2 * FS_CHUNK_SIZE - 4, back, 10) == 10);
+    assert(back[0] == data[2 * FS_CHUNK_SIZE - 4] && memcmp(back + 1, "boundary", 8) == 0 && back[9] == data[2 * FS_CHUNK_SIZE + 5]);
+    assert(read_file("/test/chunked.bin", sizeof(data) - 10, back, 100) == 10);
+    assert(get_file_info("/test/chunked.bin", &info) == 0 && info.size == sizeof(data) && info.allocated == 3 * FS_CHUNK_SIZE);
+    printf("✓ %zu bytes round-tripped across chunk boundaries, %zu allocated\n", info.size, info.allocated);
+    assert(rm_file("/test/chunked.bin") == 0);
 }
 
 void test_directory_access_tracking() {
@@ -259,6 +292,435 @@ void test_directory_access_tracking() {
     }
 }
 
+void test_large_directory() {
+    printf("\n=== Testing Large Directory ===\n");
+    
+    assert(mkdir_p("/bigdir") == 0);
+    
+    // Create far more entries than a fixed-size child array could hold.
+    const int count = 20000;
+    char path[64];
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/bigdir/f%d", i);
+        assert(create_file(path) == 0);
+    }
+    assert(create_file("/bigdir/f0") == -1); // Duplicates are still rejected.
+    
+    file_info_t info;
+    assert(get_file_info("/bigdir", &info) == 0);
+    assert(info.child_count == (size_t)count);
+    printf("✓ Created %d files in one directory\n", count);
+    
+    // Remove every other file, then check lookups still find the rest.
+    for (int i = 0; i < count; i += 2) {
+        snprintf(path, sizeof(path), "/bigdir/f%d", i);
+        assert(rm_file(path) == 0);
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/bigdir/f%d", i);
+        assert(get_file_info(path, &info) == (i % 2 ? 0 : -1));
+    }
+    printf("✓ Lookups stay correct after removals\n");
+    
+    for (int i = 1; i < count; i += 2) {
+        snprintf(path, sizeof(path), "/bigdir/f%d", i);
+        assert(rm_file(path) == 0);
+    }
+    assert(rmdir_empty("/bigdir") == 0);
+    printf("✓ Large directory emptied and removed\n");
+}
+
+// Checks the typed payload search hands out for each node of test_node_layout()'s /split.
+static int check_payload(const node_t *node, const char *path, size_t len, void *arg) {
+    (void)len;
+    if (node->type == N_DIR) assert(((const dir_node_t *)node)->child_count == (strcmp(path, "/split") == 0 ? 2u : 0u));
+    else assert(((const file_node_t *)node)->size == 5);
+    (*(int *)arg)++;
+    return 0;
+}
+
+void test_node_layout() {
+    printf("\n=== Testing Node Layout ===\n");
+    
+    // Nodes are a common header followed by their type's payload, and only as big as that type needs.
+    assert(offsetof(dir_node_t, base) == 0 && offsetof(file_node_t, base) == 0);
+    assert(sizeof(dir_node_t) > sizeof(node_t) && sizeof(file_node_t) > sizeof(node_t));
+    fs_t *fs = fs_new();
+    assert(fs);
+    assert(fsi_mkdir_p(fs, "/split/splitdir") == 0 && fsi_create_file(fs, "/split/splitfile") == 0);
+    assert(fsi_write_file(fs, "/split/splitfile", 0, "hello", 5) == 5);
+    int seen = 0;
+    assert(fsi_search_cb(fs, "split", check_payload, &seen) == 3 && seen == 3);
+    printf("✓ Directory and file nodes carry their own payloads after a common header\n");
+    fs_free(fs);
+}
+
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+// Virtual memory of this process in bytes, from /proc.
+static size_t vm_size(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[128];
+    size_t kb = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmSize: %zu kB", &kb) == 1) break;
+    }
+    if (f) fclose(f);
+    return kb * 1024;
+}
+#endif
+
+void test_node_pools() {
+    printf("\n=== Testing Node Pools ===\n");
+    
+    fs_t *fs = fs_new();
+    assert(fs);
+    
+    // Enough of both types for several slabs each, then a third removed and replaced: the freed
+    // nodes are reused, and no two live nodes share memory (each file holds its own number inline).
+    const int count = 6000;
+    char path[64];
+    assert(fsi_mkdir_p(fs, "/p") == 0);
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/p/f%d", i);
+        assert(fsi_create_file(fs, path) == 0 && fsi_write_file(fs, path, 0, &i, sizeof(i)) == sizeof(i));
+        snprintf(path, sizeof(path), "/p/d%d", i);
+        assert(fsi_mkdir_p(fs, path) == 0);
+    }
+    for (int i = 0; i < count; i += 3) {
+        snprintf(path, sizeof(path), "/p/f%d", i);
+        assert(fsi_rm_file(fs, path) == 0);
+        snprintf(path, sizeof(path), "/p/d%d", i);
+        assert(fsi_rmdir_empty(fs, path) == 0);
+    }
+    for (int i = 0; i < count; i += 3) {
+        snprintf(path, sizeof(path), "/p/n%d", i);
+        assert(fsi_create_file(fs, path) == 0 && fsi_write_file(fs, path, 0, &i, sizeof(i)) == sizeof(i));
+        snprintf(path, sizeof(path), "/p/e%d", i);
+        assert(fsi_mkdir_p(fs, path) == 0);
+    }
+    file_info_t info;
+    for (int i = 0; i < count; i++) {
+        int got = -1;
+        snprintf(path, sizeof(path), i % 3 ? "/p/f%d" : "/p/n%d", i);
+        assert(fsi_read_file(fs, path, 0, &got, sizeof(got)) == sizeof(got) && got == i);
+        snprintf(path, sizeof(path), i % 3 ? "/p/d%d" : "/p/e%d", i);
+        assert(fsi_get_file_info(fs, path, &info) == 0 && info.type == N_DIR && info.child_count == 0);
+    }
+    assert(fsi_get_file_info(fs, "/p", &info) == 0 && info.child_count == 2 * (size_t)count);
+    printf("✓ Nodes are freed and reused across slab boundaries\n");
+    
+    // Freeing the instance releases whatever is still live: nodes in every slab, chunked files,
+    // a removed file kept by its open handle, and versions a released snapshot left to retire.
+    static char big[200000];
+    memset(big, 'b', sizeof(big));
+    assert(fsi_create_file(fs, "/p/big") == 0 && fsi_write_file(fs, "/p/big", 0, big, sizeof(big)) == (ssize_t)sizeof(big));
+    int fd = fsi_open(fs, "/p/big", 0);
+    assert(fd >= 0 && fsi_rm_file(fs, "/p/big") == 0);
+    fs_snapshot_t *snap = fsi_snapshot(fs);
+    assert(snap);
+    assert(fsi_write_file(fs, "/p/f1", 0, "x", 1) == 1 && fsi_rm_file(fs, "/p/f2") == 0);
+    fs_snapshot_release(snap);
+    fs_free(fs);
+    printf("✓ Freeing an instance releases every live node\n");
+    
+    // A mapped directory that cannot be materialized for lack of memory gives back the nodes it
+    // took from the pools and stays as it was; with memory again, it comes out whole. The limit is
+    // set in a child, and only where the allocator reports failure rather than aborting.
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+    printf("✓ (Out-of-memory rollback not checked under sanitizers)\n");
+#else
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_test_%d.pool", (int)getpid());
+    const int many = 60000;
+    fs = fs_new();
+    assert(fs && fsi_mkdir_p(fs, "/m") == 0);
+    for (int i = 0; i < many; i++) {
+        snprintf(path, sizeof(path), "/m/f%d", i);
+        assert(fsi_create_file(fs, path) == 0 && fsi_truncate(fs, path, (size_t)(i % 97)) == 0);
+    }
+    assert(fsi_save(fs, image) == 0);
+    fs_free(fs);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        fs = fs_new();
+        assert(fs && fsi_map(fs, image) == 0);
+        struct rlimit was, low;
+        assert(getrlimit(RLIMIT_AS, &was) == 0);
+        low = was;
+        size_t before = vm_size(), slack = 4 * 1024 * 1024;
+        low.rlim_cur = before + slack; // Room for the arrays, not for the nodes.
+        assert(setrlimit(RLIMIT_AS, &low) == 0);
+        for (int tries = 0; tries < 3; tries++) assert(fsi_get_file_info(fs, "/m/f1", &info) == -1);
+        assert(setrlimit(RLIMIT_AS, &was) == 0);
+        assert(fsi_get_file_info(fs, "/m", &info) == 0 && info.child_count == (size_t)many);
+        assert(vm_size() - before < many * sizeof(file_node_t) + slack); // The nodes handed back were reused.
+        for (int i = 0; i < many; i++) {
+            snprintf(path, sizeof(path), "/m/f%d", i);
+            assert(fsi_get_file_info(fs, path, &info) == 0 && info.size == (size_t)(i % 97));
+        }
+        fs_free(fs);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    remove(image);
+    printf("✓ A failed materialization hands its nodes back and can be retried\n");
+#endif
+}
+
+void test_lookup_cache() {
+    printf("\n=== Testing Path Lookup Cache ===\n");
+    
+    file_info_t info;
+    dcache_stats_t before, after;
+    
+    // A missing path is cached as a miss, but creating it must make it visible.
+    assert(get_file_info("/test/cached.txt", &info) == -1);
+    assert(get_file_info("/test/cached.txt", &info) == -1);
+    assert(create_file("/test/cached.txt") == 0);
+    assert(get_file_info("/test/cached.txt", &info) == 0);
+    
+    // Repeated lookups of the same path are served from the cache.
+    get_dcache_stats(&before);
+    for (int i = 0; i < 10; i++) {
+        assert(get_file_info("/test/cached.txt", &info) == 0);
+    }
+    get_dcache_stats(&after);
+    assert(after.hits >= before.hits + 10);
+    printf("✓ Cache hits: %zu, misses: %zu\n", after.hits, after.misses);
+    
+    // Removing the file must not leave a stale positive entry.
+    assert(rm_file("/test/cached.txt") == 0);
+    assert(get_file_info("/test/cached.txt", &info) == -1);
+    printf("✓ Cache invalidated on create and remove\n");
+}
+
+void test_long_paths() {
+    printf("\n=== Testing Long Paths ===\n");
+    
+    // Build a path well past the old 1024-byte limit.
+    char path[2048] = "/deep";
+    while (strlen(path) < 1500) strcat(path, "/level");
+    assert(mkdir_p(path) == 0);
+    strcat(path, "/leaf.txt");
+    assert(create_file(path) == 0);
+    assert(write_file(path, 0, "deep", 4) == 4);
+    
+    file_info_t info;
+    assert(get_file_info(path, &info) == 0);
+    assert(info.size == 4);
+    printf("✓ %zu-byte path resolved without truncation\n", strlen(path));
+    
+    // "." and ".." are matched exactly, so "..." is an ordinary name.
+    assert(create_file("/deep/...") == 0);
+    assert(get_file_info("/deep/level/../...", &info) == 0);
+    assert(info.type == N_FILE);
+    assert(rm_file("/deep/...") == 0);
+    printf("✓ Dot components handled correctly\n");
+}
+
+void test_open_handles() {
+    printf("\n=== Testing Open File Handles ===\n");
+    
+    // Opening a missing file fails unless FS_O_CREAT is given.
+    assert(fs_open("/test/handle.txt", 0) == -1);
+    int fd = fs_open("/test/handle.txt", FS_O_CREAT);
+    assert(fd >= 0);
+    assert(fs_open("/test", 0) == -1); // Directories cannot be opened.
+    
+    // Stream writes through the handle.
+    char block[4096];
+    memset(block, 'h', sizeof(block));
+    for (int i = 0; i < 16; i++) {
+        assert(fs_pwrite(fd, (size_t)i * sizeof(block), block, sizeof(block)) == (ssize_t)sizeof(block));
+    }
+    
+    file_info_t info;
+    assert(fs_fstat(fd, &info) == 0);
+    assert(info.size == 16 * sizeof(block));
+    printf("✓ Wrote %zu bytes through handle %d\n", info.size, fd);
+    
+    // A removed file stays readable through its handle until it is closed.
+    assert(rm_file("/test/handle.txt") == 0);
+    assert(get_file_info("/test/handle.txt", &info) == -1);
+    char c = 0;
+    assert(fs_pread(fd, 100, &c, 1) == 1 && c == 'h');
+    assert(fs_close(fd) == 0);
+    assert(fs_close(fd) == -1);
+    assert(fs_pread(fd, 0, &c, 1) == -1);
+    printf("✓ Removed file stayed alive until last close\n");
+}
+
+void test_sparse_files() {
+    printf("\n=== Testing Sparse Files ===\n");
+    
+    assert(create_file("/test/sparse.bin") == 0);
+    
+    // A 1-byte write at 10 GB must not materialize the hole before it.
+    const size_t far = (size_t)10 << 30;
+    assert(write_file("/test/sparse.bin", far, "x", 1) == 1);
+    
+    file_info_t info;
+    assert(get_file_info("/test/sparse.bin", &info) == 0);
+    assert(info.size == far + 1);
+    assert(info.allocated <= FS_CHUNK_SIZE);
+    printf("✓ Logical size %zu bytes, allocated %zu bytes\n", info.size, info.allocated);
+    
+    // The hole reads back as zeros and the written byte is intact.
+    char buf[16];
+    memset(buf, 0xff, sizeof(buf));
+    assert(read_file("/test/sparse.bin", far / 2, buf, sizeof(buf)) == (ssize_t)sizeof(buf));
+    for (size_t i = 0; i < sizeof(buf); i++) assert(buf[i] == 0);
+    assert(read_file("/test/sparse.bin", far, buf, sizeof(buf)) == 1 && buf[0] == 'x');
+    printf("✓ Holes read back as zeros\n");
+    
+    assert(rm_file("/test/sparse.bin") == 0);
+}
+
+void test_read_views() {
+    printf("\n=== Testing Zero-Copy Read Views ===\n");
+    
+    assert(create_file("/test/view.bin") == 0);
+    char block[3 * FS_CHUNK_SIZE];
+    memset(block, 'a', sizeof(block));
+    assert(write_file("/test/view.bin", 0, block, sizeof(block)) == (ssize_t)sizeof(block));
+    
+    // Borrow a range spanning a chunk boundary; it comes back as several segments.
+    fs_view_t view;
+    size_t off = FS_CHUNK_SIZE - 10;
+    assert(read_file_view("/test/view.bin", off, 100, &view) == 100);
+    assert(view.nsegs >= 2);
+    size_t total = 0;
+    for (size_t i = 0; i < view.nsegs; i++) total += view.segs[i].len;
+    assert(total == 100);
+    printf("✓ View covers %zu bytes in %zu segments\n", view.len, view.nsegs);
+    
+    // Writers must not change bytes a view still points at.
+    memset(block, 'b', 200);
+    assert(write_file("/test/view.bin", off, block, 200) == 200);
+    assert(view.segs[0].data[0] == 'a');
+    char c;
+    assert(read_file("/test/view.bin", off, &c, 1) == 1 && c == 'b');
+    
+    // Views also outlive removal of the file.
+    assert(rm_file("/test/view.bin") == 0);
+    assert(view.segs[view.nsegs - 1].data[0] == 'a');
+    fs_view_release(&view);
+    printf("✓ Viewed bytes stayed stable across writes and removal\n");
+}
+
+void test_vectored_io() {
+    printf("\n=== Testing Vectored I/O ===\n");
+    
+    assert(create_file("/test/records.log") == 0);
+    
+    // Write a record built from three separate buffers in one call.
+    struct iovec out[3] = {
+        { "hdr:", 4 },
+        { "payload", 7 },
+        { ";\n", 2 },
+    };
+    assert(fs_writev("/test/records.log", 0, out, 3) == 13);
+    
+    // Read it back split across two buffers.
+    char a[6] = {0}, b[16] = {0};
+    struct iovec in[2] = { { a, 5 }, { b, sizeof(b) - 1 } };
+    assert(fs_readv("/test/records.log", 0, in, 2) == 13);
+    assert(strcmp(a, "hdr:p") == 0);
+    assert(strcmp(b, "ayload;\n") == 0);
+    printf("✓ Scatter-gather write and read round-trip\n");
+    
+    assert(fs_writev("/nonexistent.log", 0, out, 3) == -1);
+    assert(rm_file("/test/records.log") == 0);
+}
+
+void test_truncate_fallocate() {
+    printf("\n=== Testing Truncate and Fallocate ===\n");
+    
+    assert(create_file("/test/rotate.log") == 0);
+    
+    // Preallocate without changing the size.
+    const size_t big = 8 * FS_CHUNK_SIZE;
+    assert(fs_fallocate("/test/rotate.log", 0, big) == 0);
+    file_info_t info;
+    assert(get_file_info("/test/rotate.log", &info) == 0);
+    assert(info.size == 0 && info.allocated >= big);
+    printf("✓ Preallocated %zu bytes, size still %zu\n", info.allocated, info.size);
+    
+    // Fill it, then shrink it in place: memory above the new size is released.
+    char block[FS_CHUNK_SIZE];
+    memset(block, 'L', sizeof(block));
+    for (size_t off = 0; off < big; off += sizeof(block)) {
+        assert(write_file("/test/rotate.log", off, block, sizeof(block)) == (ssize_t)sizeof(block));
+    }
+    assert(fs_truncate("/test/rotate.log", 10) == 0);
+    assert(get_file_info("/test/rotate.log", &info) == 0);
+    assert(info.size == 10 && info.allocated < FS_CHUNK_SIZE);
+    printf("✓ Truncated to %zu bytes, allocated now %zu\n", info.size, info.allocated);
+    
+    // Extending again reads back zeros past the old end.
+    assert(fs_truncate("/test/rotate.log", 100) == 0);
+    char buf[100];
+    assert(read_file("/test/rotate.log", 0, buf, sizeof(buf)) == 100);
+    assert(buf[9] == 'L' && buf[10] == 0 && buf[99] == 0);
+    printf("✓ Extended file reads zeros past the old end\n");
+    
+    assert(rm_file("/test/rotate.log") == 0);
+}
+
+// Worker for test_append(): opens each shared log with FS_O_CREAT as the other workers do, and
+// appends one byte to it.
+static void *append_worker(void *arg) {
+    (void)arg;
+    char path[32];
+    for (int i = 0; i < 500; i++) {
+        snprintf(path, sizeof(path), "/test/race%d.log", i);
+        int fd = fs_open(path, FS_O_CREAT | FS_O_APPEND);
+        assert(fd >= 0);
+        assert(fs_append(fd, "x", 1, NULL) == 1);
+        assert(fs_close(fd) == 0);
+    }
+    return NULL;
+}
+
+void test_append() {
+    printf("\n=== Testing Append ===\n");
+    
+    // Two writers appending through their own handles never overwrite each other.
+    int a = fs_open("/test/app.log", FS_O_CREAT);
+    int b = fs_open("/test/app.log", FS_O_APPEND);
+    assert(a >= 0 && b >= 0);
+    
+    size_t off_a, off_b;
+    assert(fs_append(a, "first;", 6, &off_a) == 6);
+    assert(fs_pwrite(b, 0, "second;", 7) == 7); // Offset is ignored with FS_O_APPEND.
+    assert(fs_append(a, "third;", 6, &off_b) == 6);
+    assert(off_a == 0 && off_b == 13);
+    
+    char buf[32] = {0};
+    assert(read_file("/test/app.log", 0, buf, sizeof(buf) - 1) == 19);
+    assert(strcmp(buf, "first;second;third;") == 0);
+    printf("✓ Appends landed back to back: %s\n", buf);
+    
+    assert(fs_close(a) == 0);
+    assert(fs_close(b) == 0);
+    assert(rm_file("/test/app.log") == 0);
+    
+    // Threads racing to create the same log all get a handle to it.
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++) assert(pthread_create(&threads[i], NULL, append_worker, NULL) == 0);
+    for (int i = 0; i < 8; i++) pthread_join(threads[i], NULL);
+    char path[32];
+    for (int i = 0; i < 500; i++) {
+        file_info_t info;
+        snprintf(path, sizeof(path), "/test/race%d.log", i);
+        assert(get_file_info(path, &info) == 0 && info.size == 8);
+        assert(rm_file(path) == 0);
+    }
+    printf("✓ 8 threads racing to create 500 logs all opened them\n");
+}
+
 void cleanup_test_data() {
     printf("\n=== Cleaning Up Test Data ===\n");
     
@@ -288,6 +750,979 @@ void cleanup_test_data() {
     printf("✓ Cleanup completed\n");
 }
 
+void test_inline_files() {
+    printf("\n=== Testing Inline Files ===\n");
+    
+    // A tiny file keeps its bytes in the node and allocates no chunk storage.
+    assert(create_file("/test/tiny.txt") == 0);
+    assert(write_file("/test/tiny.txt", 0, "hello", 5) == 5);
+    file_info_t info;
+    assert(get_file_info("/test/tiny.txt", &info) == 0);
+    assert(info.size == 5 && info.allocated == 0);
+    printf("✓ %zu-byte file stored inline\n", info.size);
+    
+    // Growing past FS_INLINE_MAX moves the contents into a chunk without losing them.
+    char big[FS_INLINE_MAX * 2];
+    memset(big, 'x', sizeof(big));
+    assert(write_file("/test/tiny.txt", 5, big, sizeof(big)) == (int)sizeof(big));
+    assert(get_file_info("/test/tiny.txt", &info) == 0);
+    assert(info.allocated > 0);
+    char buf[8] = {0};
+    assert(read_file("/test/tiny.txt", 0, buf, 6) == 6);
+    assert(strcmp(buf, "hellox") == 0);
+    
+    // Truncating back down returns it to inline storage.
+    assert(fs_truncate("/test/tiny.txt", 4) == 0);
+    assert(get_file_info("/test/tiny.txt", &info) == 0);
+    assert(info.size == 4 && info.allocated == 0);
+    memset(buf, 0, sizeof(buf));
+    assert(read_file("/test/tiny.txt", 0, buf, sizeof(buf)) == 4);
+    assert(strcmp(buf, "hell") == 0);
+    printf("✓ Moved out of and back into the node intact\n");
+    
+    assert(rm_file("/test/tiny.txt") == 0);
+}
+
+// Worker for test_concurrent_access(): creates, checks and removes its own files while reading a shared one.
+static void *concurrent_worker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    char path[64], buf[16];
+    for (int i = 0; i < 200; i++) {
+        snprintf(path, sizeof(path), "/test/mt/t%d_%d", id, i);
+        assert(create_file(path) == 0);
+        assert(write_file(path, 0, path, strlen(path)) == (ssize_t)strlen(path));
+        assert(read_file("/test/mt/shared", 0, buf, 6) == 6 && memcmp(buf, "shared", 6) == 0);
+        assert(rm_file(path) == 0);
+    }
+    return NULL;
+}
+
+void test_concurrent_access() {
+    printf("\n=== Testing Concurrent Access ===\n");
+    
+    assert(mkdir_p("/test/mt") == 0);
+    assert(create_file("/test/mt/shared") == 0);
+    assert(write_file("/test/mt/shared", 0, "shared", 6) == 6);
+    
+    // Threads mutate the same directory and read the same file at once.
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&threads[i], NULL, concurrent_worker, (void *)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], NULL);
+    
+    file_info_t info;
+    assert(get_file_info("/test/mt", &info) == 0);
+    assert(info.child_count == 1);
+    printf("✓ 4 threads created and removed 800 files, directory consistent\n");
+    
+    assert(rm_file("/test/mt/shared") == 0);
+    assert(rmdir_empty("/test/mt") == 0);
+}
+
+void test_instances() {
+    printf("\n=== Testing File System Instances ===\n");
+    
+    // Two instances hold separate trees under the same paths, independent of the default one.
+    fs_t *a = fs_new();
+    fs_t *b = fs_new();
+    assert(a && b);
+    assert(fsi_mkdir_p(a, "/tenant") == 0 && fsi_mkdir_p(b, "/tenant") == 0);
+    assert(fsi_create_file(a, "/tenant/data") == 0);
+    assert(fsi_create_file(b, "/tenant/data") == 0);
+    assert(fsi_write_file(a, "/tenant/data", 0, "alpha", 5) == 5);
+    assert(fsi_write_file(b, "/tenant/data", 0, "beta", 4) == 4);
+    
+    char buf[8] = {0};
+    assert(fsi_read_file(a, "/tenant/data", 0, buf, sizeof(buf)) == 5 && memcmp(buf, "alpha", 5) == 0);
+    assert(fsi_read_file(b, "/tenant/data", 0, buf, sizeof(buf)) == 4 && memcmp(buf, "beta", 4) == 0);
+    assert(read_file("/tenant/data", 0, buf, sizeof(buf)) == -1);
+    
+    // Working directories and handles are per instance too.
+    assert(fsi_cd(a, "/tenant") == 0);
+    assert(fsi_read_file(a, "data", 0, buf, 5) == 5);
+    assert(fsi_read_file(b, "data", 0, buf, 5) == -1);
+    int fd = fsi_open(a, "data", 0);
+    assert(fd >= 0 && fsi_close(b, fd) == -1);
+    assert(fsi_close(a, fd) == 0);
+    printf("✓ Instances keep separate trees, working directories and handles\n");
+    
+    fs_free(a);
+    fs_free(b);
+}
+
+// Worker for test_sessions(): resolves relative paths against its own session's directory.
+static void *session_worker(void *arg) {
+    fs_session_t *ss = arg;
+    char buf[8];
+    for (int i = 0; i < 200; i++) {
+        assert(fss_create_file(ss, "tmp") == 0);
+        assert(fss_read_file(ss, "id", 0, buf, sizeof(buf)) > 0);
+        assert(fss_rm_file(ss, "tmp") == 0);
+    }
+    return NULL;
+}
+
+void test_sessions() {
+    printf("\n=== Testing Sessions ===\n");
+    
+    fs_t *fs = fs_new();
+    assert(fs);
+    assert(fsi_mkdir_p(fs, "/home/a") == 0 && fsi_mkdir_p(fs, "/home/b") == 0);
+    assert(fsi_create_file(fs, "/home/a/id") == 0 && fsi_write_file(fs, "/home/a/id", 0, "a", 1) == 1);
+    assert(fsi_create_file(fs, "/home/b/id") == 0 && fsi_write_file(fs, "/home/b/id", 0, "b", 1) == 1);
+    
+    // Each session keeps its own working directory.
+    fs_session_t *sa = fs_session_new(fs);
+    fs_session_t *sb = fs_session_new(fs);
+    assert(sa && sb);
+    assert(fss_cd(sa, "/home/a") == 0);
+    assert(fss_cd(sb, "/home/b") == 0);
+    char buf[4] = {0};
+    assert(fss_read_file(sa, "id", 0, buf, 1) == 1 && buf[0] == 'a');
+    assert(fss_read_file(sb, "id", 0, buf, 1) == 1 && buf[0] == 'b');
+    assert(fsi_read_file(fs, "id", 0, buf, 1) == -1); // The instance's own session is still at "/".
+    printf("✓ Relative paths resolve per session\n");
+    
+    // A directory that is some session's working directory cannot be removed.
+    assert(fsi_rm_file(fs, "/home/b/id") == 0);
+    assert(fsi_rmdir_empty(fs, "/home/b") == -1);
+    assert(fss_cd(sb, "..") == 0);
+    assert(fsi_rmdir_empty(fs, "/home/b") == 0);
+    assert(fss_cd(sb, "a") == 0);
+    
+    // Both sessions work in the same directory from separate threads.
+    pthread_t t1, t2;
+    fs_session_t *sc = fs_session_new(fs);
+    assert(fss_cd(sc, "/home/a") == 0 && fss_mkdir_p(sc, "c") == 0 && fss_cd(sc, "c") == 0);
+    assert(fss_create_file(sc, "id") == 0 && fss_write_file(sc, "id", 0, "c", 1) == 1);
+    assert(pthread_create(&t1, NULL, session_worker, sa) == 0);
+    assert(pthread_create(&t2, NULL, session_worker, sc) == 0);
+    pthread_join(t1, NULL);
+    pthread_join(t2, NULL);
+    printf("✓ Sessions used concurrently from separate threads\n");
+    
+    fs_session_free(sa);
+    fs_session_free(sb);
+    fs_session_free(sc);
+    fs_free(fs);
+}
+
+// Worker for test_lockfree_lookups(): looks up paths that another thread keeps removing and recreating.
+static void *lookup_worker(void *arg) {
+    fs_t *fs = arg;
+    file_info_t info;
+    for (int i = 0; i < 20000; i++) {
+        if (fsi_get_file_info(fs, i % 2 ? "/churn/d/f" : "/churn/d/../d/./f", &info) == 0) {
+            assert(info.size == 0 || info.size == 4);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "/churn/big/e%d", i % 300);
+        fsi_get_file_info(fs, name, &info);
+    }
+    return NULL;
+}
+
+void test_lockfree_lookups() {
+    printf("\n=== Testing Lock-Free Lookups ===\n");
+    
+    fs_t *fs = fs_new();
+    assert(fs && fsi_mkdir_p(fs, "/churn/big") == 0);
+    
+    // Readers walk into nodes while they are removed and freed, and probe a directory whose
+    // hash table is being replaced as it grows; removed nodes must outlive the walks inside them.
+    pthread_t readers[3];
+    for (int i = 0; i < 3; i++) assert(pthread_create(&readers[i], NULL, lookup_worker, fs) == 0);
+    char name[32];
+    for (int i = 0; i < 300; i++) {
+        assert(fsi_mkdir_p(fs, "/churn/d") == 0);
+        assert(fsi_create_file(fs, "/churn/d/f") == 0);
+        assert(fsi_write_file(fs, "/churn/d/f", 0, "data", 4) == 4);
+        assert(fsi_rm_file(fs, "/churn/d/f") == 0);
+        assert(fsi_rmdir_empty(fs, "/churn/d") == 0);
+        snprintf(name, sizeof(name), "/churn/big/e%d", i);
+        assert(fsi_create_file(fs, name) == 0);
+    }
+    for (int i = 0; i < 3; i++) pthread_join(readers[i], NULL);
+    
+    file_info_t info;
+    assert(fsi_get_file_info(fs, "/churn/d", &info) == -1);
+    assert(fsi_get_file_info(fs, "/churn/big", &info) == 0 && info.child_count == 300);
+    printf("✓ Lookups raced 300 remove/recreate cycles and directory growth safely\n");
+    
+    fs_free(fs);
+}
+
+// Run fsi_search() with stdout sent to a temporary file; returns what it printed (caller frees).
+static char *capture_search(fs_t *fs, const char *term, int *matches) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    FILE *tmp = tmpfile();
+    assert(saved >= 0 && tmp);
+    dup2(fileno(tmp), STDOUT_FILENO);
+    *matches = fsi_search(fs, term);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    
+    long len = ftell(tmp);
+    char *out = calloc(1, (size_t)len + 1);
+    rewind(tmp);
+    assert(out && fread(out, 1, (size_t)len, tmp) == (size_t)len);
+    fclose(tmp);
+    return out;
+}
+
+void test_parallel_search() {
+    printf("\n=== Testing Parallel Search ===\n");
+    
+    fs_t *fs = fs_new();
+    assert(fs);
+    char path[64];
+    for (int i = 0; i < 40; i++) {
+        snprintf(path, sizeof(path), "/p%d/q%d/r%d", i % 5, i % 7, i);
+        assert(fsi_mkdir_p(fs, path) == 0);
+        snprintf(path, sizeof(path), "/p%d/q%d/r%d/file%d", i % 5, i % 7, i, i);
+        assert(fsi_create_file(fs, path) == 0);
+    }
+    
+    // Any thread count prints the same matches in the same order as the serial search.
+    int serial_matches, matches;
+    char *serial = capture_search(fs, "1", &serial_matches);
+    assert(serial_matches > 0);
+    for (int t = 2; t <= 8; t *= 2) {
+        assert(fsi_set_search_threads(fs, t) == 0);
+        char *out = capture_search(fs, "1", &matches);
+        assert(matches == serial_matches && strcmp(out, serial) == 0);
+        free(out);
+    }
+    free(serial);
+    assert(fsi_set_search_threads(fs, 0) == -1);
+    assert(fsi_cd(fs, "/p1") == 0);
+    free(capture_search(fs, "q", &matches));
+    assert(matches == 7);
+    printf("✓ %d matches, identical to the serial search with 2, 4 and 8 threads\n", serial_matches);
+    
+    fs_free(fs);
+}
+
+// Callback for test_search_callback(): records matching paths, stopping after `limit` of them.
+typedef struct search_results {
+    char paths[8][32];
+    int count, limit;
+    size_t deepest;
+} search_results_t;
+
+static int collect_match(const node_t *node, const char *path, size_t len, void *arg) {
+    search_results_t *r = arg;
+    (void)node;
+    if (len > r->deepest) r->deepest = len;
+    if (r->count < 8 && len < sizeof(r->paths[0])) memcpy(r->paths[r->count], path, len + 1);
+    return ++r->count == r->limit;
+}
+
+void test_search_callback() {
+    printf("\n=== Testing Search Callback ===\n");
+    
+    fs_t *fs = fs_new();
+    assert(fs);
+    assert(fsi_mkdir_p(fs, "/docs/notes") == 0);
+    assert(fsi_create_file(fs, "/docs/note1") == 0);
+    assert(fsi_create_file(fs, "/docs/notes/note2") == 0);
+    
+    // Matches arrive in tree order, without printing; directories have no trailing '/'.
+    search_results_t r = { .limit = 0 };
+    assert(fsi_search_cb(fs, "note", collect_match, &r) == 3);
+    assert(strcmp(r.paths[0], "/docs/notes") == 0);
+    assert(strcmp(r.paths[1], "/docs/notes/note2") == 0);
+    assert(strcmp(r.paths[2], "/docs/note1") == 0);
+    
+    // Returning nonzero stops the search, whichever way it runs.
+    memset(&r, 0, sizeof(r));
+    r.limit = 2;
+    assert(fsi_search_cb(fs, "note", collect_match, &r) == 2);
+    assert(fsi_set_search_threads(fs, 4) == 0);
+    memset(&r, 0, sizeof(r));
+    r.limit = 1;
+    assert(fsi_search_cb(fs, "no", collect_match, &r) == 1 && strcmp(r.paths[0], "/docs/notes") == 0);
+    assert(fsi_set_search_threads(fs, 1) == 0);
+    printf("✓ Callback receives matches in tree order and can stop early\n");
+    
+    // A tree far deeper than any fixed-size path buffer: full paths, no recursion.
+    static char deep[2 * 3000 + 16];
+    char *p = deep;
+    for (int i = 0; i < 3000; i++) p += sprintf(p, "/d");
+    strcpy(p, "/bottom");
+    assert(fsi_mkdir_p(fs, deep) == 0);
+    memset(&r, 0, sizeof(r));
+    assert(fsi_search_cb(fs, "bottom", collect_match, &r) == 1);
+    assert(r.deepest == strlen(deep));
+    printf("✓ Searched a 3000-level tree with full paths\n");
+    
+    fs_free(fs);
+}
+
+// Callback for test_name_index(): appends each path (and a newline) to a string, keeping only
+// paths that contain `filter` if it is set.
+typedef struct path_log {
+    char text[4096];
+    const char *filter;
+} path_log_t;
+
+static int log_match(const node_t *node, const char *path, size_t len, void *arg) {
+    path_log_t *log = arg;
+    (void)node;
+    if (log->filter && !strstr(strrchr(path, '/') + 1, log->filter)) return 0;
+    size_t used = strlen(log->text);
+    assert(used + len + 2 <= sizeof(log->text));
+    memcpy(log->text + used, path, len);
+    strcpy(log->text + used + len, "\n");
+    return 0;
+}
+
+void test_name_index() {
+    printf("\n=== Testing Name Index ===\n");
+    
+    fs_t *fs = fs_new();
+    assert(fs);
+    char path[64];
+    for (int i = 0; i < 60; i++) {
+        snprintf(path, sizeof(path), "/idx/g%d/profile%d", i % 4, i);
+        assert(fsi_mkdir_p(fs, path) == 0);
+        snprintf(path, sizeof(path), "/idx/g%d/profile%d/file%d.txt", i % 4, i, i);
+        assert(fsi_create_file(fs, path) == 0);
+    }
+    
+    // An indexed search ("ile" has a trigram) reports exactly what walking the tree finds, in the
+    // same order: a two-byte term is never indexed, so filter its matches instead.
+    path_log_t indexed = { .filter = NULL }, walked = { .filter = "ile" };
+    int n = fsi_search_cb(fs, "ile", log_match, &indexed);
+    assert(n == 120);
+    assert(fsi_search_cb(fs, "il", log_match, &walked) >= n);
+    assert(strcmp(indexed.text, walked.text) == 0);
+    
+    // With the index turned off the same term walks the tree, serially or in parallel.
+    assert(fsi_set_search_index(fs, 0) == 0);
+    for (int t = 1; t <= 4; t *= 4) {
+        assert(fsi_set_search_threads(fs, t) == 0);
+        memset(&walked, 0, sizeof(walked));
+        assert(fsi_search_cb(fs, "ile", log_match, &walked) == n);
+        assert(strcmp(indexed.text, walked.text) == 0);
+    }
+    assert(fsi_set_search_threads(fs, 1) == 0 && fsi_set_search_index(fs, 1) == 0);
+    
+    // Candidates are verified: "abcXbcd" has every trigram of "abcd" but does not contain it.
+    assert(fsi_create_file(fs, "/idx/abcXbcd") == 0);
+    path_log_t log = { .filter = NULL };
+    assert(fsi_search_cb(fs, "abcd", log_match, &log) == 0);
+    assert(fsi_search_cb(fs, "bcXb", log_match, &log) == 1);
+    
+    // Removals leave the index, and only the working directory's subtree is searched.
+    assert(fsi_rm_file(fs, "/idx/g1/profile1/file1.txt") == 0);
+    assert(fsi_rmdir_empty(fs, "/idx/g1/profile1") == 0);
+    memset(&log, 0, sizeof(log));
+    assert(fsi_search_cb(fs, "file1.", log_match, &log) == 0);
+    assert(fsi_cd(fs, "/idx/g2") == 0);
+    memset(&log, 0, sizeof(log));
+    assert(fsi_search_cb(fs, "profile", log_match, &log) == 15);
+    assert(strncmp(log.text, "/idx/g2/profile2\n", 17) == 0);
+    printf("✓ Indexed searches match tree walks, verify candidates and follow removals\n");
+    
+    fs_free(fs);
+}
+
+void test_images() {
+    printf("\n=== Testing Images ===\n");
+    
+    char image[64], broken[64];
+    snprintf(image, sizeof(image), "/tmp/fs_test_%d.img", (int)getpid());
+    snprintf(broken, sizeof(broken), "/tmp/fs_test_%d.bad", (int)getpid());
+    
+    // A tree with every kind of file: inline, chunked, sparse, and with attributes.
+    fs_t *fs = fs_new();
+    assert(fs);
+    static char big[200000], back[200000];
+    for (size_t i = 0; i < sizeof(big); i++) big[i] = (char)(i * 7);
+    assert(fsi_mkdir_p(fs, "/img/docs/empty") == 0);
+    assert(fsi_create_file(fs, "/img/docs/hello.txt") == 0);
+    assert(fsi_write_file(fs, "/img/docs/hello.txt", 0, "hello", 5) == 5);
+    assert(fsi_create_file(fs, "/img/big") == 0);
+    assert(fsi_write_file(fs, "/img/big", 0, big, sizeof(big)) == (ssize_t)sizeof(big));
+    assert(fsi_create_file(fs, "/img/sparse") == 0);
+    assert(fsi_write_file(fs, "/img/sparse", 3 * FS_CHUNK_SIZE, "tail", 4) == 4);
+    assert(fsi_set_file_attributes(fs, "/img/docs/hello.txt", ATTR_HIDDEN | ATTR_READONLY) == 0);
+    file_info_t hello, sparse, docs;
+    assert(fsi_get_file_info(fs, "/img/docs/hello.txt", &hello) == 0);
+    assert(fsi_get_file_info(fs, "/img/sparse", &sparse) == 0);
+    assert(fsi_get_file_info(fs, "/img/docs", &docs) == 0);
+    assert(fsi_save(fs, image) == 0);
+    fs_free(fs);
+    
+    // Loading replaces whatever was there, and brings back names, metadata and contents.
+    fs = fs_new();
+    assert(fs);
+    assert(fsi_create_file(fs, "/old") == 0);
+    assert(fsi_load(fs, image) == 0);
+    file_info_t info;
+    assert(fsi_get_file_info(fs, "/old", &info) == -1);
+    assert(fsi_get_file_info(fs, "/img/docs/hello.txt", &info) == 0);
+    assert(info.size == 5 && info.attributes == hello.attributes);
+    assert(info.created == hello.created && info.modified == hello.modified);
+    assert(fsi_get_file_info(fs, "/img/docs", &info) == 0 && info.child_count == docs.child_count);
+    assert(fsi_get_file_info(fs, "/img/docs/empty", &info) == 0 && info.type == N_DIR && info.child_count == 0);
+    char buf[8] = {0};
+    assert(fsi_read_file(fs, "/img/docs/hello.txt", 0, buf, sizeof(buf)) == 5 && strcmp(buf, "hello") == 0);
+    assert(fsi_read_file(fs, "/img/big", 0, back, sizeof(back)) == (ssize_t)sizeof(back));
+    assert(memcmp(big, back, sizeof(big)) == 0);
+    assert(fsi_get_file_info(fs, "/img/sparse", &info) == 0);
+    assert(info.size == sparse.size && info.allocated == sparse.allocated);
+    assert(fsi_read_file(fs, "/img/sparse", 3 * FS_CHUNK_SIZE, buf, 4) == 4 && memcmp(buf, "tail", 4) == 0);
+    
+    // The loaded tree is fully usable: indexed searches find its names, and new nodes can join.
+    path_log_t log = { .filter = NULL };
+    assert(fsi_search_cb(fs, "hello", log_match, &log) == 1 && strcmp(log.text, "/img/docs/hello.txt\n") == 0);
+    assert(fsi_create_file(fs, "/img/docs/hello2.txt") == 0);
+    assert(fsi_search_cb(fs, "hello", log_match, &log) == 2);
+    printf("✓ Saved and reloaded names, metadata, attributes and file contents\n");
+    
+    // A truncated image, an image of another version and a missing file are all rejected,
+    // leaving the tree as it was.
+    FILE *in = fopen(image, "rb"), *out = fopen(broken, "wb");
+    assert(in && out);
+    fseek(in, 0, SEEK_END);
+    size_t n = (size_t)ftell(in);
+    rewind(in);
+    char *copy = malloc(n);
+    assert(copy && fread(copy, 1, n, in) == n);
+    fwrite(copy, 1, n - 8, out);
+    fclose(in);
+    fclose(out);
+    assert(fsi_load(fs, broken) == -1);
+    copy[8]++; // Version field.
+    out = fopen(broken, "wb");
+    assert(out);
+    fwrite(copy, 1, n, out);
+    fclose(out);
+    assert(fsi_load(fs, broken) == -1);
+    free(copy);
+    assert(fsi_load(fs, "/nonexistent/fs.img") == -1);
+    assert(fsi_get_file_info(fs, "/img/docs/hello2.txt", &info) == 0);
+    printf("✓ Rejected damaged images without touching the tree\n");
+    
+    remove(image);
+    remove(broken);
+    fs_free(fs);
+}
+
+void test_mapped_images() {
+    printf("\n=== Testing Mapped Images ===\n");
+    
+    char image[64], copy_path[64];
+    snprintf(image, sizeof(image), "/tmp/fs_test_%d.map", (int)getpid());
+    snprintf(copy_path, sizeof(copy_path), "/tmp/fs_test_%d.map2", (int)getpid());
+    
+    fs_t *fs = fs_new();
+    assert(fs);
+    static char big[150000], back[150000];
+    for (size_t i = 0; i < sizeof(big); i++) big[i] = (char)(i * 13);
+    assert(fsi_mkdir_p(fs, "/m/docs/sub") == 0);
+    assert(fsi_mkdir_p(fs, "/m/other") == 0);
+    assert(fsi_create_file(fs, "/m/docs/big") == 0);
+    assert(fsi_write_file(fs, "/m/docs/big", 0, big, sizeof(big)) == (ssize_t)sizeof(big));
+    assert(fsi_create_file(fs, "/m/docs/sub/note") == 0);
+    assert(fsi_write_file(fs, "/m/docs/sub/note", 0, "mapped", 6) == 6);
+    assert(fsi_create_file(fs, "/m/other/zzbad") == 0);
+    assert(fsi_save(fs, image) == 0);
+    fs_free(fs);
+    
+    // Files read straight from the image, including through views, until they are changed.
+    fs = fs_new();
+    assert(fs);
+    assert(fsi_map(fs, image) == 0);
+    char buf[8] = {0};
+    assert(fsi_read_file(fs, "/m/docs/sub/note", 0, buf, sizeof(buf)) == 6 && strcmp(buf, "mapped") == 0);
+    assert(fsi_read_file(fs, "/m/docs/big", 0, back, sizeof(back)) == (ssize_t)sizeof(back));
+    assert(memcmp(big, back, sizeof(big)) == 0);
+    file_info_t info;
+    assert(fsi_get_file_info(fs, "/m/docs/big", &info) == 0 && info.size == sizeof(big) && info.allocated == 0);
+    fs_view_t view;
+    assert(fsi_read_file_view(fs, "/m/docs/big", FS_CHUNK_SIZE - 2, 4, &view) == 4);
+    assert(view.nsegs == 2 && view.segs[0].data[0] == (uint8_t)big[FS_CHUNK_SIZE - 2] && view.segs[1].data[1] == (uint8_t)big[FS_CHUNK_SIZE + 1]);
+    fs_view_release(&view);
+    assert(fsi_write_file(fs, "/m/docs/big", 1, "X", 1) == 1);
+    assert(fsi_get_file_info(fs, "/m/docs/big", &info) == 0 && info.allocated >= sizeof(big));
+    assert(fsi_read_file(fs, "/m/docs/big", 0, back, 3) == 3 && back[0] == big[0] && back[1] == 'X' && back[2] == big[2]);
+    
+    // Materialized directories behave like any other: a lazy one is never empty, and the tree
+    // can change and be saved again.
+    assert(fsi_rmdir_empty(fs, "/m/docs/sub") == -1);
+    assert(fsi_create_file(fs, "/m/docs/sub/new") == 0);
+    assert(fsi_get_file_info(fs, "/m/docs/sub", &info) == 0 && info.child_count == 2);
+    path_log_t log = { .filter = NULL };
+    assert(fsi_search_cb(fs, "note", log_match, &log) == 1 && strcmp(log.text, "/m/docs/sub/note\n") == 0);
+    assert(fsi_save(fs, copy_path) == 0);
+    fs_t *again = fs_new();
+    assert(again && fsi_map(again, copy_path) == 0);
+    assert(fsi_read_file(again, "/m/docs/big", 0, back, 3) == 3 && back[1] == 'X');
+    assert(fsi_get_file_info(again, "/m/docs/sub/new", &info) == 0);
+    assert(fsi_get_file_info(again, "/m/other/zzbad", &info) == 0);
+    fs_free(again);
+    printf("✓ Mapped image reads in place and materializes directories on use\n");
+    
+    // Saving copies the records of directories that were never materialized straight from the
+    // mapping, rather than building their nodes first.
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+    char wide_path[64], path[64];
+    snprintf(wide_path, sizeof(wide_path), "/tmp/fs_test_%d.map3", (int)getpid());
+    const int many = 40000;
+    fs_t *wide = fs_new();
+    assert(wide && fsi_mkdir_p(wide, "/w") == 0);
+    for (int i = 0; i < many; i++) {
+        snprintf(path, sizeof(path), "/w/f%d", i);
+        assert(fsi_create_file(wide, path) == 0 && fsi_write_file(wide, path, 0, &i, sizeof(i)) == sizeof(i));
+    }
+    assert(fsi_save(wide, copy_path) == 0);
+    fs_free(wide);
+    wide = fs_new();
+    assert(wide && fsi_map(wide, copy_path) == 0);
+    size_t before = vm_size();
+    assert(fsi_save(wide, wide_path) == 0);
+    assert(vm_size() - before < many * sizeof(file_node_t)); // Less than the nodes alone would take.
+    assert(fsi_get_file_info(wide, "/w", &info) == 0 && info.child_count == (size_t)many);
+    fs_free(wide);
+    wide = fs_new();
+    assert(wide && fsi_load(wide, wide_path) == 0);
+    for (int i = 0; i < many; i += 97) {
+        int got = -1;
+        snprintf(path, sizeof(path), "/w/f%d", i);
+        assert(fsi_read_file(wide, path, 0, &got, sizeof(got)) == sizeof(got) && got == i);
+    }
+    fs_free(wide);
+    remove(wide_path);
+    printf("✓ Saving a mapped tree leaves unmaterialized directories as they are\n");
+#endif
+    
+    // Damage below /m/other is only found there: load refuses the image, map fails just that part.
+    FILE *in = fopen(image, "rb");
+    assert(in);
+    fseek(in, 0, SEEK_END);
+    size_t n = (size_t)ftell(in);
+    rewind(in);
+    char *bytes = malloc(n);
+    assert(bytes && fread(bytes, 1, n, in) == n);
+    fclose(in);
+    size_t at = 0;
+    while (at + 5 <= n && memcmp(bytes + at, "zzbad", 5) != 0) at++;
+    assert(at + 5 <= n);
+    bytes[at] = '/';
+    FILE *out = fopen(copy_path, "wb");
+    assert(out);
+    fwrite(bytes, 1, n, out);
+    fclose(out);
+    free(bytes);
+    assert(fsi_load(fs, copy_path) == -1);
+    assert(fsi_map(fs, copy_path) == 0);
+    assert(fsi_read_file(fs, "/m/docs/sub/note", 0, buf, sizeof(buf)) == 6);
+    assert(fsi_get_file_info(fs, "/m/other", &info) == -1);
+    assert(fsi_search_cb(fs, "note", log_match, &log) == -1);
+    printf("✓ Damage in a mapped image fails only the operations that reach it\n");
+    
+    fs_free(fs);
+    remove(image);
+    remove(copy_path);
+}
+
+// Worker for test_journal(): logs files of its own from a separate thread.
+static void *journal_worker(void *arg) {
+    fs_session_t *ss = arg;
+    char path[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(path, sizeof(path), "f%d", i);
+        assert(fss_create_file(ss, path) == 0);
+        assert(fss_write_file(ss, path, 0, path, strlen(path)) == (ssize_t)strlen(path));
+        if (i % 3 == 0) assert(fss_rm_file(ss, path) == 0);
+    }
+    return NULL;
+}
+
+void test_journal() {
+    printf("\n=== Testing Journal ===\n");
+    
+    char journal[64], image[64];
+    snprintf(journal, sizeof(journal), "/tmp/fs_test_%d.jnl", (int)getpid());
+    snprintf(image, sizeof(image), "/tmp/fs_test_%d.ckpt", (int)getpid());
+    remove(journal);
+    
+    // Every kind of change is logged and redone on an empty tree.
+    fs_t *fs = fs_new();
+    assert(fs);
+    assert(fsi_journal_open(fs, journal, 3, 0) == -1);
+    assert(fsi_journal_open(fs, journal, FS_SYNC_ALWAYS, 0) == 0);
+    assert(fsi_journal_open(fs, journal, FS_SYNC_ALWAYS, 0) == -1);
+    assert(fsi_mkdir_p(fs, "/j/a/b") == 0 && fsi_mkdir_p(fs, "/j/gone") == 0);
+    assert(fsi_create_file(fs, "/j/a/f") == 0);
+    assert(fsi_write_file(fs, "/j/a/f", 0, "hello world", 11) == 11);
+    struct iovec iov[2] = { { "AB", 2 }, { "CD", 2 } };
+    assert(fsi_writev(fs, "/j/a/f", 6, iov, 2) == 4);
+    int fd = fsi_open(fs, "/j/a/log", FS_O_CREAT | FS_O_APPEND);
+    assert(fd >= 0);
+    assert(fsi_pwrite(fs, fd, 99, "one,", 4) == 4 && fsi_append(fs, fd, "two", 3, NULL) == 3);
+    assert(fsi_close(fs, fd) == 0);
+    assert(fsi_create_file(fs, "/j/a/tmp") == 0 && fsi_rm_file(fs, "/j/a/tmp") == 0);
+    assert(fsi_rmdir_empty(fs, "/j/gone") == 0);
+    assert(fsi_truncate(fs, "/j/a/f", 9) == 0);
+    assert(fsi_fallocate(fs, "/j/a/f", 0, 1000) == 0);
+    assert(fsi_set_file_attributes(fs, "/j/a/b", ATTR_HIDDEN | ATTR_READONLY) == 0);
+    assert(fsi_touch_file(fs, "/j/a/log") == 0);
+    assert(fsi_write_file(fs, "/j/missing", 0, "x", 1) == -1); // Failed changes are not logged.
+    assert(fsi_journal_sync(fs) == 0);
+    assert(fsi_journal_close(fs) == 0 && fsi_journal_close(fs) == -1);
+    
+    fs_t *again = fs_new();
+    assert(again);
+    assert(fsi_journal_replay(again, journal) == 17);
+    char buf[16] = {0};
+    file_info_t info;
+    assert(fsi_read_file(again, "/j/a/f", 0, buf, sizeof(buf)) == 9 && memcmp(buf, "hello ABC", 9) == 0);
+    assert(fsi_read_file(again, "/j/a/log", 0, buf, sizeof(buf)) == 7 && memcmp(buf, "one,two", 7) == 0);
+    assert(fsi_get_file_info(again, "/j/a/tmp", &info) == -1);
+    assert(fsi_get_file_info(again, "/j/gone", &info) == -1);
+    assert(fsi_get_file_info(again, "/j/a/b", &info) == 0 && info.attributes == (ATTR_HIDDEN | ATTR_READONLY | ATTR_ARCHIVE));
+    assert(fsi_get_file_info(again, "/j/a", &info) == 0 && info.child_count == 3);
+    fs_free(again);
+    printf("✓ Journal replays every kind of change\n");
+    
+    // Threads logging at once share writes; the log stays in the order changes were made.
+    assert(fsi_journal_open(fs, journal, FS_SYNC_INTERVAL, 5) == 0);
+    fs_session_t *ss[4];
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++) {
+        snprintf(buf, sizeof(buf), "/j/t%d", t);
+        assert(fsi_mkdir_p(fs, buf) == 0);
+        ss[t] = fs_session_new(fs);
+        assert(ss[t] && fss_cd(ss[t], buf) == 0);
+        assert(pthread_create(&threads[t], NULL, journal_worker, ss[t]) == 0);
+    }
+    for (int t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+        fs_session_free(ss[t]);
+    }
+    
+    // A checkpoint keeps only what came after it; the image and the rest of the log rebuild the tree.
+    assert(fsi_journal_checkpoint(fs, image) == 0);
+    assert(fsi_write_file(fs, "/j/t0/f1", 0, "after", 5) == 5);
+    assert(fsi_rm_file(fs, "/j/t3/f2") == 0);
+    assert(fsi_journal_close(fs) == 0);
+    again = fs_new();
+    assert(again && fsi_load(again, image) == 0);
+    assert(fsi_journal_replay(again, journal) == 2);
+    assert(fsi_read_file(again, "/j/t0/f1", 0, buf, sizeof(buf)) == 5 && memcmp(buf, "after", 5) == 0);
+    assert(fsi_get_file_info(again, "/j/t3/f2", &info) == -1);
+    assert(fsi_get_file_info(again, "/j/t2", &info) == 0 && info.child_count == 66);
+    assert(fsi_read_file(again, "/j/t1/f98", 0, buf, sizeof(buf)) == 3 && memcmp(buf, "f98", 3) == 0);
+    fs_free(again);
+    printf("✓ Concurrent changes and checkpoints replay to the same tree\n");
+    
+    // A record torn by a crash ends the log: replay stops before it and opening cuts it off.
+    FILE *out = fopen(journal, "ab");
+    assert(out);
+    fwrite("\x40\0\0\0\0\0\0\0torn", 1, 12, out);
+    fclose(out);
+    again = fs_new();
+    assert(again && fsi_journal_replay(again, journal) == 2);
+    assert(fsi_journal_open(again, journal, FS_SYNC_NEVER, 0) == 0);
+    assert(fsi_create_file(again, "/late") == 0);
+    assert(fsi_journal_close(again) == 0);
+    fs_free(again);
+    again = fs_new();
+    assert(again && fsi_journal_replay(again, journal) == 3);
+    assert(fsi_get_file_info(again, "/late", &info) == 0);
+    fs_free(again);
+    assert(fsi_journal_replay(fs, image) == -1); // Not a journal.
+    
+    // A garbage length ends the log too: the first record (after the 16-byte header) claims to
+    // be 1 byte long with a huge path.
+    out = fopen(journal, "r+b");
+    assert(out);
+    uint64_t bad_len = 1;
+    uint32_t bad_path_len = 0x7fffffff;
+    assert(fseek(out, 16, SEEK_SET) == 0 && fwrite(&bad_len, sizeof(bad_len), 1, out) == 1);
+    assert(fseek(out, 16 + 12, SEEK_SET) == 0 && fwrite(&bad_path_len, sizeof(bad_path_len), 1, out) == 1);
+    fclose(out);
+    again = fs_new();
+    assert(again && fsi_journal_replay(again, journal) == 0);
+    assert(fsi_journal_open(again, journal, FS_SYNC_NEVER, 0) == 0 && fsi_journal_close(again) == 0);
+    fs_free(again);
+    printf("✓ Torn records are dropped and logging resumes after them\n");
+    
+    fs_free(fs);
+    remove(journal);
+    remove(image);
+}
+
+// Size of a host file (for checking how much a delta image holds).
+static long file_bytes(const char *path) {
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fclose(f);
+    return n;
+}
+
+void test_incremental_backup() {
+    printf("\n=== Testing Incremental Backup ===\n");
+    
+    char delta0[64], delta1[64], delta2[64], image[64];
+    snprintf(delta0, sizeof(delta0), "/tmp/fs_test_%d.d0", (int)getpid());
+    snprintf(delta1, sizeof(delta1), "/tmp/fs_test_%d.d1", (int)getpid());
+    snprintf(delta2, sizeof(delta2), "/tmp/fs_test_%d.d2", (int)getpid());
+    snprintf(image, sizeof(image), "/tmp/fs_test_%d.bak", (int)getpid());
+    
+    // New nodes start out with the archive bit; the first export takes everything and clears it.
+    fs_t *fs = fs_new();
+    assert(fs);
+    static char big[200000], back[200000];
+    for (size_t i = 0; i < sizeof(big); i++) big[i] = (char)(i * 7);
+    assert(fsi_mkdir_p(fs, "/b/docs") == 0 && fsi_mkdir_p(fs, "/b/pics") == 0 && fsi_mkdir_p(fs, "/b/empty") == 0);
+    assert(fsi_create_file(fs, "/b/docs/a.txt") == 0 && fsi_write_file(fs, "/b/docs/a.txt", 0, "first", 5) == 5);
+    assert(fsi_create_file(fs, "/b/docs/old") == 0);
+    assert(fsi_create_file(fs, "/b/pics/p1") == 0 && fsi_write_file(fs, "/b/pics/p1", 0, big, sizeof(big)) == (ssize_t)sizeof(big));
+    file_info_t info;
+    assert(fsi_get_file_info(fs, "/b/pics/p1", &info) == 0 && (info.attributes & ATTR_ARCHIVE));
+    assert(fsi_export_delta(fs, delta0) == 0);
+    assert(fsi_get_file_info(fs, "/b/pics/p1", &info) == 0 && info.attributes == ATTR_NONE);
+    assert(fsi_get_file_info(fs, "/", &info) == 0 && info.attributes == ATTR_NONE);
+    
+    // Changes set the bit on the node and (for additions and removals) on its directory.
+    assert(fsi_write_file(fs, "/b/docs/a.txt", 0, "second", 6) == 6);
+    assert(fsi_rm_file(fs, "/b/docs/old") == 0);
+    assert(fsi_rmdir_empty(fs, "/b/empty") == 0);
+    assert(fsi_create_file(fs, "/b/pics/p2") == 0);
+    assert(fsi_set_file_attributes(fs, "/b/pics", ATTR_READONLY | ATTR_ARCHIVE) == 0);
+    assert(fsi_mkdir_p(fs, "/b/x/y") == 0);
+    assert(fsi_get_file_info(fs, "/b/docs", &info) == 0 && (info.attributes & ATTR_ARCHIVE));
+    assert(fsi_get_file_info(fs, "/b/pics/p1", &info) == 0 && !(info.attributes & ATTR_ARCHIVE));
+    assert(fsi_read_file(fs, "/b/pics/p1", 0, back, 10) == 10); // Reading is not a change.
+    assert(fsi_get_file_info(fs, "/b/pics/p1", &info) == 0 && !(info.attributes & ATTR_ARCHIVE));
+    
+    // The delta leaves out the unchanged big file, and restores to the same tree.
+    assert(fsi_export_delta(fs, delta1) == 0);
+    assert(file_bytes(delta1) < (long)sizeof(big) / 4);
+    assert(fsi_load(fs, delta1) == -1); // Not a whole tree.
+    fs_t *r = fs_new();
+    assert(r);
+    assert(fsi_apply_delta(r, delta0) == 0 && fsi_apply_delta(r, delta1) == 0);
+    char buf[8] = {0};
+    assert(fsi_read_file(r, "/b/docs/a.txt", 0, buf, sizeof(buf)) == 6 && memcmp(buf, "second", 6) == 0);
+    assert(fsi_read_file(r, "/b/pics/p1", 0, back, sizeof(back)) == (ssize_t)sizeof(back) && memcmp(big, back, sizeof(big)) == 0);
+    assert(fsi_get_file_info(r, "/b/docs/old", &info) == -1 && fsi_get_file_info(r, "/b/empty", &info) == -1);
+    assert(fsi_get_file_info(r, "/b/x/y", &info) == 0 && fsi_get_file_info(r, "/b/pics/p2", &info) == 0);
+    file_info_t orig;
+    assert(fsi_get_file_info(r, "/b/pics", &info) == 0 && fsi_get_file_info(fs, "/b/pics", &orig) == 0);
+    assert(info.attributes == ATTR_READONLY && orig.attributes == ATTR_READONLY && info.child_count == 2);
+    assert(info.modified == orig.modified && info.created == orig.created);
+    printf("✓ Deltas hold only changed nodes and restore the tree in order\n");
+    
+    // Nothing changed: an empty delta that applies cleanly. The bits survive an image too.
+    assert(fsi_export_delta(fs, delta2) == 0);
+    assert(file_bytes(delta2) < 512);
+    assert(fsi_apply_delta(r, delta2) == 0);
+    assert(fsi_touch_file(fs, "/b/x/y") == 0);
+    assert(fsi_set_file_attributes(fs, "/b/docs/a.txt", ATTR_HIDDEN) == 0); // A change: the bit is set.
+    assert(fsi_get_file_info(fs, "/b/docs/a.txt", &info) == 0 && info.attributes == (ATTR_HIDDEN | ATTR_ARCHIVE));
+    assert(fsi_save(fs, image) == 0);
+    fs_t *loaded = fs_new();
+    assert(loaded && fsi_map(loaded, image) == 0);
+    assert(fsi_export_delta(loaded, delta2) == 0);
+    assert(fsi_get_file_info(loaded, "/b/x/y", &info) == 0 && info.attributes == ATTR_NONE);
+    fs_t *empty = fs_new();
+    assert(empty && fsi_apply_delta(empty, delta2) == -1); // Needs the previous backups first.
+    assert(fsi_get_file_info(empty, "/b", &info) == -1);
+    fs_free(empty);
+    assert(fsi_apply_delta(r, delta2) == 0);
+    assert(fsi_get_file_info(r, "/b/x/y", &info) == 0 && fsi_get_file_info(fs, "/b/x/y", &orig) == 0);
+    assert(info.modified == orig.modified);
+    assert(fsi_get_file_info(r, "/b/docs/a.txt", &info) == 0 && info.attributes == ATTR_HIDDEN);
+    printf("✓ Unchanged trees export empty deltas, and the archive bits survive images\n");
+    
+    // An export that cannot be written puts back the bits it cleared, and only those.
+    assert(fsi_export_delta(fs, delta2) == 0);
+    assert(fsi_touch_file(fs, "/b/x/y") == 0);
+    assert(fsi_export_delta(fs, "/nonexistent/dir/delta") == -1);
+    assert(fsi_get_file_info(fs, "/b/x/y", &info) == 0 && info.attributes == ATTR_ARCHIVE);
+    assert(fsi_get_file_info(fs, "/b/x", &info) == 0 && info.attributes == ATTR_NONE);
+    assert(fsi_get_file_info(fs, "/b/pics", &info) == 0 && info.attributes == ATTR_READONLY);
+    assert(fsi_export_delta(fs, delta2) == 0);
+    assert(fsi_get_file_info(fs, "/b/x/y", &info) == 0 && info.attributes == ATTR_NONE);
+    printf("✓ A failed export leaves the changes flagged as they were\n");
+    
+    // One entry added to and one removed from a big directory are a record each, not a listing;
+    // a name removed and made again is removed before it comes back.
+    char name[32];
+    assert(fsi_mkdir_p(fs, "/b/many") == 0);
+    for (int i = 0; i < 2000; i++) {
+        snprintf(name, sizeof(name), "/b/many/f%d", i);
+        assert(fsi_create_file(fs, name) == 0);
+    }
+    assert(fsi_write_file(fs, "/b/many/f8", 0, "old", 3) == 3);
+    assert(fsi_export_delta(fs, delta2) == 0 && fsi_apply_delta(r, delta2) == 0);
+    assert(fsi_create_file(fs, "/b/many/new") == 0 && fsi_rm_file(fs, "/b/many/f7") == 0);
+    assert(fsi_rm_file(fs, "/b/many/f8") == 0 && fsi_mkdir_p(fs, "/b/many/f8") == 0);
+    assert(fsi_export_delta(fs, "/nonexistent/dir/delta") == -1); // Keeps the removals for the next.
+    assert(fsi_export_delta(fs, delta2) == 0);
+    assert(file_bytes(delta2) < 1024);
+    assert(fsi_apply_delta(r, delta2) == 0);
+    assert(fsi_get_file_info(r, "/b/many/new", &info) == 0 && fsi_get_file_info(r, "/b/many/f7", &info) == -1);
+    assert(fsi_get_file_info(r, "/b/many/f8", &info) == 0 && info.type == N_DIR);
+    assert(fsi_get_file_info(r, "/b/many", &info) == 0 && info.child_count == 2000);
+    printf("✓ Additions and removals in a big directory are written one record each\n");
+    
+    fs_free(loaded);
+    fs_free(r);
+    fs_free(fs);
+    remove(delta0);
+    remove(delta1);
+    remove(delta2);
+    remove(image);
+}
+
+// Writes the same counter into two files, one after the other, until told to stop.
+typedef struct snapshot_writer {
+    fs_t *fs;
+    int id;
+    int *stop;
+} snapshot_writer_t;
+
+static void *snapshot_worker(void *arg) {
+    snapshot_writer_t *w = arg;
+    char x[32], y[32], tmp[32];
+    snprintf(x, sizeof(x), "/c/x%d", w->id);
+    snprintf(y, sizeof(y), "/c/y%d", w->id);
+    snprintf(tmp, sizeof(tmp), "/c/tmp%d", w->id);
+    for (unsigned i = 1; !__atomic_load_n(w->stop, __ATOMIC_RELAXED); i++) {
+        assert(fsi_write_file(w->fs, x, 0, &i, sizeof(i)) == sizeof(i));
+        assert(fsi_write_file(w->fs, y, 0, &i, sizeof(i)) == sizeof(i));
+        assert(fsi_create_file(w->fs, tmp) == 0 && fsi_rm_file(w->fs, tmp) == 0);
+    }
+    return NULL;
+}
+
+static int count_match(const node_t *node, const char *path, size_t len, void *arg) {
+    (void)node; (void)path; (void)len;
+    (*(int *)arg)++;
+    return 0;
+}
+
+void test_snapshots() {
+    printf("\n=== Testing Snapshots ===\n");
+    
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_test_%d.snap", (int)getpid());
+    
+    fs_t *fs = fs_new();
+    assert(fs);
+    static char big[200000], back[200000];
+    for (size_t i = 0; i < sizeof(big); i++) big[i] = (char)(i * 13);
+    assert(fsi_mkdir_p(fs, "/s/docs") == 0 && fsi_mkdir_p(fs, "/s/empty") == 0);
+    assert(fsi_create_file(fs, "/s/docs/a") == 0 && fsi_write_file(fs, "/s/docs/a", 0, "first", 5) == 5);
+    assert(fsi_create_file(fs, "/s/docs/big") == 0 && fsi_write_file(fs, "/s/docs/big", 0, big, sizeof(big)) == (ssize_t)sizeof(big));
+    assert(fsi_create_file(fs, "/s/keep") == 0 && fsi_create_file(fs, "/s/h") == 0);
+    assert(fsi_create_file(fs, "/s/ra") == 0 && fsi_write_file(fs, "/s/ra", 0, "x", 1) == 1);
+    int fd = fsi_open(fs, "/s/h", 0);
+    assert(fd >= 0 && fsi_pwrite(fs, fd, 0, "handle", 6) == 6);
+    
+    // Every kind of change after the snapshot leaves it as it was.
+    fs_snapshot_t *snap = fsi_snapshot(fs);
+    assert(snap);
+    assert(fsi_write_file(fs, "/s/docs/a", 0, "second!", 7) == 7);
+    assert(fsi_write_file(fs, "/s/docs/big", 70000, "XYZ", 3) == 3);
+    assert(fsi_truncate(fs, "/s/docs/big", 100) == 0);
+    assert(fsi_rm_file(fs, "/s/keep") == 0 && fsi_rmdir_empty(fs, "/s/empty") == 0);
+    assert(fsi_rm_file(fs, "/s/h") == 0 && fsi_pwrite(fs, fd, 0, "HANDLE", 6) == 6);
+    assert(fsi_mkdir_p(fs, "/s/new/dir") == 0 && fsi_create_file(fs, "/s/docs/c") == 0);
+    assert(fsi_set_file_attributes(fs, "/s/docs", ATTR_HIDDEN) == 0);
+    file_info_t info, before;
+    assert(fs_snapshot_get_file_info(snap, "/s/ra", &before) == 0);
+    assert(fsi_fallocate(fs, "/s/ra", 0, 300000) == 0);
+    assert(fs_snapshot_get_file_info(snap, "/s/ra", &info) == 0 && info.allocated == before.allocated);
+    assert(fsi_get_file_info(fs, "/s/ra", &info) == 0 && info.allocated >= 300000);
+    char buf[16] = {0};
+    assert(fs_snapshot_read_file(snap, "/s/docs/a", 0, buf, sizeof(buf)) == 5 && memcmp(buf, "first", 5) == 0);
+    assert(fs_snapshot_read_file(snap, "s/./docs/../docs/big", 0, back, sizeof(back)) == (ssize_t)sizeof(back));
+    assert(memcmp(big, back, sizeof(big)) == 0);
+    assert(fs_snapshot_read_file(snap, "/s/h", 0, buf, sizeof(buf)) == 6 && memcmp(buf, "handle", 6) == 0);
+    assert(fs_snapshot_get_file_info(snap, "/s/keep", &info) == 0 && info.type == N_FILE);
+    assert(fs_snapshot_get_file_info(snap, "/s/empty", &info) == 0 && info.type == N_DIR);
+    assert(fs_snapshot_get_file_info(snap, "/s/new", &info) == -1 && fs_snapshot_get_file_info(snap, "/s/docs/c", &info) == -1);
+    assert(fs_snapshot_get_file_info(snap, "/s/docs", &info) == 0 && info.child_count == 2 && !(info.attributes & ATTR_HIDDEN));
+    assert(fs_snapshot_get_file_info(snap, "/s/docs/big", &info) == 0 && info.size == sizeof(big));
+    assert(fs_snapshot_read_file(snap, "/s/docs", 0, buf, sizeof(buf)) == -1);
+    assert(fsi_read_file(fs, "/s/docs/a", 0, buf, sizeof(buf)) == 7 && memcmp(buf, "second!", 7) == 0);
+    assert(fsi_get_file_info(fs, "/s/docs/big", &info) == 0 && info.size == 100);
+    assert(fsi_get_file_info(fs, "/s/keep", &info) == -1 && fsi_get_file_info(fs, "/s/docs", &info) == 0 && info.child_count == 3);
+    printf("✓ Snapshots keep what was there as the live tree changes\n");
+    
+    // Searching and saving a snapshot see it whole; the image loads as the old tree.
+    int n = 0;
+    assert(fs_snapshot_search_cb(snap, "", count_match, &n) == 8 && n == 8);
+    assert(fs_snapshot_search_cb(snap, "e", count_match, &(int){0}) == 2); // empty, keep.
+    assert(fsi_search_cb(fs, "e", count_match, &(int){0}) == 1); // new.
+    assert(fs_snapshot_save(snap, image) == 0);
+    assert(fsi_load(fs, image) == -1); // Not while a snapshot is open.
+    fs_t *loaded = fs_new();
+    assert(loaded && fsi_load(loaded, image) == 0);
+    assert(fsi_read_file(loaded, "/s/docs/big", 0, back, sizeof(back)) == (ssize_t)sizeof(back) && memcmp(big, back, sizeof(big)) == 0);
+    assert(fsi_get_file_info(loaded, "/s/keep", &info) == 0 && fsi_get_file_info(loaded, "/s/new", &info) == -1);
+    fs_free(loaded);
+    printf("✓ Snapshots can be searched and saved as images\n");
+    
+    // A later snapshot sees the changes; releasing the first leaves it intact.
+    fs_snapshot_t *later = fsi_snapshot(fs);
+    assert(later);
+    assert(fsi_write_file(fs, "/s/docs/a", 0, "third", 5) == 5);
+    fs_snapshot_release(snap);
+    assert(fs_snapshot_read_file(later, "/s/docs/a", 0, buf, sizeof(buf)) == 7 && memcmp(buf, "second!", 7) == 0);
+    assert(fs_snapshot_read_file(later, "/s/h", 0, buf, sizeof(buf)) == -1);
+    assert(fs_snapshot_get_file_info(later, "/s/new/dir", &info) == 0);
+    assert(fsi_close(fs, fd) == 0);
+    fs_snapshot_release(later);
+    printf("✓ Snapshots are independent of each other\n");
+    
+    // Writers keep going while snapshots are taken, read and released: each sees a consistent cut.
+    assert(fsi_mkdir_p(fs, "/c") == 0);
+    int stop = 0;
+    snapshot_writer_t ws[2];
+    pthread_t threads[2];
+    for (int t = 0; t < 2; t++) {
+        snprintf(buf, sizeof(buf), "/c/x%d", t);
+        assert(fsi_create_file(fs, buf) == 0);
+        snprintf(buf, sizeof(buf), "/c/y%d", t);
+        assert(fsi_create_file(fs, buf) == 0);
+        ws[t] = (snapshot_writer_t){ fs, t, &stop };
+        assert(pthread_create(&threads[t], NULL, snapshot_worker, &ws[t]) == 0);
+    }
+    for (int round = 0; round < 200; round++) {
+        fs_snapshot_t *s = fsi_snapshot(fs);
+        assert(s);
+        for (int t = 0; t < 2; t++) {
+            unsigned x = 0, y = 0;
+            snprintf(buf, sizeof(buf), "/c/y%d", t);
+            assert(fs_snapshot_read_file(s, buf, 0, &y, sizeof(y)) >= 0);
+            snprintf(buf, sizeof(buf), "/c/x%d", t);
+            assert(fs_snapshot_read_file(s, buf, 0, &x, sizeof(x)) >= 0);
+            assert(x == y || x == y + 1);
+        }
+        fs_snapshot_release(s);
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < 2; t++) pthread_join(threads[t], NULL);
+    printf("✓ Snapshots taken under concurrent writes are consistent\n");
+    
+    fs_free(fs);
+    remove(image);
+}
+
 int main() {
     printf("File System Metadata Tests\n");
     printf("=========================================\n");
@@ -300,6 +1735,30 @@ int main() {
     test_timestamp_precision();
     test_large_file_metadata();
     test_directory_access_tracking();
+    test_large_directory();
+    test_node_layout();
+    test_node_pools();
+    test_lookup_cache();
+    test_long_paths();
+    test_open_handles();
+    test_sparse_files();
+    test_read_views();
+    test_vectored_io();
+    test_truncate_fallocate();
+    test_append();
+    test_inline_files();
+    test_concurrent_access();
+    test_instances();
+    test_sessions();
+    test_lockfree_lookups();
+    test_parallel_search();
+    test_search_callback();
+    test_name_index();
+    test_images();
+    test_mapped_images();
+    test_journal();
+    test_incremental_backup();
+    test_snapshots();
     cleanup_test_data();
     
     printf("\nAll Tests Completed Successfully! \n");